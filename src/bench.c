@@ -0,0 +1,546 @@
+// Benchmarks of the editor, built and run by "make bench". The editor is
+// compiled in whole with its "main" left out, so the benchmarks can reach
+// any part of it.
+#include "milli.c"
+
+#include <limits.h>
+#include <sys/wait.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_CYCLES() __rdtsc()
+#else
+#define BENCH_CYCLES() 0 // no cycle counter to read, only throughput is shown
+#endif
+
+/***                                  DEFINES                             ***/
+#define BENCH_CODE_LINES 200000
+#define BENCH_LOG_LINES 500000
+#define BENCH_LONG_LINES 2000
+#define BENCH_LONG_LINE_LEN 5000
+#define BENCH_PAGES 200 // pages moved down into a file before editing it
+#define BENCH_TYPED_LINES 50
+#define BENCH_TYPED_LINE_LEN 40
+#define BENCH_DELETES 1000
+#define BENCH_SAVES 3
+#define BENCH_KEYWORD_LINES 100000
+#define BENCH_COMMENT_BLOCKS 20000
+#define BENCH_MICRO_NS 300000000ULL // time each microbenchmark keeps repeating for
+#define BENCH_MICRO_PASSES 3 // passes each one is timed over at least
+#define BENCH_HEAD_ROWS 1000 // rows inserted at the head of the file per pass
+#define BENCH_DRAW_ROWS 50
+#define BENCH_DRAW_COLS 200
+
+/***                                  DATA                                ***/
+
+// synthetic files the benchmarks run against
+typedef struct bench_corpus {
+  CONST_CHAR_PTR name;
+  void (*write)(FILE* fp);
+} bench_corpus;
+
+// one of the hot paths of the editor, timed on its own over a corpus
+typedef struct bench_micro {
+  CONST_CHAR_PTR name;
+  CONST_CHAR_PTR corpus; // file opened first, by name
+  void (*setup)(void); // may be NULL
+  size_t (*run)(void); // one pass, returns the bytes it went through
+} bench_micro;
+
+// text search queries, typed key by key
+CONST_CHAR_PTR BENCH_QUERIES[] = { "return", "x12345", "needle", "/* comment */", "0x1f" };
+
+CONST_CHAR_PTR BENCH_WORDS[] = { "int", "char", "return", "if", "else", "while", "for", "struct",
+  "static", "value", "count", "buffer", "index", "size", "next", "node", "error", "offset" };
+
+// words the highlighter knows, for keyword-dense code
+CONST_CHAR_PTR BENCH_KEYWORDS[] = { "int", "char", "return", "if", "else", "while", "for", "struct",
+  "static", "switch", "case", "break", "unsigned", "const", "void", "double", "long", "typedef" };
+
+/***                                  FUNCTION PROTOTYPES                 ***/
+u_int32_t
+benchRandom(void);
+CONST_CHAR_PTR
+benchWord(void);
+void benchWriteCode(FILE* fp);
+void benchWriteLog(FILE* fp);
+void benchWriteLong(FILE* fp);
+void benchWriteKeywords(FILE* fp);
+void benchWriteComments(FILE* fp);
+size_t
+benchWriteCorpus(CONST_CHAR_PTR dir, bench_corpus* corpus);
+void benchWait(pid_t pid);
+void benchKeys(struct abuf* keys, CONST_CHAR_PTR key, int32_t times);
+void benchWriteKeys(CONST_CHAR_PTR path);
+void benchReplay(CONST_CHAR_PTR keys, CONST_CHAR_PTR path);
+void benchReplayCorpora(CONST_CHAR_PTR dir);
+size_t
+benchFileBytes(void);
+size_t
+benchHighlight(void);
+size_t
+benchCommentToggle(void);
+void benchDrawSetup(void);
+void benchDrawWideSetup(void);
+size_t
+benchDraw(void);
+size_t
+benchInsertHead(void);
+size_t
+benchSave(void);
+void benchMicro(CONST_CHAR_PTR dir, bench_micro* micro);
+void benchMicros(CONST_CHAR_PTR dir);
+
+/***                                  CORPORA                             ***/
+
+// xorshift32 with a fixed seed: every run generates the same files
+u_int32_t
+benchRandom(void)
+{
+  static u_int32_t state = 0x2545f491;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+CONST_CHAR_PTR
+benchWord(void)
+{
+  return BENCH_WORDS[benchRandom() % (sizeof(BENCH_WORDS) / sizeof(BENCH_WORDS[0]))];
+}
+
+// C code: indented, keyword dense, with strings, numbers and comments, some
+// of them spanning lines
+void benchWriteCode(FILE* fp)
+{
+  for (int32_t i = 0; i < BENCH_CODE_LINES; ++i) {
+    int32_t depth = benchRandom() % 4;
+    for (int32_t d = 0; d < depth; ++d) {
+      fputc('\t', fp);
+    }
+
+    switch (benchRandom() % 6) {
+    case 0:
+      fprintf(fp, "%s x%d = %s(%d, \"%s %d\"); /* comment */\n", benchWord(), i, benchWord(), i, benchWord(), i);
+      break;
+    case 1:
+      fprintf(fp, "if (%s && %s[%d]) { return 0x%x; }\n", benchWord(), benchWord(), i % 97, i);
+      break;
+    case 2:
+      fprintf(fp, "// %s %s %s %d\n", benchWord(), benchWord(), benchWord(), i);
+      break;
+    case 3:
+      fprintf(fp, "/* %s\n * %s %d\n */\n", benchWord(), benchWord(), i);
+      i += 2;
+      break;
+    case 4:
+      fprintf(fp, "while (%s < %d.%d) { %s++; }\n", benchWord(), i, i % 10, benchWord());
+      break;
+    default:
+      fprintf(fp, "%s %s(%s %s, %s* %s);\n", benchWord(), benchWord(), benchWord(), benchWord(), benchWord(), benchWord());
+      break;
+    }
+  }
+}
+
+// a server log: many short plain lines
+void benchWriteLog(FILE* fp)
+{
+  for (int32_t i = 0; i < BENCH_LOG_LINES; ++i) {
+    fprintf(fp, "2024-01-%02d %02d:%02d:%02d.%03d [%s] worker-%d: %s %s after %u ms\n",
+        1 + i / 86400 % 28, i / 3600 % 24, i / 60 % 60, i % 60, benchRandom() % 1000,
+        (benchRandom() % 8) ? "info" : "warn", benchRandom() % 16, benchWord(), benchWord(),
+        benchRandom() % 5000);
+  }
+}
+
+// few but very long lines, the kind minified files have
+void benchWriteLong(FILE* fp)
+{
+  for (int32_t i = 0; i < BENCH_LONG_LINES; ++i) {
+    int32_t len = 0;
+    while (len < BENCH_LONG_LINE_LEN) {
+      len += fprintf(fp, "%s(%u),", benchWord(), benchRandom() % 100000);
+    }
+    fputc('\n', fp);
+  }
+}
+
+// code made of nothing but keywords and types, every word a table lookup
+void benchWriteKeywords(FILE* fp)
+{
+  for (int32_t i = 0; i < BENCH_KEYWORD_LINES; ++i) {
+    for (int32_t j = 0; j < 10; ++j) {
+      fprintf(fp, "%s%s", j ? " " : "", BENCH_KEYWORDS[benchRandom() % (sizeof(BENCH_KEYWORDS) / sizeof(BENCH_KEYWORDS[0]))]);
+    }
+    fputc('\n', fp);
+  }
+}
+
+// long comment blocks, with comment markers hidden in strings and line
+// comments in between to keep the lexer guessing
+void benchWriteComments(FILE* fp)
+{
+  for (int32_t i = 0; i < BENCH_COMMENT_BLOCKS; ++i) {
+    fprintf(fp, "/* %s %s\n", benchWord(), benchWord());
+    for (int32_t j = benchRandom() % 8; j > 0; --j) {
+      fprintf(fp, " * %s \"*/ %s /*\" %d\n", benchWord(), benchWord(), j);
+    }
+    fprintf(fp, " */\nchar* s%d = \"/* not a comment */\"; // /* nor this */\n", i);
+  }
+}
+
+// Writes a corpus into a directory and returns its size
+size_t
+benchWriteCorpus(CONST_CHAR_PTR dir, bench_corpus* corpus)
+{
+  char path[PATH_MAX] = { '\0' };
+  snprintf(path, sizeof(path), "%s/%s", dir, corpus->name);
+
+  FILE* fp = fopen(path, "w");
+  if (!fp) {
+    HANDLE_ERR("fopen")
+  }
+  corpus->write(fp);
+  long size = ftell(fp);
+  if (fclose(fp) == EOF) {
+    HANDLE_ERR("fclose")
+  }
+
+  return size;
+}
+
+// Waits for a benchmark's child process, which printed its own results
+void benchWait(pid_t pid)
+{
+  int32_t status = 0;
+  if (waitpid(pid, &status, 0) == -1) {
+    HANDLE_ERR("waitpid")
+  }
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+    printf("benchmark failed\n");
+  }
+}
+
+/***                                  REPLAY                              ***/
+
+// Appends a key to a recording a number of times
+void benchKeys(struct abuf* keys, CONST_CHAR_PTR key, int32_t times)
+{
+  for (int32_t i = 0; i < times; ++i) {
+    abAppend(keys, key, strlen(key));
+  }
+}
+
+// Records the session replayed over every file: paging down into it, typing
+// lines, deleting, paging back up, searching and saving
+void benchWriteKeys(CONST_CHAR_PTR path)
+{
+  struct abuf keys = { NULL, 0, 0 };
+
+  benchKeys(&keys, "\x1b[6~", BENCH_PAGES);
+  for (int32_t i = 0; i < BENCH_TYPED_LINES; ++i) {
+    for (int32_t len = 0; len < BENCH_TYPED_LINE_LEN;) {
+      CONST_CHAR_PTR word = benchWord();
+      benchKeys(&keys, word, 1);
+      benchKeys(&keys, " ", 1);
+      len += strlen(word) + 1;
+    }
+    benchKeys(&keys, "\r", 1);
+  }
+  benchKeys(&keys, "\x7f", BENCH_DELETES);
+  benchKeys(&keys, "\x1b[5~", BENCH_PAGES / 2);
+
+  for (size_t i = 0; i < sizeof(BENCH_QUERIES) / sizeof(BENCH_QUERIES[0]); ++i) {
+    benchKeys(&keys, "\x06", 1);
+    benchKeys(&keys, BENCH_QUERIES[i], 1);
+    benchKeys(&keys, "\r", 1);
+  }
+
+  for (int32_t i = 0; i < BENCH_SAVES; ++i) {
+    benchKeys(&keys, "x\x13", 1);
+  }
+
+  FILE* fp = fopen(path, "w");
+  if (!fp || fwrite(keys.buffer, 1, keys.len, fp) != keys.len || fclose(fp) == EOF) {
+    HANDLE_ERR("fopen")
+  }
+
+  abFree(&keys);
+}
+
+// Replays a recording over a file in a child process, which prints the
+// timings as it exits and leaves this one's editor state alone
+void benchReplay(CONST_CHAR_PTR keys, CONST_CHAR_PTR path)
+{
+  fflush(stdout);
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    HANDLE_ERR("fork")
+  }
+
+  if (pid == 0) {
+    editorReplayLoad(keys);
+    initEditor();
+    edt_conf.buf->fname = strdup(path);
+    editorOpen();
+    editorReplay();
+  }
+
+  benchWait(pid);
+}
+
+// Generates each corpus and replays the session over it
+void benchReplayCorpora(CONST_CHAR_PTR dir)
+{
+  bench_corpus corpora[] = {
+    { "code.c", benchWriteCode },
+    { "log.txt", benchWriteLog },
+    { "long.txt", benchWriteLong },
+  };
+
+  char keys[PATH_MAX] = { '\0' };
+  snprintf(keys, sizeof(keys), "%s/keys", dir);
+  benchWriteKeys(keys);
+
+  for (size_t i = 0; i < sizeof(corpora) / sizeof(corpora[0]); ++i) {
+    char path[PATH_MAX] = { '\0' };
+    snprintf(path, sizeof(path), "%s/%s", dir, corpora[i].name);
+
+    size_t size = benchWriteCorpus(dir, corpora + i);
+    printf("\nreplay: %s, %.1f MB\n", corpora[i].name, size / (1024.0 * 1024.0));
+    benchReplay(keys, path);
+    unlink(path);
+  }
+
+  unlink(keys);
+}
+
+/***                                  MICROBENCHMARKS                     ***/
+
+// Adds up the bytes of every row
+size_t
+benchFileBytes(void)
+{
+  size_t bytes = 0;
+  for (edt_row* row = editorRowAt(0); row; row = editorRowNext(row)) {
+    bytes += row->size;
+  }
+
+  return bytes;
+}
+
+// Drops every row's caches and colors the whole file again, the way rows
+// get drawn for the first time
+size_t
+benchHighlight(void)
+{
+  for (edt_row* row = editorRowAt(0); row; row = editorRowNext(row)) {
+    editorUpdateRow(row);
+  }
+
+  size_t bytes = 0;
+  for (edt_row* row = editorRowAt(0); row; row = editorRowNext(row)) {
+    editorRowHighlight(row);
+    bytes += row->size;
+  }
+
+  return bytes;
+}
+
+// Opens a comment on the first line and takes it out again, each time letting
+// the highlighter carry the change through the rest of the file
+size_t
+benchCommentToggle(void)
+{
+  static size_t bytes = 0;
+  if (!bytes) {
+    bytes = benchFileBytes();
+  }
+
+  edt_row* row = editorRowAt(0);
+  editorRowInsertStr(row, 0, "/*", 2);
+  editorSyntaxCatchUp(INT32_MAX, INT32_MAX);
+  editorRowDelStr(row, 0, 2);
+  editorSyntaxCatchUp(INT32_MAX, INT32_MAX);
+
+  return 2 * bytes;
+}
+
+// A big terminal looking at the middle of the file
+void benchDrawSetup(void)
+{
+  edt_conf.term_rows = BENCH_DRAW_ROWS - 2;
+  edt_conf.term_cols = BENCH_DRAW_COLS;
+  edt_conf.buf->row_off = edt_conf.buf->num_rows / 2;
+  editorScreenResize(BENCH_DRAW_ROWS, BENCH_DRAW_COLS);
+}
+
+// Same, scrolled far to the right
+void benchDrawWideSetup(void)
+{
+  benchDrawSetup();
+  edt_conf.buf->col_off = BENCH_LONG_LINE_LEN / 2;
+}
+
+// Composes a full screen of rows and flushes all of it, returning the bytes
+// sent
+size_t
+benchDraw(void)
+{
+  struct abuf* ab = &edt_conf.screen.out;
+  abReset(ab);
+  editorScreenInvalidate();
+  editorScreenClear();
+  editorDrawRows();
+  editorScreenFlush(ab);
+
+  return ab->len;
+}
+
+// Inserts rows at the very top of the file
+size_t
+benchInsertHead(void)
+{
+  char line[] = "\tint x = foo(1, \"str\"); /* comment */ if (a && b) { return 0x1f; }";
+  for (int32_t i = 0; i < BENCH_HEAD_ROWS; ++i) {
+    editorInsertRow(0, line, sizeof(line) - 1);
+  }
+
+  return BENCH_HEAD_ROWS * (sizeof(line) - 1);
+}
+
+// Saves the file and waits for the write to land
+size_t
+benchSave(void)
+{
+  editorSave();
+  editorSavePoll(1);
+
+  struct stat st;
+  if (stat(edt_conf.buf->fname, &st) == -1) {
+    HANDLE_ERR("stat")
+  }
+
+  return st.st_size;
+}
+
+// Times a microbenchmark in a child process over its corpus: one pass to
+// warm up, then as many as fit its time budget
+void benchMicro(CONST_CHAR_PTR dir, bench_micro* micro)
+{
+  fflush(stdout);
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    HANDLE_ERR("fork")
+  }
+
+  if (pid == 0) {
+    char path[PATH_MAX] = { '\0' };
+    snprintf(path, sizeof(path), "%s/%s", dir, micro->corpus);
+
+    // headless, as in a replay
+    edt_conf.replay.active = 1;
+    initEditor();
+    edt_conf.buf->fname = strdup(path);
+    editorOpen();
+    edt_conf.buf->undo.paused = 1;
+    if (micro->setup) {
+      micro->setup();
+    }
+
+    micro->run();
+
+    size_t bytes = 0;
+    int32_t passes = 0;
+    u_int64_t start = editorClockNs();
+    u_int64_t cycles = BENCH_CYCLES();
+    u_int64_t elapsed = 0;
+    do {
+      bytes += micro->run();
+      elapsed = editorClockNs() - start;
+    } while (++passes < BENCH_MICRO_PASSES || elapsed < BENCH_MICRO_NS);
+    cycles = BENCH_CYCLES() - cycles;
+
+    printf("%-24s %-12s %10.1f", micro->name, micro->corpus, bytes / (elapsed / 1e9) / (1024.0 * 1024.0));
+    if (cycles) {
+      printf(" %12.2f\n", (double)cycles / bytes);
+    } else {
+      printf(" %12s\n", "-");
+    }
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+  }
+
+  benchWait(pid);
+}
+
+// Generates the corpora of the microbenchmarks and runs them
+void benchMicros(CONST_CHAR_PTR dir)
+{
+  bench_corpus corpora[] = {
+    { "code.c", benchWriteCode },
+    { "keywords.c", benchWriteKeywords },
+    { "comments.c", benchWriteComments },
+    { "long.c", benchWriteLong },
+    { "log.txt", benchWriteLog },
+  };
+
+  bench_micro micros[] = {
+    { "highlight", "code.c", NULL, benchHighlight },
+    { "highlight", "keywords.c", NULL, benchHighlight },
+    { "highlight", "comments.c", NULL, benchHighlight },
+    { "highlight", "long.c", NULL, benchHighlight },
+    { "comment-toggle", "keywords.c", NULL, benchCommentToggle },
+    { "draw", "code.c", benchDrawSetup, benchDraw },
+    { "draw-scrolled", "long.c", benchDrawWideSetup, benchDraw },
+    { "insert-row-head", "code.c", NULL, benchInsertHead },
+    { "save", "code.c", NULL, benchSave },
+    { "save", "log.txt", NULL, benchSave },
+  };
+
+  for (size_t i = 0; i < sizeof(corpora) / sizeof(corpora[0]); ++i) {
+    benchWriteCorpus(dir, corpora + i);
+  }
+
+  printf("\n%-24s %-12s %10s %12s\n", "micro", "corpus", "MB/s", "cycles/byte");
+  for (size_t i = 0; i < sizeof(micros) / sizeof(micros[0]); ++i) {
+    benchMicro(dir, micros + i);
+  }
+
+  for (size_t i = 0; i < sizeof(corpora) / sizeof(corpora[0]); ++i) {
+    char path[PATH_MAX] = { '\0' };
+    snprintf(path, sizeof(path), "%s/%s", dir, corpora[i].name);
+    unlink(path);
+  }
+}
+
+// Runs every suite, or only the one named: "replay" or "micro"
+int32_t
+main(int32_t argc, CHAR_PTR argv[])
+{
+  CONST_CHAR_PTR suite = (argc >= 2) ? argv[1] : NULL;
+  if (suite && strcmp(suite, "replay") && strcmp(suite, "micro")) {
+    fprintf(stderr, "usage: %s [replay|micro]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  char dir[] = "/tmp/milli-bench-XXXXXX";
+  if (!mkdtemp(dir)) {
+    HANDLE_ERR("mkdtemp")
+  }
+
+  if (!suite || !strcmp(suite, "replay")) {
+    benchReplayCorpora(dir);
+  }
+  if (!suite || !strcmp(suite, "micro")) {
+    benchMicros(dir);
+  }
+  rmdir(dir);
+
+  return EXIT_SUCCESS;
+}
@@ -28,7 +28,10 @@ edt_sytx HLDB[] = {
       "*/",
       C_HL_extensions,
       C_HL_keywords,
-      HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+      HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+      NULL,
+      "\"'",
+      NULL },
 };
 
 /***                                TERMINAL                              ***/
@@ -36,6 +39,9 @@ edt_sytx HLDB[] = {
 // Used for disabling raw mode
 void disableRawMode(void)
 {
+  // stop bracketing pastes
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);
+
   if (-1 == tcsetattr(STDIN_FILENO, TCSAFLUSH, &edt_conf.orig_term_attrs)) {
     HANDLE_ERR("tcsetattr");
   }
@@ -59,103 +65,363 @@ void enableRawMode(void)
   raw.c_oflag = raw.c_oflag & ~(OPOST);
   raw.c_cflag = raw.c_cflag | CS8; // set character size to 8bits.
   raw.c_lflag = raw.c_lflag & ~(ECHO | ICANON | ISIG | IEXTEN);
+  // reads never block, waiting for input is left to poll()
   raw.c_cc[VMIN] = 0; // min no of read characters
-  raw.c_cc[VTIME] = 1; // timeout for reading in milli-secs
+  raw.c_cc[VTIME] = 0; // timeout for reading in tenths of a second
 
   if (-1 == tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw)) {
     HANDLE_ERR("tcsetattr");
   }
+
+  // have the terminal bracket pastes so they can be inserted in one go
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+// Wakes the event loop up: signals are handled there, outside of the handler
+void editorSignalHandler(int32_t sig)
+{
+  (void)sig;
+  int32_t saved_errno = errno;
+  write(edt_conf.signal_pipe[1], "", 1);
+  errno = saved_errno;
+}
+
+// Routes SIGWINCH through a self-pipe the event loop polls alongside input
+void editorInitSignals(void)
+{
+  if (pipe(edt_conf.signal_pipe) == -1) {
+    HANDLE_ERR("pipe")
+  }
+
+  for (int32_t i = 0; i < 2; ++i) {
+    fcntl(edt_conf.signal_pipe[i], F_SETFL, O_NONBLOCK);
+    fcntl(edt_conf.signal_pipe[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = editorSignalHandler;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGWINCH, &action, NULL) == -1) {
+    HANDLE_ERR("sigaction")
+  }
+}
+
+// Picks up the new size of the terminal and redraws everything
+void editorHandleResize(void)
+{
+  char drain[64] = { '\0' };
+  while (read(edt_conf.signal_pipe[0], drain, sizeof(drain)) > 0) {
+  }
+
+  if (getTermWinSize(&edt_conf.term_rows, &edt_conf.term_cols) == -1) {
+    return;
+  }
+
+  edt_conf.term_rows -= 2;
+  if (edt_conf.term_rows < 1) {
+    edt_conf.term_rows = 1;
+  }
+
+  editorScreenInvalidate();
+  editorRefreshScreen();
+}
+
+// Reads whatever the terminal has for us, up to the free room in the input
+// buffer. Returns the number of bytes read, 0 on a timeout and -1 on error.
+ssize_t
+editorInputFill(void)
+{
+  edt_input* input = &edt_conf.input;
+  if (input->start) {
+    memmove(input->buf, input->buf + input->start, input->len);
+    input->start = 0;
+  }
+
+  // a replay hands its recording over as if it was typed
+  if (edt_conf.replay.active) {
+    edt_replay* replay = &edt_conf.replay;
+    size_t room = sizeof(input->buf) - input->len;
+    size_t count = (replay->len - replay->pos < room) ? replay->len - replay->pos : room;
+
+    memcpy(input->buf + input->len, replay->keys + replay->pos, count);
+    replay->pos += count;
+    input->len += count;
+    return count;
+  }
+
+  PERF_COUNT(syscalls);
+  ssize_t nread = read(STDIN_FILENO, input->buf + input->len, sizeof(input->buf) - input->len);
+  if (nread == -1 && (errno == EAGAIN || errno == EINTR)) {
+    return 0;
+  }
+
+  if (nread > 0) {
+    input->len += nread;
+  }
+
+  return nread;
+}
+
+// Sleeps until input comes in, a signal arrives or "timeout" milliseconds
+// pass (-1 waits for ever), and reads the input. Returns the number of bytes
+// read.
+ssize_t
+editorWaitInput(int32_t timeout)
+{
+  if (edt_conf.replay.active) {
+    return editorReplayWait(timeout);
+  }
+
+  struct pollfd fds[2] = {
+    { STDIN_FILENO, POLLIN, 0 },
+    { edt_conf.signal_pipe[0], POLLIN, 0 },
+  };
+
+  PERF_COUNT(syscalls);
+  int32_t ready = poll(fds, 2, timeout);
+  if (ready == -1 && errno != EINTR) {
+    HANDLE_ERR("poll")
+  }
+
+  if (ready <= 0) {
+    return 0;
+  }
+
+  if (fds[1].revents & POLLIN) {
+    editorHandleResize();
+  }
+
+  if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+    return 0;
+  }
+
+  ssize_t nread = editorInputFill();
+  if (nread == -1) {
+    HANDLE_ERR("read")
+  }
+
+  // the terminal went away
+  if (nread == 0 && (fds[0].revents & (POLLHUP | POLLERR))) {
+    exit(EXIT_FAILURE);
+  }
+
+  return nread;
+}
+
+// Tells whether a key is waiting to be processed, without blocking
+u_int8_t
+editorInputPending(void)
+{
+  return edt_conf.input.len || editorWaitInput(0) > 0;
 }
 
-// Reads and returns input keypresses from user
+// Works out how long the event loop may sleep for: for ever, unless rows are
+// waiting for the highlighter, a search is running or a status message is
+// about to expire
 int32_t
-editorReadKey(void)
+editorIdleTimeout(void)
 {
-  int32_t nchar_read = 0;
-  char in_key = '\0';
+  if (edt_conf.buf->rows && edt_conf.buf->rows->dirty) {
+    return 0;
+  }
 
-  // keep reading till u get character
-  for (;;) {
-    nchar_read = read(STDIN_FILENO, &in_key, 1);
+  int32_t timeout = edt_conf.search.running ? SEARCH_POLL_INTERVAL : -1;
+  if (edt_conf.save.running && (timeout == -1 || SAVE_POLL_INTERVAL < timeout)) {
+    timeout = SAVE_POLL_INTERVAL;
+  }
+  if (edt_conf.status_msg[0] && !edt_conf.in_prompt) {
+    time_t left = edt_conf.status_msg_time + STATUS_MSG_TIMEOUT - time(NULL);
+    int32_t expiry = (left > 0) ? left * 1000 : 0;
+    if (timeout == -1 || expiry < timeout) {
+      timeout = expiry;
+    }
+  }
 
-    switch ((nchar_read)) {
-    case -1:
-      if (errno != EAGAIN) {
-        HANDLE_ERR("read")
-      } else {
-        continue;
-      }
+  return timeout;
+}
+
+// Background work done while no key is pending: show search results coming
+// in, take expired status messages down and let the highlighter catch up
+// off-screen
+void editorIdle(void)
+{
+  u_int8_t redraw = editorSearchPoll();
+  redraw |= editorSavePoll(0);
+  if (edt_conf.status_msg[0] && !edt_conf.in_prompt
+      && time(NULL) - edt_conf.status_msg_time >= STATUS_MSG_TIMEOUT) {
+    edt_conf.status_msg[0] = '\0';
+    redraw = 1;
+  }
+
+  if (redraw) {
+    editorRefreshScreen();
+  }
+
+  editorSyntaxIdle();
+}
+
+// Takes the next input byte, waiting a short while for it at most. Returns
+// -1 when none came.
+int32_t
+editorInputByte(void)
+{
+  edt_input* input = &edt_conf.input;
+  if (!input->len && editorWaitInput(ESC_SEQ_TIMEOUT) <= 0) {
+    return -1;
+  }
+
+  --input->len;
+  return (BYTE)input->buf[input->start++];
+}
+
+// Decodes the escape sequence following an "ESC" byte. A lone "ESC" is
+// returned as such and anything unknown after it is left for the next key.
+int32_t
+editorDecodeEscape(void)
+{
+  int32_t lead = editorInputByte();
+  if (lead != '[' && lead != 'O') {
+    if (lead >= 0) {
+      ++edt_conf.input.len;
+      --edt_conf.input.start;
+    }
+    return '\x1b';
+  }
 
+  // CSI: parameters, of which only the first one matters, then a final byte
+  int32_t param = 0;
+  int32_t ch = editorInputByte();
+  for (u_int8_t first = 1; (ch >= '0' && ch <= '9') || ch == ';'; ch = editorInputByte()) {
+    if (ch == ';') {
+      first = 0;
+    } else if (first) {
+      param = param * 10 + (ch - '0');
+    }
+  }
+
+  if (ch == '~' && lead == '[') {
+    // Handle HOME, END, PAGE UP and DOWN keys, and pastes
+    switch (param) {
     case 1:
-      if (in_key == '\x1b') { // special keys
-        char seq[3] = { '\0' };
+    case 7:
+      return HOME_KEY;
+    case 3:
+      return DEL_KEY;
+    case 4:
+    case 8:
+      return END_KEY;
+    case 5:
+      return PAGE_UP;
+    case 6:
+      return PAGE_DOWN;
+    case 200:
+      return PASTE_START;
+    case 201:
+      return PASTE_END;
+    }
 
-        if (read(STDIN_FILENO, seq, 1) != 1) {
-          return '\x1b';
-        }
+    return '\x1b';
+  }
 
-        if (read(STDIN_FILENO, (seq + 1), 1) != 1) {
-          return '\x1b';
-        }
+  // Handle arrow keys
+  switch (ch) {
+  case 'A':
+    return ARROW_UP;
+  case 'B':
+    return ARROW_DOWN;
+  case 'C':
+    return ARROW_RIGHT;
+  case 'D':
+    return ARROW_LEFT;
+  case 'H':
+    return HOME_KEY;
+  case 'F':
+    return END_KEY;
+  }
 
-        if (seq[0] == '[') {
-          if (seq[1] >= '0' && seq[1] <= '9') {
-            if (read(STDIN_FILENO, (seq + 2), 1) != 1) {
-              return '\x1b';
-            }
-
-            // Handle HOME, ENDPAGE UP and DOWN keys
-            if (seq[2] == '~') {
-              switch (seq[1]) {
-              case '1':
-                return HOME_KEY;
-              case '3':
-                return DEL_KEY;
-              case '4':
-                return END_KEY;
-              case '5':
-                return PAGE_UP;
-              case '6':
-                return PAGE_DOWN;
-              case '7':
-                return HOME_KEY;
-              case '8':
-                return END_KEY;
-              }
-            }
-          } else {
-            // Handle arrow keys
-            switch (seq[1]) {
-            case 'A':
-              return ARROW_UP;
-            case 'B':
-              return ARROW_DOWN;
-            case 'C':
-              return ARROW_RIGHT;
-            case 'D':
-              return ARROW_LEFT;
-            case 'H':
-              return HOME_KEY;
-            case 'F':
-              return END_KEY;
-            }
-          }
-        } else if (seq[0] == 'O') {
-          switch (seq[1]) {
-          case 'H':
-            return HOME_KEY;
-          case 'F':
-            return END_KEY;
-          }
-        }
+  return '\x1b';
+}
 
-        return '\x1b';
-      } else {
-        // other non-special keys
-        return in_key;
+// Reads and returns input keypresses from user. Input is read in blocks
+// and keys are decoded from the buffer.
+int32_t
+editorReadKey(void)
+{
+  // sleep till a key comes in, waking up only for pending background work
+  while (!edt_conf.input.len) {
+    if (editorWaitInput(editorIdleTimeout()) == 0) {
+      editorIdle();
+    }
+  }
+
+  // keys typed in a prompt wait on what the previous ones set off as well
+  if (edt_conf.replay.active) {
+    editorReplaySettle();
+  }
+
+  int32_t in_key = editorInputByte();
+  return (in_key == '\x1b') ? editorDecodeEscape() : in_key;
+}
+
+// Collects the text of a bracketed paste, up to its end marker. Returns it
+// as a heap string of "len" bytes.
+CHAR_PTR
+editorReadPaste(size_t* len)
+{
+  static CONST_CHAR_PTR end_marker = "\x1b[201~";
+  edt_input* input = &edt_conf.input;
+  size_t cap = INPUT_BUF_SIZE;
+  CHAR_PTR text = malloc(cap);
+  size_t matched = 0; // bytes of the end marker seen so far
+  int32_t waits = 0;
+
+  *len = 0;
+  while (matched < strlen(end_marker)) {
+    if (!input->len) {
+      if (editorWaitInput(ESC_SEQ_TIMEOUT) <= 0 && ++waits > PASTE_MAX_WAITS) {
+        break;
+      }
+      continue;
+    }
+
+    if (*len + input->len + strlen(end_marker) > cap) {
+      while (*len + input->len + strlen(end_marker) > cap) {
+        cap *= 2;
       }
+      text = realloc(text, cap);
+    }
+
+    // text up to the next "ESC" can't be part of the marker
+    CONST_CHAR_PTR p = input->buf + input->start;
+    CONST_CHAR_PTR esc = matched ? p : memchr(p, '\x1b', input->len);
+    size_t plain = esc ? (size_t)(esc - p) : input->len;
+    memcpy(text + *len, p, plain);
+    *len += plain;
+    input->start += plain;
+    input->len -= plain;
+    if (!input->len) {
+      continue;
+    }
+
+    char ch = input->buf[input->start++];
+    --input->len;
+    if (ch == end_marker[matched]) {
+      ++matched;
+      continue;
+    }
+
+    // a false start: what looked like the marker was text after all
+    memcpy(text + *len, end_marker, matched);
+    *len += matched;
+    matched = (ch == end_marker[0]);
+    if (!matched) {
+      text[(*len)++] = ch;
     }
   }
+
+  return text;
 }
 
 // Gets the current cursor position in the terminal interface
@@ -170,8 +436,10 @@ getCursorPosition(INT_PTR rows, INT_PTR cols)
     return -1;
   }
 
+  // reads don't block, so wait for each byte of the answer
+  struct pollfd in = { STDIN_FILENO, POLLIN, 0 };
   for (; i < sizeof(buf) - 1; ++i) {
-    if ((read(STDIN_FILENO, &buf[i], 1) != 1) || buf[i] == 'R') {
+    if (poll(&in, 1, TERM_REPLY_TIMEOUT) <= 0 || (read(STDIN_FILENO, &buf[i], 1) != 1) || buf[i] == 'R') {
       break;
     }
   }
@@ -198,6 +466,16 @@ getTermWinSize(INT_PTR rows, INT_PTR cols)
 {
   struct winsize ws = { 0, 0, 0, 0 };
 
+  // replays and batch edits have no terminal, the usual variables may still
+  // size it
+  if (edt_conf.replay.active || edt_conf.batch.active) {
+    CONST_CHAR_PTR lines = getenv("LINES");
+    CONST_CHAR_PTR columns = getenv("COLUMNS");
+    *rows = (lines && atoi(lines) > 2) ? atoi(lines) : REPLAY_ROWS;
+    *cols = (columns && atoi(columns) > 0) ? atoi(columns) : REPLAY_COLS;
+    return 0;
+  }
+
   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
     // query cursor position in a "portable" way. The "C" cmd moves cursor
     // forwards 2 the right and "B" cmd moves the cursor down to the bottom
@@ -224,1083 +502,5957 @@ is_separator(int32_t ch)
   return isspace(ch) || ch == '\0' || strchr("{}'\",.()+-/*=~%%<>[];", ch) != NULL;
 }
 
-// Sets the highlight color for each character in a row
-void editorUpdateSyntax(edt_row* row)
+// Hashes a word(FNV-1a) under a given seed
+u_int32_t
+editorKeywordHash(CONST_CHAR_PTR word, size_t len, u_int32_t seed)
 {
-  row->highlight = realloc(row->highlight, row->rsize);
-  memset(row->highlight, HL_NORMAL, row->rsize);
-
-  // if there's no filetype set
-  if (!edt_conf.syntax) {
-    return;
+  u_int32_t hash = 2166136261u ^ seed;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (BYTE)word[i];
+    hash *= 16777619u;
   }
 
-  CHAR_PTR* keywords = edt_conf.syntax->keywords;
-
-  CHAR_PTR sl_comm = edt_conf.syntax->singleline_comment_start;
-  CHAR_PTR mc_start = edt_conf.syntax->multiline_comment_start;
-  CHAR_PTR mc_end = edt_conf.syntax->multiline_comment_end;
-
-  int8_t sl_comm_len = sl_comm ? strlen(sl_comm) : 0;
-  int8_t mc_start_len = mc_start ? strlen(mc_start) : 0;
-  int8_t mc_end_len = mc_end ? strlen(mc_end) : 0;
+  return hash ^ (hash >> 16);
+}
 
-  int16_t prev_sep = 1;
-  int8_t in_string = 0;
-  int8_t in_ml_comm = (row->index > 0 && edt_conf.row[row->index - 1].hl_open_comment);
+// Compiles a keyword list into a perfect hash table: table sizes and seeds
+// are tried until every keyword lands in a slot of its own. Returns NULL for
+// a list with an empty or too long word, or when no table up to KW_MAX_SLOTS
+// works out, as happens when a word is listed twice.
+kw_table*
+editorCompileKeywords(CHAR_PTR* keywords)
+{
+  kw_table* table = calloc(1, sizeof(kw_table));
+  if (!table) {
+    return NULL;
+  }
 
-  size_t i = 0;
-  while (i < row->rsize) {
-    char ch = row->render[i];
-    BYTE prev_highlight = (i > 0) ? row->highlight[i - 1] : HL_NORMAL;
-
-    // highlight single-line comments
-    if (sl_comm_len && !in_string && !in_ml_comm) {
-      if (!strncmp(row->render + i, sl_comm, sl_comm_len)) {
-        memset(row->highlight + i, HL_COMMENT, row->rsize - i);
-        break;
-      }
+  size_t count = 0;
+  table->min_len = SIZE_MAX;
+  for (; keywords[count]; ++count) {
+    size_t len = strlen(keywords[count]);
+    len -= (len && keywords[count][len - 1] == '|');
+    if (!len || len > KW_MAX_LEN) {
+      SAFE_FREE(table);
+      return NULL;
     }
 
-    // highlight multi-line comments
-    if (mc_start_len && mc_end_len && !in_string) {
-      if (in_ml_comm) {
-        row->highlight[i] = HL_MLCOMMENT;
-        if (!strncmp(row->render + i, mc_end, mc_end_len)) {
-          memset(row->highlight + i, HL_MLCOMMENT, mc_end_len);
-          i += mc_end_len;
-          in_ml_comm = 0;
-          prev_sep = 1;
-          continue;
-        } else {
-          ++i;
-          continue;
-        }
-      } else if (!strncmp(row->render + i, mc_start, mc_start_len)) {
-        memset(row->highlight + i, HL_MLCOMMENT, mc_start_len);
-        i += mc_start_len;
-        in_ml_comm = 1;
-        continue;
-      }
+    if (len < table->min_len) {
+      table->min_len = len;
     }
 
-    // highlight strings
-    if (edt_conf.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (in_string) {
-        row->highlight[i] = HL_STRING;
-
-        if (ch == '\\' && (i + 1) < row->rsize) {
-          row->highlight[i + 1] = HL_STRING;
-          i += 2;
-          continue;
-        }
-
-        if (ch == in_string) {
-          in_string = 0;
-        }
-
-        ++i;
-        prev_sep = 1;
-        continue;
-      } else {
-        if (ch == '"' || ch == '\'') {
-          in_string = ch;
-          row->highlight[i] = HL_STRING;
-          ++i;
-          continue;
-        }
-      }
+    if (len > table->max_len) {
+      table->max_len = len;
     }
+  }
 
-    // highlight numbers
-    if (edt_conf.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(ch) && (prev_sep || prev_highlight == HL_NUMBER)) || (ch == '.' && prev_highlight == HL_NUMBER)) {
-        row->highlight[i] = HL_NUMBER;
-        ++i;
-        prev_sep = 0;
-        continue;
-      }
+  u_int32_t size = 16;
+  while (size < 2 * count) {
+    size <<= 1;
+  }
+
+  for (; size <= KW_MAX_SLOTS; size <<= 1) {
+    kw_slot* slots = realloc(table->slots, size * sizeof(kw_slot));
+    if (!slots) {
+      break;
     }
+    table->slots = slots;
+    table->mask = size - 1;
 
-    // highlight keywords
-    if (prev_sep) {
-      u_int32_t j = 0;
-      for (; keywords[j]; ++j) {
-        size_t keywd_len = strlen(keywords[j]);
-        int32_t keywd_2 = keywords[j][keywd_len - 1] == '|';
+    for (u_int32_t seed = 0; seed < KW_SEED_TRIES; ++seed) {
+      memset(table->slots, 0, size * sizeof(kw_slot));
+      table->seed = seed;
 
-        if (keywd_2) {
-          --keywd_len;
-        }
+      size_t i = 0;
+      for (; i < count; ++i) {
+        size_t len = strlen(keywords[i]);
+        u_int8_t keywd_2 = (keywords[i][len - 1] == '|');
+        len -= keywd_2;
 
-        if (!strncmp(row->render + i, keywords[j], keywd_len) && is_separator(row->render[i + keywd_len])) {
-          memset(
-              row->highlight + i, keywd_2 ? HL_KEYWORD2 : HL_KEYWORD1, keywd_len);
-          i += keywd_len;
+        kw_slot* slot = table->slots + (editorKeywordHash(keywords[i], len, seed) & table->mask);
+        if (slot->word) {
           break;
         }
+
+        slot->word = keywords[i];
+        slot->len = len;
+        slot->hl = keywd_2 ? HL_KEYWORD2 : HL_KEYWORD1;
       }
 
-      if (keywords[j]) {
-        prev_sep = 0;
-        continue;
+      if (i == count) {
+        return table;
       }
     }
-
-    prev_sep = is_separator(ch);
-    ++i;
   }
 
-  u_int8_t changed = (row->hl_open_comment != in_ml_comm);
-  row->hl_open_comment = in_ml_comm;
-  if (changed && row->index + 1 < edt_conf.num_rows) {
-    editorUpdateSyntax(edt_conf.row + (row->index + 1));
-  }
+  SAFE_FREE(table->slots);
+  SAFE_FREE(table);
+  return NULL;
 }
 
-// Maps the editor's possible highlight values to their corresponding ASCII
-// color codes
-int32_t
-editorSyntaxToColor(int32_t hl_value)
+// Returns the highlight class of a word, HL_NORMAL if it isn't a keyword
+BYTE editorKeywordLookup(kw_table* table, CONST_CHAR_PTR word, size_t len)
 {
-  switch (hl_value) {
-  case HL_NUMBER:
-    return 31;
-  case HL_KEYWORD2:
-    return 32;
-  case HL_KEYWORD1:
-    return 33;
-  case HL_MATCH:
-    return 34;
-  case HL_STRING:
-    return 35;
-  case HL_COMMENT:
-  case HL_MLCOMMENT:
-    return 36;
-  default:
-    return 37;
+  if (!table || len < table->min_len || len > table->max_len) {
+    return HL_NORMAL;
   }
-}
 
-// Matches current filename to their respective syntax highlighting
-void editorSelectSyntaxHighlight(void)
-{
-  edt_conf.syntax = NULL;
-  if (!edt_conf.fname) {
-    return;
+  kw_slot* slot = table->slots + (editorKeywordHash(word, len, table->seed) & table->mask);
+  if (slot->word && slot->len == len && !memcmp(slot->word, word, len)) {
+    return slot->hl;
   }
 
-  CHAR_PTR ext = strchr(edt_conf.fname, '.');
-  for (u_int32_t j = 0; j < HLDB_ENTRIES; ++j) {
-    edt_sytx* sytx = HLDB + j;
-
-    u_int32_t i = 0;
-    while (sytx->file_match[i]) {
-      int32_t is_ext = (sytx->file_match[i][0] == '.');
-      if ((is_ext && ext && !strcmp(ext, sytx->file_match[i])) || (!is_ext && strstr(edt_conf.fname, sytx->file_match[i]))) {
-        edt_conf.syntax = sytx;
+  return HL_NORMAL;
+}
 
-        // rehighlight file after setting the syntax highlighting
-        int32_t file_row = 0;
-        for (; file_row < edt_conf.num_rows;
-             editorUpdateSyntax(edt_conf.row + file_row), ++file_row)
-          ;
+// Says how the lexer handles a byte in a state. This is where the rules of
+// highlighting live; the lexer only ever follows the tables built from them.
+lex_cell
+editorLexRule(edt_sytx* syntax, int32_t state, BYTE ch)
+{
+  lex_cell cell = { state, HL_NORMAL, 0 };
+  CHAR_PTR sl_comm = syntax->singleline_comment_start;
+  CHAR_PTR mc_start = syntax->multiline_comment_start;
+  CHAR_PTR mc_end = syntax->multiline_comment_end;
+  u_int8_t ml_comm = mc_start && mc_end && *mc_start && *mc_end;
+
+  if (state == LEX_MLC) {
+    cell.hl = HL_MLCOMMENT;
+    cell.action = (ml_comm && ch == (BYTE)mc_end[0]) ? LEX_CLOSE : 0;
+    return cell;
+  }
 
-        return;
-      }
-      ++i;
+  // strings run to the quote that started them, backslashes escaping
+  if (state >= LEX_STR) {
+    cell.hl = HL_STRING;
+    if (ch == '\\') {
+      cell.action = LEX_ESCAPE;
+    } else if (ch == (BYTE)syntax->quotes[state - LEX_STR]) {
+      cell.next = LEX_SEP;
     }
+    return cell;
   }
-}
 
-/***                                ROW OPERATIONS                         ***/
+  // a comment may start anywhere outside of strings, even inside a word
+  if ((sl_comm && *sl_comm && ch == (BYTE)sl_comm[0]) || (ml_comm && ch == (BYTE)mc_start[0])) {
+    cell.action |= LEX_OPEN;
+  }
 
-int32_t
-editorRowCxToRx(edt_row* row, int32_t cx)
-{
-  int32_t rx = 0x0;
-  int32_t j = 0x0;
-  for (; j < cx; ++j, ++rx) {
-    if (row->chars[j] == '\t') {
-      rx += (MILLI_TAB_STOP - 1) - (rx % MILLI_TAB_STOP);
-    }
+  // only a whole word running from a separator to the next can be a keyword
+  u_int8_t sep = is_separator(ch);
+  if (state == LEX_WORDK && sep) {
+    cell.action |= LEX_LOOKUP;
+  }
+
+  u_int8_t numbers = (syntax->flags & HL_HIGHLIGHT_NUMBERS) != 0;
+  int32_t quotes = (syntax->flags & HL_HIGHLIGHT_STRINGS) && syntax->quotes ? strlen(syntax->quotes) : 0;
+  CONST_CHAR_PTR quote = (ch && quotes) ? memchr(syntax->quotes, ch, (quotes < LEX_MAX_QUOTES) ? quotes : LEX_MAX_QUOTES) : NULL;
+
+  if (quote) {
+    cell.hl = HL_STRING;
+    cell.next = LEX_STR + (quote - syntax->quotes);
+  } else if (numbers && ((isdigit(ch) && (state == LEX_SEP || state == LEX_NUM)) || (ch == '.' && state == LEX_NUM))) {
+    cell.hl = HL_NUMBER;
+    cell.next = LEX_NUM;
+  } else if (sep) {
+    cell.next = LEX_SEP;
+  } else if (state == LEX_SEP) {
+    cell.next = LEX_WORDK;
+    cell.action |= LEX_MARK;
+  } else {
+    cell.next = (state == LEX_WORDK) ? LEX_WORDK : LEX_WORD;
   }
 
-  return rx;
+  return cell;
 }
 
-int32_t
-editorRowRxToCx(edt_row* row, int32_t rx)
+// Compiles the highlighting rules of a syntax into a lexer's tables. Bytes
+// the rules treat alike in every state are folded into one class, which
+// keeps the table small enough to stay in cache.
+lex_table*
+editorCompileLexer(edt_sytx* syntax)
 {
-  int32_t cur_rx = 0x0;
-  int32_t csr_x = 0x0;
-  for (; (size_t)csr_x < row->size; ++csr_x) {
-    if (row->chars[csr_x] == '\t') {
-      cur_rx += (MILLI_TAB_STOP - 1) - (cur_rx % MILLI_TAB_STOP);
+  int32_t quotes = (syntax->flags & HL_HIGHLIGHT_STRINGS) && syntax->quotes ? strlen(syntax->quotes) : 0;
+  int32_t states = LEX_STR + ((quotes < LEX_MAX_QUOTES) ? quotes : LEX_MAX_QUOTES);
+  lex_cell rules[256][LEX_STR + LEX_MAX_QUOTES];
+  BYTE first[256]; // a byte of each class
+
+  lex_table* lexer = calloc(1, sizeof(lex_table));
+  if (!lexer) {
+    HANDLE_ERR("calloc")
+  }
+  lexer->states = states;
+
+  for (int32_t ch = 0; ch < 256; ++ch) {
+    // a byte is quiet for a group of states when it can't open or close a
+    // comment or a string from any of them
+    lexer->quiet[ch] = 0xff;
+    for (int32_t state = 0; state < states; ++state) {
+      rules[ch][state] = editorLexRule(syntax, state, ch);
+
+      lex_cell cell = rules[ch][state];
+      if ((cell.action & (LEX_OPEN | LEX_CLOSE | LEX_ESCAPE)) || LEX_GROUP(cell.next) != LEX_GROUP(state)) {
+        lexer->quiet[ch] &= ~LEX_GROUP(state);
+      }
     }
 
-    ++cur_rx;
-
-    if (cur_rx > rx) {
-      return csr_x;
+    int32_t cls = 0;
+    while (cls < lexer->classes && memcmp(rules[ch], rules[first[cls]], states * sizeof(lex_cell))) {
+      ++cls;
     }
-  }
-
-  return csr_x;
-}
-
-void editorUpdateRow(edt_row* row)
-{
-  u_int16_t tabs = 0x0;
-  size_t j = 0x0;
-  for (; j < row->size; ++j) {
-    if (row->chars[j] == '\t') {
-      ++tabs;
+    if (cls == lexer->classes) {
+      first[lexer->classes++] = ch;
     }
+    lexer->cls[ch] = cls;
   }
 
-  if (row->render) {
-    SAFE_FREE(row->render);
+  lexer->trans = malloc(states * lexer->classes * sizeof(lex_cell));
+  if (!lexer->trans) {
+    HANDLE_ERR("malloc")
   }
 
-  row->render = malloc(row->size + (tabs * (MILLI_TAB_STOP - 1)) + 1);
-
-  size_t index = 0;
-  for (j = 0; j < row->size; ++j) {
-    // rendering tabs
-    if (row->chars[j] == '\t') {
-      row->render[index++] = ' ';
-
-      // print spaces till a tab-stop
-      while (index % MILLI_TAB_STOP != 0x0) {
-        row->render[index++] = ' ';
-      }
-    } else {
-      row->render[index++] = row->chars[j];
+  for (int32_t state = 0; state < states; ++state) {
+    for (int32_t cls = 0; cls < lexer->classes; ++cls) {
+      lexer->trans[state * lexer->classes + cls] = rules[first[cls]][state];
     }
   }
 
-  row->render[index] = '\0';
-  row->rsize = index;
-
-  editorUpdateSyntax(row);
+  return lexer;
 }
 
-void editorInsertRow(int32_t at, CHAR_PTR s, size_t len)
+// Releases the tables compiled for a syntax, and everything else in it if it
+// was loaded from a file
+void editorFreeSyntax(edt_sytx* syntax, u_int8_t loaded)
 {
-  if (at < 0 || at > edt_conf.num_rows) {
-    return;
+  if (syntax->keyword_table) {
+    SAFE_FREE(syntax->keyword_table->slots);
+    SAFE_FREE(syntax->keyword_table);
   }
 
-  edt_conf.row = realloc(edt_conf.row, sizeof(edt_row) * (edt_conf.num_rows + 1));
-  memmove(edt_conf.row + (at + 1),
-      edt_conf.row + at,
-      sizeof(edt_row) * (edt_conf.num_rows - at));
-
-  int32_t j = at + 1;
-  for (; j < edt_conf.num_rows; ++edt_conf.row[j].index, ++j)
-    ;
-
-  edt_conf.row[at].index = at;
-
-  // store new row, s, into our editor's row buffer
-  edt_conf.row[at].size = len;
-  edt_conf.row[at].chars = calloc(len + 1, sizeof(char));
-  memcpy(edt_conf.row[at].chars, s, len);
-
-  edt_conf.row[at].chars[len] = '\0';
-
-  edt_conf.row[at].rsize = 0x0;
-  edt_conf.row[at].render = NULL;
-  edt_conf.row[at].highlight = NULL;
-  edt_conf.row[at].hl_open_comment = 0x0;
-  editorUpdateRow(edt_conf.row + at);
-
-  ++edt_conf.num_rows;
-  ++edt_conf.dirty;
-}
-
-void editorFreeRow(edt_row* row)
-{
-  if (row) {
-    for (int32_t i = 0; i < edt_conf.num_rows; ++i) {
-      edt_row* tmp_row = row + i;
+  if (syntax->lexer) {
+    SAFE_FREE(syntax->lexer->trans);
+    SAFE_FREE(syntax->lexer);
+  }
 
-      if (tmp_row->chars && tmp_row->render && tmp_row->highlight) {
-        SAFE_FREE(tmp_row->render);
-        SAFE_FREE(tmp_row->chars);
-        SAFE_FREE(tmp_row->highlight);
-      }
+  if (loaded) {
+    for (size_t i = 0; syntax->file_match && syntax->file_match[i]; ++i) {
+      free(syntax->file_match[i]);
     }
-
-    SAFE_FREE(row);
+    for (size_t i = 0; syntax->keywords && syntax->keywords[i]; ++i) {
+      free(syntax->keywords[i]);
+    }
+    SAFE_FREE(syntax->file_match);
+    SAFE_FREE(syntax->keywords);
+    SAFE_FREE(syntax->file_type);
+    SAFE_FREE(syntax->singleline_comment_start);
+    SAFE_FREE(syntax->multiline_comment_start);
+    SAFE_FREE(syntax->multiline_comment_end);
+    SAFE_FREE(syntax->quotes);
   }
 }
 
-void editorDelRow(int32_t at)
+// Releases the tables compiled so far and the syntaxes loaded from files
+void editorFreeSyntaxes(void)
 {
-  if (at < 0 || at >= edt_conf.num_rows) {
-    return;
+  for (u_int32_t j = 0; j < HLDB_ENTRIES; ++j) {
+    editorFreeSyntax(HLDB + j, 0);
   }
 
-  for (int32_t j = at; j < edt_conf.num_rows - 1; ++j) {
-    --edt_conf.row[j].index;
+  for (size_t j = 0; j < edt_conf.syntax_count; ++j) {
+    editorFreeSyntax(edt_conf.syntax_db + j, 1);
   }
 
-  editorFreeRow(edt_conf.row + at);
-  memmove(edt_conf.row + at,
-      edt_conf.row + (at + 1),
-      (sizeof(edt_row) * (edt_conf.num_rows - (at + 1))));
-  --edt_conf.num_rows;
-  ++edt_conf.dirty;
+  SAFE_FREE(edt_conf.syntax_db);
+  edt_conf.syntax_count = 0;
 }
 
-void editorRowInsertChar(edt_row* row, int32_t at, int32_t ch)
+// Runs the highlighter over one line of text, starting inside a multi-line
+// comment or not, and returns whether the line ends inside one. Colors are
+// only produced when "hl" isn't NULL, otherwise just the comment state is
+// tracked.
+//
+// Each byte costs a lookup of its class and of the transition for it; only
+// bytes that may start or end a comment, escape a quote or bound a word
+// carry an action to be dealt with on the side. Without colors, runs of
+// quiet bytes are skipped with a single lookup each.
+int8_t
+editorLexLine(CONST_CHAR_PTR text, size_t len, int8_t in_ml_comm, BYTE* hl)
 {
-  // add characters to a line/row
-  if (at < 0x0 || (size_t)at > row->size) {
-    at = row->size;
+  // if there's no filetype set
+  if (!edt_conf.buf->syntax) {
+    return 0;
   }
 
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove((row->chars + (at + 1)), (row->chars + at), row->size - at + 1);
+  edt_sytx* syntax = edt_conf.buf->syntax;
+  lex_table* lexer = syntax->lexer;
+  CONST_CHAR_PTR sl_comm = syntax->singleline_comment_start;
+  CONST_CHAR_PTR mc_start = syntax->multiline_comment_start;
+  CONST_CHAR_PTR mc_end = syntax->multiline_comment_end;
+
+  int32_t state = in_ml_comm ? LEX_MLC : LEX_SEP;
+  size_t word = 0; // where the word being read started
+
+  for (size_t i = 0; i < len; ++i) {
+    // the words and numbers of code don't matter to the comment state, the
+    // state a quiet run is left in is as good as the one it was entered in
+    if (!hl) {
+      u_int8_t group = LEX_GROUP(state);
+      while (i < len && (lexer->quiet[(BYTE)text[i]] & group)) {
+        ++i;
+      }
+      if (i == len) {
+        break;
+      }
+    }
 
-  ++row->size;
-  row->chars[at] = ch;
+    lex_cell cell = lexer->trans[state * lexer->classes + lexer->cls[(BYTE)text[i]]];
 
-  editorUpdateRow(row);
-  ++edt_conf.dirty;
+    if (cell.action) {
+      if ((cell.action & LEX_LOOKUP) && hl) {
+        BYTE keywd_hl = editorKeywordLookup(syntax->keyword_table, text + word, i - word);
+        if (keywd_hl != HL_NORMAL) {
+          memset(hl + word, keywd_hl, i - word);
+        }
+      }
+
+      if (cell.action & LEX_OPEN) {
+        size_t sl_len = sl_comm ? strlen(sl_comm) : 0;
+        if (sl_len && len - i >= sl_len && !memcmp(text + i, sl_comm, sl_len)) {
+          HL_PAINT(hl, i, HL_COMMENT, len - i);
+          return 0;
+        }
+
+        size_t mc_len = (mc_start && mc_end && *mc_end) ? strlen(mc_start) : 0;
+        if (mc_len && len - i >= mc_len && !memcmp(text + i, mc_start, mc_len)) {
+          HL_PAINT(hl, i, HL_MLCOMMENT, mc_len);
+          i += mc_len - 1;
+          state = LEX_MLC;
+          continue;
+        }
+      }
+
+      if (cell.action & LEX_CLOSE) {
+        size_t mc_len = strlen(mc_end);
+        if (len - i >= mc_len && !memcmp(text + i, mc_end, mc_len)) {
+          HL_PAINT(hl, i, HL_MLCOMMENT, mc_len);
+          i += mc_len - 1;
+          state = LEX_SEP;
+          continue;
+        }
+      }
+
+      if ((cell.action & LEX_ESCAPE) && i + 1 < len) {
+        HL_PAINT(hl, i, HL_STRING, 2);
+        ++i;
+        continue;
+      }
+
+      if (cell.action & LEX_MARK) {
+        word = i;
+      }
+    }
+
+    if (hl) {
+      hl[i] = cell.hl;
+    }
+    state = cell.next;
+  }
+
+  if (state == LEX_WORDK && hl) {
+    BYTE keywd_hl = editorKeywordLookup(syntax->keyword_table, text + word, len - word);
+    if (keywd_hl != HL_NORMAL) {
+      memset(hl + word, keywd_hl, len - word);
+    }
+  }
+
+  return state == LEX_MLC;
 }
 
-void editorRowAppendStr(edt_row* row, CHAR_PTR s, size_t len)
+// Tracks the multi-line comment state over whole lines still mapped from the
+// file, as editorLexLine() would row by row, and returns the one they end in
+int8_t
+editorLexSpan(CONST_CHAR_PTR text, size_t len, int8_t in_ml_comm)
 {
-  row->chars = realloc(row->chars, row->size + len + 1);
+  CONST_CHAR_PTR end = text + len;
 
-  memcpy(row->chars + row->size, s, len);
-  row->size += len;
+  while (text < end) {
+    CONST_CHAR_PTR eol = memchr(text, '\n', end - text);
+    size_t n = (eol ? eol : end) - text;
+    while (n > 0 && text[n - 1] == '\r') {
+      --n;
+    }
 
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  ++edt_conf.dirty;
+    in_ml_comm = editorLexLine(text, n, in_ml_comm, NULL);
+    text = eol ? eol + 1 : end;
+  }
+
+  return in_ml_comm;
 }
 
-void editorRowDelChar(edt_row* row, int32_t at)
+// Returns the multi-line comment state the row before "row" ends in. A mapped
+// node keeps the state its last line ends in.
+int8_t
+editorRowStartState(edt_row* row)
 {
-  if (at < 0 || (size_t)at >= row->size) {
-    return;
-  }
+  row_node* prev_node = rowTreePrev(ROW_NODE(row));
+  return prev_node && prev_node->row.hl_open_comment;
+}
 
-  memmove(row->chars + at, row->chars + (at + 1), row->size - at);
+// Flags a row for the highlighter after its contents or the state it starts
+// in changed. Colors and the state it ends in get recomputed lazily by
+// editorSyntaxCatchUp().
+void editorUpdateSyntax(edt_row* row)
+{
+  row->hl_valid = 0;
+  editorRowSetDirty(row, 1);
+}
 
-  --row->size;
-  editorUpdateRow(row);
-  ++edt_conf.dirty;
+// Brings the comment state of the rows up to date, front to back, up to and
+// including row "upto" or until "budget" rows were lexed. Each row's end
+// state is a checkpoint: as soon as a row ends in the same state as in the
+// previous run the rows after it are left alone. Mapped lines are lexed
+// straight from the file, a span being cut into pieces of HL_SPAN_LINES lines
+// at most, or what's left of the budget, so that a line materialized later is
+// never far from a checkpoint. Returns whether some rows still wait for the
+// highlighter.
+u_int8_t
+editorSyntaxCatchUp(int32_t upto, int32_t budget)
+{
+  for (; budget > 0; --budget) {
+    int32_t at = 0;
+    row_node* node = rowTreeFirstDirty(&at);
+    if (!node || at > upto) {
+      return node != NULL;
+    }
+
+    int8_t in_ml_comm = editorRowStartState(&node->row);
+    if (ROW_MAPPED(node)) {
+      int32_t lines = (budget < HL_SPAN_LINES) ? budget : HL_SPAN_LINES;
+      if (node->lines > lines) {
+        node = editorSpanSplit(node, at, lines);
+      }
+      in_ml_comm = editorLexSpan(node->span, node->span_len, in_ml_comm);
+      budget -= node->lines - 1;
+    } else {
+      in_ml_comm = editorLexLine(node->row.chars, node->row.size, in_ml_comm, NULL);
+    }
+
+    edt_row* row = &node->row;
+    editorRowSetDirty(row, 0);
+
+    if (row->hl_open_comment != in_ml_comm) {
+      row->hl_open_comment = in_ml_comm;
+
+      row_node* next_node = rowTreeNext(node);
+      if (next_node) {
+        editorUpdateSyntax(&next_node->row);
+      }
+    }
+  }
+
+  return edt_conf.buf->rows && edt_conf.buf->rows->dirty;
 }
 
-/***                                EDITOR OPERATIONS                      ***/
-void editorInsertChar(int32_t ch)
+// Lets the highlighter work through off-screen rows while no key is pending
+void editorSyntaxIdle(void)
 {
-  // add newline to EOF
-  if (edt_conf.csr_y == edt_conf.num_rows) {
-    editorInsertRow(edt_conf.num_rows, "", 0x0);
+  struct pollfd in = { STDIN_FILENO, POLLIN, 0 };
+  if (!edt_conf.buf->rows || !edt_conf.buf->rows->dirty) {
+    return;
   }
 
-  editorRowInsertChar(edt_conf.row + edt_conf.csr_y, edt_conf.csr_x, ch);
+  u_int64_t start = PERF_ON() ? editorClockNs() : 0;
+  while (editorSyntaxCatchUp(INT32_MAX, HL_IDLE_BATCH)) {
+    PERF_COUNT(syscalls);
+    if (poll(&in, 1, 0) > 0) {
+      break;
+    }
+  }
 
-  ++edt_conf.csr_x;
+  if (start) {
+    edt_conf.perf.cur.syntax_ns += editorPerfEvent(PERF_SYNTAX, start, (u_int32_t)-1);
+  }
 }
 
-void editorInsertNewLine(void)
+// Fills the highlight cache of a row about to be drawn
+edt_row*
+editorRowHighlight(edt_row* row)
 {
-  if (edt_conf.csr_x == 0) {
-    editorInsertRow(edt_conf.csr_y, "", 0);
-  } else {
-    edt_row* row = edt_conf.row + edt_conf.csr_y;
-    editorInsertRow(edt_conf.csr_y + 1,
-        row->chars + edt_conf.csr_x,
-        row->size - edt_conf.csr_x);
+  editorRowLayout(row);
+  if (!edt_conf.buf->rows->dirty && row->hl_valid) {
+    return row;
+  }
 
-    row = edt_conf.row + edt_conf.csr_y;
-    row->size = edt_conf.csr_x;
-    row->chars[row->size] = '\0';
+  u_int64_t start = PERF_ON() ? editorClockNs() : 0;
+
+  // the rows above must agree on the state this one starts in, catching up
+  // may also invalidate this row's colors
+  if (edt_conf.buf->rows->dirty) {
+    editorSyntaxCatchUp(editorRowIndex(row), INT32_MAX);
+  }
+
+  if (!row->hl_valid) {
+    row->highlight = editorArenaRealloc(row->highlight, row->size + 1);
+    memset(row->highlight, HL_NORMAL, row->size);
 
-    editorUpdateRow(row);
+    editorLexLine(row->chars, row->size, editorRowStartState(row), row->highlight);
+    row->hl_valid = 1;
   }
 
-  ++edt_conf.csr_y;
-  edt_conf.csr_x = 0;
+  if (start) {
+    edt_conf.perf.cur.syntax_ns += editorPerfEvent(PERF_SYNTAX, start, editorRowIndex(row));
+  }
+
+  return row;
 }
 
-void editorDelChar(void)
+// Maps the editor's possible highlight values to their corresponding ASCII
+// color codes
+int32_t
+editorSyntaxToColor(int32_t hl_value)
 {
-  if (edt_conf.csr_y == edt_conf.num_rows) {
-    return;
+  switch (hl_value) {
+  case HL_NUMBER:
+    return 31;
+  case HL_KEYWORD2:
+    return 32;
+  case HL_KEYWORD1:
+    return 33;
+  case HL_MATCH:
+    return 34;
+  case HL_STRING:
+    return 35;
+  case HL_COMMENT:
+  case HL_MLCOMMENT:
+    return 36;
+  default:
+    return 37;
   }
+}
 
-  if (edt_conf.csr_x == 0 && edt_conf.csr_y == 0) {
+// Matches current filename to their respective syntax highlighting
+void editorSelectSyntaxHighlight(void)
+{
+  edt_conf.buf->syntax = NULL;
+  if (!edt_conf.buf->fname) {
     return;
   }
 
-  edt_row* row = edt_conf.row + edt_conf.csr_y;
-  if (edt_conf.csr_x > 0) {
-    editorRowDelChar(row, edt_conf.csr_x - 1);
-    --edt_conf.csr_x;
-  } else {
-    edt_conf.csr_x = edt_conf.row[edt_conf.csr_y - 1].size;
-    editorRowAppendStr(
-        edt_conf.row + edt_conf.csr_y - 1, row->chars, row->size);
-    editorDelRow(edt_conf.csr_y);
-    --edt_conf.csr_y;
+  // syntaxes loaded from files come first, they may take over a built-in one
+  for (size_t j = 0; j < edt_conf.syntax_count + HLDB_ENTRIES; ++j) {
+    edt_sytx* sytx = (j < edt_conf.syntax_count) ? edt_conf.syntax_db + j : HLDB + (j - edt_conf.syntax_count);
+    if (!editorSyntaxMatches(sytx, edt_conf.buf->fname)) {
+      continue;
+    }
+
+    edt_conf.buf->syntax = sytx;
+    if (!sytx->keyword_table) {
+      sytx->keyword_table = editorCompileKeywords(sytx->keywords);
+    }
+    if (!sytx->lexer) {
+      sytx->lexer = editorCompileLexer(sytx);
+    }
+
+    // queue the rows built so far for the highlighter, their colors get
+    // redone once they're drawn
+    rowTreeMarkDirty(edt_conf.buf->rows);
+
+    return;
   }
 }
 
-/***                                FILE I/O                               ***/
-
-CHAR_PTR
-editorRowsToStr(INT_PTR buf_len)
+// Tells whether a file is one a syntax is meant for, by its extension or a
+// part of its name
+u_int8_t
+editorSyntaxMatches(edt_sytx* syntax, CONST_CHAR_PTR fname)
 {
-  u_int32_t tot_len = 0;
-  u_int32_t j = 0;
-  for (; j < (u_int32_t)edt_conf.num_rows; ++j) {
-    tot_len += edt_conf.row[j].size + 1;
+  CONST_CHAR_PTR ext = strchr(fname, '.');
+  for (u_int32_t i = 0; syntax->file_match[i]; ++i) {
+    int32_t is_ext = (syntax->file_match[i][0] == '.');
+    if ((is_ext && ext && !strcmp(ext, syntax->file_match[i])) || (!is_ext && strstr(fname, syntax->file_match[i]))) {
+      return 1;
+    }
   }
-  *buf_len = tot_len;
 
-  CHAR_PTR buf = calloc(tot_len, sizeof(char));
-  if (!buf) {
+  return 0;
+}
+
+// Cuts the next blank-separated word off a line, NULL once there's none left
+CHAR_PTR
+editorSyntaxWord(CHAR_PTR* line)
+{
+  CHAR_PTR word = *line + strspn(*line, " \t\r\n");
+  if (!*word) {
     return NULL;
   }
 
-  CHAR_PTR p = buf;
-  for (j = 0; j < (u_int32_t)edt_conf.num_rows; ++j, ++p) {
-    memcpy(p, edt_conf.row[j].chars, edt_conf.row[j].size);
-    p += edt_conf.row[j].size;
-    *p = '\n';
-  }
+  CHAR_PTR end = word + strcspn(word, " \t\r\n");
+  *line = *end ? end + 1 : end;
+  *end = '\0';
 
-  return buf;
+  return word;
 }
 
-// Opens and reads a file from disk
-void editorOpen()
+// Loads a syntax definition and adds it to the ones files are matched with.
+// Each line holds a setting followed by its words:
+//
+//   name python
+//   match .py .pyw SConstruct
+//   comment #
+//   block-comment """ """
+//   strings "'
+//   numbers off
+//   keywords if elif else while for def return
+//   types int str float
+//
+// "keywords" and "types" (secondary keywords) may be repeated. Returns -1
+// when the file is malformed, which is told on the standard error.
+int32_t
+editorSyntaxLoad(CONST_CHAR_PTR path)
 {
-  editorSelectSyntaxHighlight();
-
-  // open file for reading
-  FILE* fp = fopen(edt_conf.fname, "r");
+  FILE* fp = fopen(path, "r");
   if (!fp) {
-    HANDLE_ERR("fopen")
+    return -1;
+  }
+
+  edt_sytx syntax;
+  memset(&syntax, 0, sizeof(syntax));
+  syntax.flags = HL_HIGHLIGHT_NUMBERS;
+
+  size_t matches = 0, keywords = 0;
+  syntax.file_match = calloc(1, sizeof(CHAR_PTR));
+  syntax.keywords = calloc(1, sizeof(CHAR_PTR));
+  if (!syntax.file_match || !syntax.keywords) {
+    HANDLE_ERR("calloc")
   }
 
-  // read lines from the opened file
   CHAR_PTR line = NULL;
   size_t line_cap = 0;
-  ssize_t line_len = 0;
+  CONST_CHAR_PTR error = NULL;
+  int32_t line_no = 0;
+  int32_t keywords_line = 0; // last line that added keywords
+  while (!error && getline(&line, &line_cap, fp) != -1) {
+    ++line_no;
+    CHAR_PTR rest = line;
+    CHAR_PTR key = editorSyntaxWord(&rest);
+    if (!key || key[0] == '#') {
+      continue;
+    }
 
-  // register the read data into the editor for display
-  while ((line_len = getline(&line, &line_cap, fp)) != -1) {
-    // strip off newline or carriage return characters
-    while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) {
-      --line_len;
+    CHAR_PTR word = editorSyntaxWord(&rest);
+    CHAR_PTR* list = NULL;
+    size_t* count = NULL;
+    if (!word) {
+      error = "missing value";
+    } else if (!strcmp(key, "name")) {
+      free(syntax.file_type);
+      syntax.file_type = strdup(word);
+    } else if (!strcmp(key, "comment")) {
+      free(syntax.singleline_comment_start);
+      syntax.singleline_comment_start = strdup(word);
+    } else if (!strcmp(key, "block-comment")) {
+      CHAR_PTR end = editorSyntaxWord(&rest);
+      if (!end) {
+        error = "block-comment needs a start and an end";
+      } else {
+        free(syntax.multiline_comment_start);
+        free(syntax.multiline_comment_end);
+        syntax.multiline_comment_start = strdup(word);
+        syntax.multiline_comment_end = strdup(end);
+      }
+    } else if (!strcmp(key, "strings")) {
+      free(syntax.quotes);
+      syntax.quotes = strdup(word);
+      syntax.flags |= HL_HIGHLIGHT_STRINGS;
+      error = (strlen(word) > LEX_MAX_QUOTES) ? "too many quote characters" : NULL;
+    } else if (!strcmp(key, "numbers")) {
+      syntax.flags = !strcmp(word, "off") ? syntax.flags & ~HL_HIGHLIGHT_NUMBERS : syntax.flags | HL_HIGHLIGHT_NUMBERS;
+    } else if (!strcmp(key, "match")) {
+      list = syntax.file_match;
+      count = &matches;
+    } else if (!strcmp(key, "keywords") || !strcmp(key, "types")) {
+      list = syntax.keywords;
+      count = &keywords;
+    } else {
+      error = "unknown setting";
     }
 
-    editorInsertRow(edt_conf.num_rows, line, line_len);
+    // lists take every word of the line, secondary keywords end in a "|".
+    // A keyword listed again keeps its first color.
+    u_int8_t types = !strcmp(key, "types");
+    for (; list && word && !error; word = editorSyntaxWord(&rest)) {
+      size_t len = strlen(word);
+      if (count == &keywords && (len > KW_MAX_LEN || word[len - 1] == '|')) {
+        error = (len > KW_MAX_LEN) ? "keyword too long" : "keywords can't end in \"|\"";
+        break;
+      }
+
+      u_int8_t listed = 0;
+      for (size_t i = 0; count == &keywords && !listed && i < *count; ++i) {
+        size_t listed_len = strlen(list[i]);
+        listed_len -= (list[i][listed_len - 1] == '|');
+        listed = (listed_len == len && !memcmp(list[i], word, len));
+      }
+      if (listed) {
+        continue;
+      }
+      keywords_line = (count == &keywords) ? line_no : keywords_line;
+
+      list = realloc(list, (*count + 2) * sizeof(CHAR_PTR));
+      if (!list) {
+        HANDLE_ERR("realloc")
+      }
+
+      list[*count] = malloc(len + 2);
+      if (!list[*count]) {
+        HANDLE_ERR("malloc")
+      }
+      memcpy(list[*count], word, len);
+      memcpy(list[*count] + len, types ? "|" : "", types + 1);
+      list[++*count] = NULL;
+
+      if (count == &matches) {
+        syntax.file_match = list;
+      } else {
+        syntax.keywords = list;
+      }
+    }
   }
 
   SAFE_FREE(line);
   fclose(fp);
 
-  edt_conf.dirty = 0;
-}
+  if (!error && (!syntax.file_type || !matches)) {
+    error = "a syntax needs a name and files to match";
+  }
 
-void editorSave(void)
-{
-  if (!edt_conf.fname) {
-    edt_conf.fname = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+  // compiled right away so a list that can't be gets told about
+  if (!error) {
+    syntax.keyword_table = editorCompileKeywords(syntax.keywords);
+    if (!syntax.keyword_table) {
+      error = "keywords don't fit a keyword table";
+      line_no = keywords_line;
+    }
+  }
 
-    if (!edt_conf.fname) {
-      editorSetStatusMessage("Save ABORTED!");
-      return;
+  edt_sytx* db = error ? NULL : realloc(edt_conf.syntax_db, (edt_conf.syntax_count + 1) * sizeof(edt_sytx));
+  if (!db) {
+    if (error) {
+      fprintf(stderr, "%s:%d: %s\n", path, line_no, error);
     }
 
-    edt_conf.empty_file = 1;
-    editorSelectSyntaxHighlight();
+    editorFreeSyntax(&syntax, 1);
+    return -1;
   }
 
-  int32_t len = 0;
-  CHAR_PTR buf = editorRowsToStr(&len);
-  if (!buf) {
+  db[edt_conf.syntax_count++] = syntax;
+  edt_conf.syntax_db = db;
+  return 0;
+}
+
+// Loads the "*.syntax" files of $MILLI_SYNTAX_DIR, or ~/.config/milli/syntax,
+// in name order: of two syntaxes matching a file the first one loaded wins
+void editorSyntaxLoadDir(void)
+{
+  char dir[PATH_MAX] = { '\0' };
+  CONST_CHAR_PTR env = getenv("MILLI_SYNTAX_DIR");
+  CONST_CHAR_PTR home = getenv("HOME");
+  if (env) {
+    snprintf(dir, sizeof(dir), "%s", env);
+  } else if (home) {
+    snprintf(dir, sizeof(dir), "%s/%s", home, SYNTAX_DIR);
+  } else {
     return;
   }
 
-  // open a file and write to disk
-  int32_t fd = open(edt_conf.fname, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        SAFE_FREE(buf);
-
-        edt_conf.dirty = 0;
-        editorSetStatusMessage("%d bytes were written to DISK.", len);
-        return;
+  struct dirent** entries = NULL;
+  int32_t count = scandir(dir, &entries, NULL, alphasort);
+  for (int32_t i = 0; i < count; ++i) {
+    size_t len = strlen(entries[i]->d_name);
+    if (len > 7 && !strcmp(entries[i]->d_name + len - 7, ".syntax")) {
+      char path[PATH_MAX] = { '\0' };
+      if (snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name) < (int32_t)sizeof(path)) {
+        editorSyntaxLoad(path);
       }
     }
+    free(entries[i]);
+  }
 
-    close(fd);
+  free(entries);
+}
+/***                                ROW ARENA                              ***/
+
+// Returns the smallest size class holding "size" bytes. Classes go 16, 24,
+// 32, 48, 64... so a block never wastes more than a third of itself.
+int32_t
+editorArenaClass(size_t size)
+{
+  if (size <= 16) {
+    return 0;
   }
 
-  SAFE_FREE(buf);
-  editorSetStatusMessage("Failed to save file. I/O error: %s", strerror(errno));
+  int32_t top = 63 - __builtin_clzll(size - 1); // 2^top < size <= 2^(top + 1)
+  return (size <= (3ul << (top - 1))) ? 2 * (top - 4) + 1 : 2 * (top - 3);
 }
 
-/***                                FIND                                   ***/
+size_t
+editorArenaClassSize(int32_t cls)
+{
+  return (size_t)((cls & 1) ? 24 : 16) << (cls >> 1);
+}
 
-// Callback to locate search query.
-void editorFindCallback(CHAR_PTR query, int32_t key)
+// Cuts "need" bytes off the current chunk, starting a new chunk when they
+// don't fit. What is left of the old one is handed out to the free lists
+// first.
+PTR_T
+editorArenaCarve(size_t need)
 {
-  static int32_t last_match = SEARCH_NO_MATCH;
-  static int8_t direction = SEARCH_FORWARDS;
+  row_arena* arena = &edt_conf.arena;
+  arena_chunk* chunk = arena->chunks;
+
+  if (!chunk || chunk->size - chunk->used < need) {
+    for (int32_t cls = ARENA_CLASSES - 1; chunk && cls >= 0; --cls) {
+      size_t block = sizeof(size_t) + editorArenaClassSize(cls);
+      while (chunk->size - chunk->used >= block) {
+        BYTE* p = (BYTE*)chunk + chunk->used;
+        chunk->used += block;
+        *(size_t*)p = block - sizeof(size_t);
+        PTR_T* slot = (PTR_T*)(p + sizeof(size_t));
+        *slot = arena->free_lists[cls];
+        arena->free_lists[cls] = slot;
+      }
+    }
 
-  // restore the text highlight after a search
-  static int32_t saved_hl_line = 0;
-  static CHAR_PTR saved_hl = NULL;
-  if (saved_hl) {
-    memcpy(edt_conf.row[saved_hl_line].highlight,
-        saved_hl,
-        edt_conf.row[saved_hl_line].rsize);
-    SAFE_FREE(saved_hl);
-  }
+    chunk = malloc(ARENA_CHUNK_SIZE);
+    if (!chunk) {
+      HANDLE_ERR("malloc")
+    }
 
-  if (key == '\r' || key == '\x1b') {
-    last_match = SEARCH_NO_MATCH;
-    direction = SEARCH_FORWARDS;
-    return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = SEARCH_FORWARDS;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = SEARCH_BACKWARDS;
-  } else {
-    last_match = SEARCH_NO_MATCH;
-    direction = SEARCH_FORWARDS;
+    chunk->next = arena->chunks;
+    chunk->prev = NULL;
+    chunk->used = sizeof(arena_chunk);
+    chunk->size = ARENA_CHUNK_SIZE;
+    arena->chunks = chunk;
   }
 
-  // set cursor to the queried string's position
-  if (last_match == SEARCH_NO_MATCH) {
-    direction = SEARCH_FORWARDS;
-  }
+  PTR_T p = (BYTE*)chunk + chunk->used;
+  chunk->used += need;
+  return p;
+}
 
-  int32_t curr_match_row = last_match;
-  int32_t i = 0;
-  for (; i < edt_conf.num_rows; ++i) {
-    curr_match_row += direction;
+// Allocates a block of at least "size" bytes
+PTR_T
+editorArenaAlloc(size_t size)
+{
+  row_arena* arena = &edt_conf.arena;
+  PERF_COUNT(allocs);
 
-    if (curr_match_row == SEARCH_NO_MATCH) {
-      curr_match_row = edt_conf.num_rows - 1;
-    } else if (curr_match_row == edt_conf.num_rows) {
-      curr_match_row = 0;
+  if (size > ARENA_MAX_BLOCK) {
+    arena_chunk* chunk = malloc(sizeof(arena_chunk) + sizeof(size_t) + size);
+    if (!chunk) {
+      HANDLE_ERR("malloc")
     }
 
-    edt_row* row = edt_conf.row + curr_match_row;
-    CHAR_PTR match = strstr(row->render, query);
-    if (match) {
-      last_match = curr_match_row;
-      edt_conf.csr_y = curr_match_row;
-      edt_conf.csr_x = editorRowRxToCx(row, match - row->render);
-      edt_conf.row_off = edt_conf.num_rows;
+    chunk->next = arena->large;
+    chunk->prev = NULL;
+    chunk->used = chunk->size = sizeof(arena_chunk) + sizeof(size_t) + size;
+    if (arena->large) {
+      arena->large->prev = chunk;
+    }
+    arena->large = chunk;
 
-      saved_hl_line = curr_match_row;
-      saved_hl = calloc(row->rsize, sizeof(char));
-      memcpy(saved_hl, row->highlight, row->rsize);
-      memset(row->highlight + (match - row->render), HL_MATCH, strlen(query));
+    size_t* header = (size_t*)(chunk + 1);
+    *header = size;
+    return header + 1;
+  }
 
-      break;
-    }
+  int32_t cls = editorArenaClass(size);
+  PTR_T* block = arena->free_lists[cls];
+  if (block) {
+    arena->free_lists[cls] = *block;
+    return block;
   }
+
+  size_t* header = editorArenaCarve(sizeof(size_t) + editorArenaClassSize(cls));
+  *header = editorArenaClassSize(cls);
+  return header + 1;
 }
 
-void editorFind(void)
+// Grows a block. Growing within its capacity is free, otherwise the row moves
+// up a size class or more, which keeps per-keystroke growth amortized.
+PTR_T
+editorArenaRealloc(PTR_T ptr, size_t size)
 {
-  // save cursor & scroll position before search
-  int32_t saved_csr_x = edt_conf.csr_x;
-  int32_t saved_csr_y = edt_conf.csr_y;
-  int32_t saved_col_off = edt_conf.col_off;
-  int32_t saved_row_off = edt_conf.row_off;
+  if (!ptr) {
+    return editorArenaAlloc(size);
+  }
 
-  // get search query from user
-  CHAR_PTR query = editorPrompt(
-      "Search: %s (ESC to cancel | ARROW keys to navigate | Enter key )",
-      editorFindCallback);
-  if (!query) {
-    return;
+  size_t cap = ARENA_CAP(ptr);
+  if (size <= cap) {
+    return ptr;
+  }
+
+  PTR_T grown = editorArenaAlloc(size);
+  memcpy(grown, ptr, cap);
+  editorArenaFree(ptr);
+
+  return grown;
+}
+
+// Allocates a zeroed tree node. Nodes all have the same size, so they come
+// from a list of their own and go without a header.
+row_node*
+editorArenaNodeAlloc(void)
+{
+  row_arena* arena = &edt_conf.arena;
+  row_node* node = arena->node_free;
+  PERF_COUNT(allocs);
+
+  if (node) {
+    arena->node_free = *(PTR_T*)node;
   } else {
-    // restore saved cursor & scroll position in case no query was input
-    edt_conf.csr_x = saved_csr_x;
-    edt_conf.csr_y = saved_csr_y;
-    edt_conf.col_off = saved_col_off;
-    edt_conf.row_off = saved_row_off;
+    node = editorArenaCarve((sizeof(row_node) + 7) & ~(size_t)7);
   }
 
-  SAFE_FREE(query);
+  memset(node, 0, sizeof(row_node));
+  return node;
 }
 
-/***                                APPEND BUFFER                          ***/
+void editorArenaNodeFree(row_node* node)
+{
+  *(PTR_T*)node = edt_conf.arena.node_free;
+  edt_conf.arena.node_free = node;
+}
 
-// Appends data to a custom dynamic output screen buffer
-void abAppend(struct abuf* ab, CONST_CHAR_PTR s, size_t len)
+// Puts a block back on its free list
+void editorArenaFree(PTR_T ptr)
 {
-  CHAR_PTR new = realloc(ab->buffer, (ab->len + len));
+  row_arena* arena = &edt_conf.arena;
+  size_t cap = ARENA_CAP(ptr);
+
+  // a large block sits right behind its chunk's header, which is unlinked
+  // from its neighbours in place
+  if (cap > ARENA_MAX_BLOCK) {
+    arena_chunk* chunk = (arena_chunk*)((size_t*)ptr - 1) - 1;
+    if (chunk->prev) {
+      chunk->prev->next = chunk->next;
+    } else {
+      arena->large = chunk->next;
+    }
+    if (chunk->next) {
+      chunk->next->prev = chunk->prev;
+    }
 
-  if (!new)
+    free(chunk);
     return;
+  }
 
-  memcpy((new + ab->len), s, len);
-
-  ab->buffer = new;
-  ab->len += len;
+  int32_t cls = editorArenaClass(cap);
+  *(PTR_T*)ptr = arena->free_lists[cls];
+  arena->free_lists[cls] = ptr;
 }
 
-// Frees allocated memory for the output screen buffer
-void abFree(struct abuf* ab)
+// Releases all the rows at once
+void editorArenaReset(void)
 {
-  SAFE_FREE(ab->buffer);
+  row_arena* arena = &edt_conf.arena;
+  arena_chunk* lists[2] = { arena->chunks, arena->large };
+
+  for (int32_t i = 0; i < 2; ++i) {
+    while (lists[i]) {
+      arena_chunk* next = lists[i]->next;
+      free(lists[i]);
+      lists[i] = next;
+    }
+  }
+
+  memset(arena, 0, sizeof(row_arena));
 }
 
-/***                                INPUT                                  ***/
+/***                                ROW STORAGE                            ***/
 
-// Asks user for input in cases like saving files or passing commands
-CHAR_PTR
-editorPrompt(CHAR_PTR prompt, void (*callback)(CHAR_PTR, int32_t))
+// Recomputes a node's subtree size and re-parents its children
+void rowTreePull(row_node* node)
 {
-  size_t bufsize = 128;
-  CHAR_PTR buf = calloc(bufsize, sizeof(char));
+  node->count = node->lines + ROW_COUNT(node->left) + ROW_COUNT(node->right);
+  node->dirty = node->row.hl_dirty + ROW_DIRTY(node->left) + ROW_DIRTY(node->right);
 
-  size_t buflen = 0;
+  if (node->left) {
+    node->left->parent = node;
+  }
 
-  for (;;) {
-    editorSetStatusMessage(prompt, buf);
-    editorRefreshScreen();
+  if (node->right) {
+    node->right->parent = node;
+  }
+}
 
-    int32_t ch = editorReadKey();
-    if (ch == DEL_KEY || ch == CTRL_KEY('h') || ch == BACKSPACE) {
-      if (buflen != 0) {
-        buf[--buflen] = '\0';
-      }
-    } else if (ch == '\x1b') {
-      // using "ESC" to cancel user input
-      editorSetStatusMessage("");
-      if (callback) {
+// Splits a tree into its first "at" lines and the remaining ones. "at" must
+// fall on a node boundary, mapped spans are never cut here.
+void rowTreeSplit(row_node* node, int32_t at, row_node** left, row_node** right)
+{
+  if (!node) {
+    *left = *right = NULL;
+    return;
+  }
+
+  int32_t left_count = ROW_COUNT(node->left);
+  if (at <= left_count) {
+    rowTreeSplit(node->left, at, left, &node->left);
+    *right = node;
+  } else {
+    rowTreeSplit(node->right, at - left_count - node->lines, &node->right, right);
+    *left = node;
+  }
+
+  rowTreePull(node);
+}
+
+// Joins two trees, every row of "left" ending up before those of "right"
+row_node*
+rowTreeMerge(row_node* left, row_node* right)
+{
+  if (!left || !right) {
+    return left ? left : right;
+  }
+
+  if (left->prio > right->prio) {
+    left->right = rowTreeMerge(left->right, right);
+    rowTreePull(left);
+    return left;
+  }
+
+  right->left = rowTreeMerge(left, right->left);
+  rowTreePull(right);
+  return right;
+}
+
+// Flags every row and mapped span of a (sub)tree for the highlighter
+void rowTreeMarkDirty(row_node* node)
+{
+  if (!node) {
+    return;
+  }
+
+  rowTreeMarkDirty(node->left);
+  rowTreeMarkDirty(node->right);
+
+  node->row.hl_dirty = 1;
+  node->row.hl_valid = 0;
+
+  rowTreePull(node);
+}
+
+// Finds the first row waiting for the highlighter along with its position
+row_node*
+rowTreeFirstDirty(INT_PTR at)
+{
+  row_node* node = edt_conf.buf->rows;
+  *at = 0;
+
+  while (node && node->dirty) {
+    if (ROW_DIRTY(node->left)) {
+      node = node->left;
+    } else if (node->row.hl_dirty) {
+      *at += ROW_COUNT(node->left);
+      return node;
+    } else {
+      *at += ROW_COUNT(node->left) + node->lines;
+      node = node->right;
+    }
+  }
+
+  return NULL;
+}
+
+// Sets whether a row waits for the highlighter, keeping the counts of its
+// ancestors in sync
+void editorRowSetDirty(edt_row* row, u_int8_t dirty)
+{
+  if (row->hl_dirty == dirty) {
+    return;
+  }
+
+  row->hl_dirty = dirty;
+  for (row_node* node = ROW_NODE(row); node; node = node->parent) {
+    node->dirty += dirty ? 1 : -1;
+  }
+}
+
+// Finds the node holding the line at "at" without materializing it. "start"
+// receives the position of the node's first line.
+row_node*
+rowTreeFind(int32_t at, INT_PTR start)
+{
+  row_node* node = edt_conf.buf->rows;
+  *start = 0;
+
+  while (node) {
+    int32_t left_count = ROW_COUNT(node->left);
+    if (at < left_count) {
+      node = node->left;
+    } else if (at < left_count + node->lines) {
+      *start += left_count;
+      return node;
+    } else {
+      at -= left_count + node->lines;
+      *start += left_count + node->lines;
+      node = node->right;
+    }
+  }
+
+  return NULL;
+}
+
+// Returns the leftmost node of a (sub)tree
+row_node*
+rowTreeFirst(row_node* node)
+{
+  while (node && node->left) {
+    node = node->left;
+  }
+
+  return node;
+}
+
+// Returns the node following "node" in file order, if any
+row_node*
+rowTreeNext(row_node* node)
+{
+  if (node->right) {
+    return rowTreeFirst(node->right);
+  }
+
+  while (node->parent && node == node->parent->right) {
+    node = node->parent;
+  }
+
+  return node->parent;
+}
+
+// Returns the node preceding "node" in file order, if any
+row_node*
+rowTreePrev(row_node* node)
+{
+  if (node->left) {
+    for (node = node->left; node->right; node = node->right)
+      ;
+    return node;
+  }
+
+  while (node->parent && node == node->parent->left) {
+    node = node->parent;
+  }
+
+  return node->parent;
+}
+
+// Allocates a detached tree node standing for "lines" file lines
+row_node*
+rowNodeNew(int32_t lines)
+{
+  static u_int32_t prio_seed = 0x9e3779b9;
+  row_node* node = editorArenaNodeAlloc();
+
+  // xorshift32 priorities keep the treap balanced in expectation
+  prio_seed ^= prio_seed << 13;
+  prio_seed ^= prio_seed >> 17;
+  prio_seed ^= prio_seed << 5;
+  node->prio = prio_seed;
+  node->lines = node->count = lines;
+  node->row.save_gen = edt_conf.save.gen;
+
+  return node;
+}
+
+// Counts the newline characters in a buffer
+size_t
+editorCountNewlines(CONST_CHAR_PTR buf, size_t len)
+{
+  size_t lines = 0;
+  size_t i = 0;
+
+#ifdef __SSE2__
+  // compare 16 bytes at a time against '\n' and count the hits
+  const __m128i newline = _mm_set1_epi8('\n');
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(buf + i));
+    u_int32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+    lines += __builtin_popcount(mask);
+  }
+#endif
+
+  for (; i < len; ++i) {
+    lines += (buf[i] == '\n');
+  }
+
+  return lines;
+}
+
+// Adds the offset of the next indexed line to the line index of the buffer
+void editorLineIndexAdd(size_t offset)
+{
+  edt_buffer* buf = edt_conf.buf;
+  if (buf->line_index_len == buf->line_index_cap) {
+    buf->line_index_cap = buf->line_index_cap ? buf->line_index_cap * 2 : 64;
+    buf->line_index = realloc(buf->line_index, buf->line_index_cap * sizeof(size_t));
+    if (!buf->line_index) {
+      HANDLE_ERR("realloc")
+    }
+  }
+
+  buf->line_index[buf->line_index_len++] = offset;
+}
+
+// Counts the lines of a file about to be mapped, a missing final newline still
+// ending a line, and notes down where every LINE_INDEX_STEP-th line starts on
+// the way. Lines far into the file can then be found from the closest of them
+// instead of by scanning all the lines before.
+size_t
+editorIndexLines(CONST_CHAR_PTR buf, size_t len)
+{
+  editorLineIndexAdd(0);
+
+  size_t lines = 0;
+  size_t next = LINE_INDEX_STEP; // newlines seen when the next entry is due
+  size_t i = 0;
+
+#ifdef __SSE2__
+  // as in editorCountNewlines(), only chunks holding a due line get picked apart
+  const __m128i newline = _mm_set1_epi8('\n');
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(buf + i));
+    u_int32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+    size_t hits = __builtin_popcount(mask);
+    if (lines + hits < next) {
+      lines += hits;
+      continue;
+    }
+
+    for (; mask; mask &= mask - 1) {
+      if (++lines < next) {
+        continue;
+      }
+
+      editorLineIndexAdd(i + __builtin_ctz(mask) + 1);
+      next += LINE_INDEX_STEP;
+    }
+  }
+#endif
+
+  for (; i < len; ++i) {
+    if (buf[i] != '\n' || ++lines < next) {
+      continue;
+    }
+
+    editorLineIndexAdd(i + 1);
+    next += LINE_INDEX_STEP;
+  }
+
+  return lines + (len && buf[len - 1] != '\n');
+}
+
+// Locates line number "line" of a mapped span and returns its start along with
+// its length, trailing newline and carriage returns excluded
+CONST_CHAR_PTR
+editorSpanLine(CONST_CHAR_PTR span, size_t len, int32_t line, size_t* line_len)
+{
+  CONST_CHAR_PTR end = span + len;
+  CONST_CHAR_PTR p = span;
+
+  // memchr is vectorized by the C library, keep hopping over newlines with it
+  for (; line > 0; --line) {
+    p = (CONST_CHAR_PTR)memchr(p, '\n', end - p) + 1;
+  }
+
+  CONST_CHAR_PTR eol = memchr(p, '\n', end - p);
+  size_t n = (eol ? eol : end) - p;
+  while (n > 0 && (p[n - 1] == '\n' || p[n - 1] == '\r')) {
+    --n;
+  }
+
+  *line_len = n;
+  return p;
+}
+
+// Locates line number "line" of a mapped node like editorSpanLine() does
+CONST_CHAR_PTR
+editorSpanSeek(row_node* node, int32_t line, size_t* line_len)
+{
+  CONST_CHAR_PTR span_end = node->span + node->span_len;
+
+  // far into the span, the closest indexed line before it is a shortcut: the
+  // mapping still holds the file's lines as they were, whatever became of them
+  CONST_CHAR_PTR from = node->span;
+  int32_t skip = line;
+  size_t entry = (size_t)(node->span_line + line) / LINE_INDEX_STEP;
+  if (line >= LINE_INDEX_STEP && entry < edt_conf.buf->line_index_len) {
+    from = edt_conf.buf->map + edt_conf.buf->line_index[entry];
+    skip = node->span_line + line - (int32_t)(entry * LINE_INDEX_STEP);
+  }
+
+  return editorSpanLine(from, span_end - from, skip, line_len);
+}
+
+// Cuts a mapped node starting at file line "start" after its first "lines"
+// lines and returns the first piece. Both pieces are left for the
+// highlighter, keeping the state the span ends in as their last one.
+row_node*
+editorSpanSplit(row_node* node, int32_t start, int32_t lines)
+{
+  size_t line_len = 0;
+  CONST_CHAR_PTR cut = editorSpanSeek(node, lines, &line_len);
+
+  row_node* first = rowNodeNew(lines);
+  first->span = node->span;
+  first->span_len = cut - node->span;
+  first->span_line = node->span_line;
+
+  row_node* second = rowNodeNew(node->lines - lines);
+  second->span = cut;
+  second->span_len = node->span + node->span_len - cut;
+  second->span_line = node->span_line + lines;
+
+  first->row.hl_open_comment = second->row.hl_open_comment = node->row.hl_open_comment;
+  first->row.hl_dirty = first->dirty = 1;
+  second->row.hl_dirty = second->dirty = 1;
+
+  row_node *left = NULL, *mid = NULL, *right = NULL;
+  rowTreeSplit(edt_conf.buf->rows, start, &left, &right);
+  rowTreeSplit(right, node->lines, &mid, &right);
+  editorArenaNodeFree(mid);
+
+  edt_conf.buf->rows = rowTreeMerge(rowTreeMerge(left, rowTreeMerge(first, second)), right);
+  edt_conf.buf->rows->parent = NULL;
+  return first;
+}
+
+// Turns line "line" of a mapped node starting at file line "start" into a real
+// row by splitting the span around it. The rest of the span stays mapped.
+edt_row*
+editorRowMaterialize(row_node* node, int32_t start, int32_t line)
+{
+  size_t line_len = 0;
+  CONST_CHAR_PTR span_end = node->span + node->span_len;
+  CONST_CHAR_PTR text = editorSpanSeek(node, line, &line_len);
+  CONST_CHAR_PTR after = memchr(text, '\n', span_end - text);
+  after = after ? after + 1 : span_end;
+
+  row_node* before_node = NULL;
+  if (line > 0) {
+    before_node = rowNodeNew(line);
+    before_node->span = node->span;
+    before_node->span_len = text - node->span;
+    before_node->span_line = node->span_line;
+  }
+
+  row_node* after_node = NULL;
+  if (line + 1 < node->lines) {
+    after_node = rowNodeNew(node->lines - line - 1);
+    after_node->span = after;
+    after_node->span_len = span_end - after;
+    after_node->span_line = node->span_line + line + 1;
+  }
+
+  row_node* line_node = rowNodeNew(1);
+  edt_row* row = &line_node->row;
+  row->size = line_len;
+  row->chars = editorArenaAlloc(line_len + 1);
+  memcpy(row->chars, text, line_len);
+  row->chars[line_len] = '\0';
+
+  // the pieces of a span the highlighter was done with get their states right
+  // away, so the rest of the span doesn't need another pass. Those of a span
+  // still waiting for it keep waiting.
+  u_int8_t dirty = node->row.hl_dirty;
+  int8_t in_ml_comm = editorRowStartState(&node->row);
+  if (before_node) {
+    if (dirty) {
+      before_node->row.hl_dirty = before_node->dirty = 1;
+    } else {
+      in_ml_comm = editorLexSpan(before_node->span, before_node->span_len, in_ml_comm);
+    }
+    before_node->row.hl_open_comment = in_ml_comm;
+  }
+  if (after_node) {
+    after_node->row.hl_open_comment = node->row.hl_open_comment;
+    after_node->row.hl_dirty = after_node->dirty = dirty;
+  }
+
+  // a line of a span the highlighter was done with gets the state it ends in,
+  // otherwise it starts from the one it's entered in so the highlighter only
+  // touches the next row if this one turns out to open or close a comment
+  row->hl_open_comment = dirty ? in_ml_comm : editorLexLine(row->chars, row->size, in_ml_comm, NULL);
+
+  // cut the span node out and splice the three pieces in its place
+  row_node *left = NULL, *mid = NULL, *right = NULL;
+  rowTreeSplit(edt_conf.buf->rows, start, &left, &right);
+  rowTreeSplit(right, node->lines, &mid, &right);
+  editorArenaNodeFree(mid);
+
+  mid = rowTreeMerge(rowTreeMerge(before_node, line_node), after_node);
+  edt_conf.buf->rows = rowTreeMerge(rowTreeMerge(left, mid), right);
+  edt_conf.buf->rows->parent = NULL;
+
+  editorUpdateRow(row);
+  return row;
+}
+
+// Finds the row at a given position in the file in O(log n), building it from
+// the mapped file on first access
+edt_row*
+editorRowAt(int32_t at)
+{
+  if (at < 0 || at >= edt_conf.buf->num_rows) {
+    return NULL;
+  }
+
+  int32_t start = 0;
+  row_node* node = rowTreeFind(at, &start);
+  if (node && ROW_MAPPED(node)) {
+    return editorRowMaterialize(node, start, at - start);
+  }
+
+  return node ? &node->row : NULL;
+}
+
+// Computes the position of a row in the file by walking up to the root
+int32_t
+editorRowIndex(edt_row* row)
+{
+  row_node* node = ROW_NODE(row);
+  int32_t index = ROW_COUNT(node->left);
+
+  for (; node->parent; node = node->parent) {
+    if (node == node->parent->right) {
+      index += ROW_COUNT(node->parent->left) + node->parent->lines;
+    }
+  }
+
+  return index;
+}
+
+// Returns the row following "row" in the file, if any
+edt_row*
+editorRowNext(edt_row* row)
+{
+  row_node* node = rowTreeNext(ROW_NODE(row));
+  if (node && ROW_MAPPED(node)) {
+    return editorRowAt(editorRowIndex(row) + 1);
+  }
+
+  return node ? &node->row : NULL;
+}
+
+// Returns the row preceding "row" in the file, if any
+edt_row*
+editorRowPrev(edt_row* row)
+{
+  row_node* node = rowTreePrev(ROW_NODE(row));
+  if (node && ROW_MAPPED(node)) {
+    return editorRowAt(editorRowIndex(row) - 1);
+  }
+
+  return node ? &node->row : NULL;
+}
+
+/***                                UTF-8                                  ***/
+
+// code point ranges drawn over two columns: CJK, Hangul, fullwidth forms and
+// emoji, sorted for a binary search
+u_int32_t UTF8_WIDE[][2] = {
+  { 0x1100, 0x115f }, { 0x231a, 0x231b }, { 0x2329, 0x232a }, { 0x23e9, 0x23ec },
+  { 0x23f0, 0x23f0 }, { 0x23f3, 0x23f3 }, { 0x25fd, 0x25fe }, { 0x2614, 0x2615 },
+  { 0x2648, 0x2653 }, { 0x267f, 0x267f }, { 0x2693, 0x2693 }, { 0x26a1, 0x26a1 },
+  { 0x26aa, 0x26ab }, { 0x26bd, 0x26be }, { 0x26c4, 0x26c5 }, { 0x26ce, 0x26ce },
+  { 0x26d4, 0x26d4 }, { 0x26ea, 0x26ea }, { 0x26f2, 0x26f3 }, { 0x26f5, 0x26f5 },
+  { 0x26fa, 0x26fa }, { 0x26fd, 0x26fd }, { 0x2705, 0x2705 }, { 0x270a, 0x270b },
+  { 0x2728, 0x2728 }, { 0x274c, 0x274c }, { 0x274e, 0x274e }, { 0x2753, 0x2755 },
+  { 0x2757, 0x2757 }, { 0x2795, 0x2797 }, { 0x27b0, 0x27b0 }, { 0x27bf, 0x27bf },
+  { 0x2b1b, 0x2b1c }, { 0x2b50, 0x2b50 }, { 0x2b55, 0x2b55 }, { 0x2e80, 0x303e },
+  { 0x3041, 0x33ff }, { 0x3400, 0x4dbf }, { 0x4e00, 0x9fff }, { 0xa000, 0xa4cf },
+  { 0xa960, 0xa97f }, { 0xac00, 0xd7a3 }, { 0xf900, 0xfaff }, { 0xfe10, 0xfe19 },
+  { 0xfe30, 0xfe6f }, { 0xff00, 0xff60 }, { 0xffe0, 0xffe6 }, { 0x16fe0, 0x16fe4 },
+  { 0x17000, 0x18cff }, { 0x1b000, 0x1b2ff }, { 0x1f004, 0x1f004 }, { 0x1f0cf, 0x1f0cf },
+  { 0x1f18e, 0x1f18e }, { 0x1f191, 0x1f19a }, { 0x1f200, 0x1f251 }, { 0x1f300, 0x1f320 },
+  { 0x1f32d, 0x1f335 }, { 0x1f337, 0x1f37c }, { 0x1f37e, 0x1f393 }, { 0x1f3a0, 0x1f3ca },
+  { 0x1f3cf, 0x1f3d3 }, { 0x1f3e0, 0x1f3f0 }, { 0x1f3f4, 0x1f3f4 }, { 0x1f3f8, 0x1f43e },
+  { 0x1f440, 0x1f440 }, { 0x1f442, 0x1f4fc }, { 0x1f4ff, 0x1f53d }, { 0x1f54b, 0x1f54e },
+  { 0x1f550, 0x1f567 }, { 0x1f57a, 0x1f57a }, { 0x1f595, 0x1f596 }, { 0x1f5a4, 0x1f5a4 },
+  { 0x1f5fb, 0x1f64f }, { 0x1f680, 0x1f6c5 }, { 0x1f6cc, 0x1f6cc }, { 0x1f6d0, 0x1f6d2 },
+  { 0x1f6d5, 0x1f6d7 }, { 0x1f6eb, 0x1f6ec }, { 0x1f6f4, 0x1f6fc }, { 0x1f7e0, 0x1f7eb },
+  { 0x1f90c, 0x1f93a }, { 0x1f93c, 0x1f945 }, { 0x1f947, 0x1f9ff }, { 0x1fa70, 0x1faff },
+  { 0x20000, 0x2fffd }, { 0x30000, 0x3fffd },
+};
+
+// code point ranges taking no column: combining marks, joiners and variation
+// selectors, which the character before them absorbs
+u_int32_t UTF8_ZERO_WIDTH[][2] = {
+  { 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd }, { 0x05bf, 0x05bf },
+  { 0x05c1, 0x05c2 }, { 0x05c4, 0x05c5 }, { 0x05c7, 0x05c7 }, { 0x0610, 0x061a },
+  { 0x064b, 0x065f }, { 0x0670, 0x0670 }, { 0x06d6, 0x06dc }, { 0x06df, 0x06e4 },
+  { 0x06e7, 0x06e8 }, { 0x06ea, 0x06ed }, { 0x0900, 0x0902 }, { 0x093a, 0x093a },
+  { 0x093c, 0x093c }, { 0x0941, 0x0948 }, { 0x094d, 0x094d }, { 0x0951, 0x0957 },
+  { 0x0962, 0x0963 }, { 0x0e31, 0x0e31 }, { 0x0e34, 0x0e3a }, { 0x0e47, 0x0e4e },
+  { 0x1ab0, 0x1aff }, { 0x1dc0, 0x1dff }, { 0x200b, 0x200f }, { 0x202a, 0x202e },
+  { 0x2060, 0x2064 }, { 0x20d0, 0x20ff }, { 0x302a, 0x302d }, { 0x3099, 0x309a },
+  { 0xfe00, 0xfe0f }, { 0xfe20, 0xfe2f }, { 0xfeff, 0xfeff }, { 0x1f3fb, 0x1f3ff },
+  { 0xe0001, 0xe007f }, { 0xe0100, 0xe01ef },
+};
+
+// Decodes the UTF-8 character at the start of "text". Returns its length, 0
+// for a byte that doesn't start a valid one: stray continuation bytes, cut
+// short, overlong or surrogate sequences and values past U+10FFFF.
+int32_t
+editorUtf8Decode(CONST_CHAR_PTR text, size_t len, int32_t* cp)
+{
+  const BYTE* s = (const BYTE*)text;
+  if (!len) {
+    return 0;
+  }
+
+  int32_t seq_len = 0x0;
+  int32_t min = 0x0; // smallest value a sequence this long may encode
+  if (s[0] < 0x80) {
+    *cp = s[0];
+    return 1;
+  } else if ((s[0] & 0xe0) == 0xc0) {
+    seq_len = 2;
+    min = 0x80;
+    *cp = s[0] & 0x1f;
+  } else if ((s[0] & 0xf0) == 0xe0) {
+    seq_len = 3;
+    min = 0x800;
+    *cp = s[0] & 0x0f;
+  } else if ((s[0] & 0xf8) == 0xf0) {
+    seq_len = 4;
+    min = 0x10000;
+    *cp = s[0] & 0x07;
+  } else {
+    return 0;
+  }
+
+  if ((size_t)seq_len > len) {
+    return 0;
+  }
+
+  for (int32_t i = 1; i < seq_len; ++i) {
+    if ((s[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+    *cp = (*cp << 6) | (s[i] & 0x3f);
+  }
+
+  if (*cp < min || *cp > 0x10ffff || (*cp >= 0xd800 && *cp <= 0xdfff)) {
+    return 0;
+  }
+
+  return seq_len;
+}
+
+// Looks a code point up in a sorted table of ranges
+u_int8_t
+editorUtf8InRanges(int32_t cp, u_int32_t (*ranges)[2], size_t count)
+{
+  size_t lo = 0, hi = count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (ranges[mid][1] < (u_int32_t)cp) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo < count && ranges[lo][0] <= (u_int32_t)cp;
+}
+
+// Tells how many columns a code point takes on screen: 0, 1 or 2. The C1
+// control codes, which a terminal would act on, come out as -1.
+int32_t
+editorCharWidth(int32_t cp)
+{
+  if (cp < 0x300) {
+    return (cp >= 0x80 && cp < 0xa0) ? -1 : 1;
+  }
+
+  if (editorUtf8InRanges(cp, UTF8_ZERO_WIDTH, sizeof(UTF8_ZERO_WIDTH) / sizeof(UTF8_ZERO_WIDTH[0]))) {
+    return 0;
+  }
+
+  return editorUtf8InRanges(cp, UTF8_WIDE, sizeof(UTF8_WIDE) / sizeof(UTF8_WIDE[0])) ? 2 : 1;
+}
+
+// Measures the glyph at position "cx" of a row drawn from column "rx": a tab,
+// a control or invalid byte, or a character along with the zero-width marks
+// following it. Returns its width and sets its length in bytes and, if asked
+// for, the UTF-8 bytes to draw packed first byte lowest. Bytes that can't be
+// drawn as they are get 0 there. Marks that don't fit the four bytes a
+// screen cell holds are left out of "glyph" but still belong to the glyph.
+int32_t
+editorRowGlyph(edt_row* row, int32_t cx, int32_t rx, INT_PTR len, u_int32_t* glyph)
+{
+  CONST_CHAR_PTR text = row->chars + cx;
+  size_t avail = row->size - cx;
+
+  if (text[0] == '\t') {
+    *len = 1;
+    if (glyph) {
+      *glyph = ' ';
+    }
+    return MILLI_TAB_STOP - (rx % MILLI_TAB_STOP);
+  }
+
+  int32_t cp = 0x0;
+  int32_t seq_len = editorUtf8Decode(text, avail, &cp);
+  int32_t width = seq_len ? editorCharWidth(cp) : -1;
+
+  // lone marks with nothing to combine with are shown like control bytes
+  if (width <= 0 || cp < 0x20 || cp == 0x7f) {
+    *len = seq_len ? seq_len : 1;
+    if (glyph) {
+      *glyph = 0x0;
+    }
+    return 1;
+  }
+
+  u_int32_t packed = 0x0;
+  int32_t packed_len = 0x0;
+  int32_t total = 0x0;
+  for (;;) {
+    if (packed_len + seq_len <= 4) {
+      for (int32_t i = 0; i < seq_len; ++i) {
+        packed |= (u_int32_t)(BYTE)text[total + i] << (8 * packed_len++);
+      }
+    }
+    total += seq_len;
+
+    seq_len = editorUtf8Decode(text + total, avail - total, &cp);
+    if (!seq_len || editorCharWidth(cp) != 0) {
+      break;
+    }
+  }
+
+  *len = total;
+  if (glyph) {
+    *glyph = packed;
+  }
+
+  return width;
+}
+
+/***                                ROW OPERATIONS                         ***/
+
+// Finds the glyph of the column index a position in "chars" falls in or
+// follows, -1 when it comes before all of them
+int32_t
+editorRowColAt(edt_row* row, int32_t cx)
+{
+  INT_PTR cols = row->cols + 1;
+  int32_t lo = 0, hi = row->cols[0];
+  while (lo < hi) {
+    int32_t mid = lo + (hi - lo) / 2;
+    if (cols[2 * mid] <= cx) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo - 1;
+}
+
+// Maps a position in "chars" to the screen column it's drawn at, a position
+// inside a glyph to the glyph's first column. Rows of single-column bytes map
+// one to one, others binary search the column index.
+int32_t
+editorRowCxToRx(edt_row* row, int32_t cx)
+{
+  editorRowLayout(row);
+  if (!row->cols) {
+    return cx;
+  }
+
+  int32_t at = editorRowColAt(row, cx);
+  if (at < 0) {
+    return cx;
+  }
+
+  int32_t from = row->cols[1 + 2 * at];
+  int32_t rx = row->cols[2 + 2 * at];
+  int32_t len = 0x0;
+  int32_t width = editorRowGlyph(row, from, rx, &len, NULL);
+
+  return (cx < from + len) ? rx : rx + width + (cx - from - len);
+}
+
+// Maps a screen column back to the position in "chars" of the glyph drawn
+// over it
+int32_t
+editorRowRxToCx(edt_row* row, int32_t rx)
+{
+  editorRowLayout(row);
+  int32_t cx = (rx < 0) ? 0 : rx;
+
+  if (row->cols) {
+    // last glyph starting at or before "rx"
+    INT_PTR cols = row->cols + 1;
+    int32_t lo = 0, hi = row->cols[0];
+    while (lo < hi) {
+      int32_t mid = lo + (hi - lo) / 2;
+      if (cols[2 * mid + 1] <= rx) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+
+    if (lo) {
+      int32_t from = cols[2 * lo - 2];
+      int32_t len = 0x0;
+      int32_t width = editorRowGlyph(row, from, cols[2 * lo - 1], &len, NULL);
+      int32_t past = rx - cols[2 * lo - 1] - width; // columns after the glyph
+
+      cx = (past < 0) ? from : from + len + past;
+    }
+  }
+
+  return ((size_t)cx > row->size) ? (int32_t)row->size : cx;
+}
+
+// Finds the start of the glyph a position in "chars" falls in
+int32_t
+editorRowGlyphStart(edt_row* row, int32_t cx)
+{
+  editorRowLayout(row);
+  if (!row->cols || (cx < (int32_t)row->size && (BYTE)row->chars[cx] < 0x80 && row->chars[cx] != '\t')) {
+    return cx;
+  }
+
+  int32_t at = editorRowColAt(row, cx);
+  if (at < 0) {
+    return cx;
+  }
+
+  int32_t from = row->cols[1 + 2 * at];
+  int32_t len = 0x0;
+  editorRowGlyph(row, from, row->cols[2 + 2 * at], &len, NULL);
+
+  return (cx < from + len) ? from : cx;
+}
+
+// Drops a row's layout and highlight caches after its contents changed
+void editorUpdateRow(edt_row* row)
+{
+  ARENA_FREE(row->cols);
+  ARENA_FREE(row->highlight);
+  row->laid_out = 0x0;
+
+  editorUpdateSyntax(row);
+}
+
+// Counts the bytes of a row that don't take a column of their own: tabs and
+// those of UTF-8 characters, 16 bytes at a time where SSE2 is around
+int32_t
+editorRowCountWide(CONST_CHAR_PTR text, size_t len)
+{
+  int32_t count = 0x0;
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i tab = _mm_set1_epi8('\t');
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(text + i));
+    u_int32_t mask = _mm_movemask_epi8(chunk) | _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, tab));
+    count += __builtin_popcount(mask);
+  }
+#endif
+
+  for (; i < len; ++i) {
+    count += ((BYTE)text[i] >= 0x80 || text[i] == '\t');
+  }
+
+  return count;
+}
+
+// Lays out a row on screen: works out its width and indexes the position and
+// column of each of its glyphs that isn't a single byte in a single column.
+// Rows of plain ASCII, the common case, are let through after the count.
+edt_row*
+editorRowLayout(edt_row* row)
+{
+  if (row->laid_out) {
+    return row;
+  }
+
+  row->laid_out = 1;
+  row->width = row->size;
+
+  int32_t wide = editorRowCountWide(row->chars, row->size);
+  if (!wide) {
+    return row;
+  }
+
+  // every glyph in the index holds at least one of the counted bytes
+  row->cols = editorArenaAlloc((1 + 2 * wide) * sizeof(int32_t));
+
+  INT_PTR entry = row->cols + 1;
+  int32_t cx = 0, rx = 0;
+  while ((size_t)cx < row->size) {
+    // an ASCII character has a glyph of its own unless marks combine with it
+    if ((BYTE)row->chars[cx] < 0x80 && row->chars[cx] != '\t' && (BYTE)row->chars[cx + 1] < 0x80) {
+      ++cx;
+      ++rx;
+      continue;
+    }
+
+    int32_t len = 0x0;
+    int32_t width = editorRowGlyph(row, cx, rx, &len, NULL);
+    if (len > 1 || (BYTE)row->chars[cx] >= 0x80 || row->chars[cx] == '\t') {
+      *entry++ = cx;
+      *entry++ = rx;
+    }
+    cx += len;
+    rx += width;
+  }
+
+  row->cols[0] = (entry - row->cols - 1) / 2;
+  row->width = rx;
+
+  return row;
+}
+
+void editorInsertRow(int32_t at, CHAR_PTR s, size_t len)
+{
+  if (at < 0 || at > edt_conf.buf->num_rows) {
+    return;
+  }
+
+  // rows are only ever spliced in on node boundaries, so a mapped line
+  // sitting at "at" gets its own node first
+  editorRowAt(at);
+  editorUndoRecord(UNDO_INSERT_ROWS, at, 1, s, len);
+
+  row_node* node = rowNodeNew(1);
+
+  // store new row, s, into our editor's row buffer
+  edt_row* row = &node->row;
+  row->size = len;
+  row->chars = editorArenaAlloc(len + 1);
+  memcpy(row->chars, s, len);
+
+  row->chars[len] = '\0';
+
+  row_node *left = NULL, *right = NULL;
+  rowTreeSplit(edt_conf.buf->rows, at, &left, &right);
+  edt_conf.buf->rows = rowTreeMerge(rowTreeMerge(left, node), right);
+  edt_conf.buf->rows->parent = NULL;
+  ++edt_conf.buf->num_rows;
+
+  // highlighting looks at the neighbours so the row must be linked in first
+  row->hl_open_comment = editorRowStartState(row);
+  editorUpdateRow(row);
+
+  ++edt_conf.buf->dirty;
+}
+
+// Links in "count" rows made of the '\n' separated lines of "text" before
+// row "at" in a single splice, leaving them for the highlighter
+void editorInsertRows(int32_t at, CONST_CHAR_PTR text, size_t len, int32_t count)
+{
+  if (at < 0 || at > edt_conf.buf->num_rows || count <= 0) {
+    return;
+  }
+
+  editorRowAt(at);
+  editorUndoRecord(UNDO_INSERT_ROWS, at, count, text, len);
+
+  row_node* rows = NULL;
+  CONST_CHAR_PTR end = text + len;
+  CONST_CHAR_PTR p = text;
+  for (int32_t i = 0; i < count; ++i) {
+    CONST_CHAR_PTR eol = memchr(p, '\n', end - p);
+    if (!eol) {
+      eol = end;
+    }
+
+    row_node* node = rowNodeNew(1);
+    edt_row* row = &node->row;
+    row->size = eol - p;
+    row->chars = editorArenaAlloc(row->size + 1);
+    memcpy(row->chars, p, row->size);
+    row->chars[row->size] = '\0';
+    row->hl_dirty = node->dirty = 1;
+
+    rows = rowTreeMerge(rows, node);
+    p = (eol < end) ? eol + 1 : end;
+  }
+
+  row_node *left = NULL, *right = NULL;
+  rowTreeSplit(edt_conf.buf->rows, at, &left, &right);
+  edt_conf.buf->rows = rowTreeMerge(rowTreeMerge(left, rows), right);
+  edt_conf.buf->rows->parent = NULL;
+  edt_conf.buf->num_rows += count;
+
+  ++edt_conf.buf->dirty;
+}
+
+// Frees the contents of a single row
+void editorFreeRow(edt_row* row)
+{
+  if (row) {
+    ARENA_FREE(row->cols);
+    ARENA_FREE(row->highlight);
+
+    // a save in progress may still be writing the contents out
+    if (row->chars && ROW_SHARED(row)) {
+      editorSaveKeep(row->chars);
+      row->chars = NULL;
+    }
+    ARENA_FREE(row->chars);
+  }
+}
+
+// Frees the rows of a detached subtree
+void rowTreeFree(row_node* node)
+{
+  if (!node) {
+    return;
+  }
+
+  rowTreeFree(node->left);
+  rowTreeFree(node->right);
+  editorFreeRow(&node->row);
+  editorArenaNodeFree(node);
+}
+
+// Frees every row of every buffer. Rows only live in the arena, which is
+// released as a whole instead of row by row.
+void editorFreeRows(void)
+{
+  editorSavePoll(1);
+  editorArenaReset();
+
+  for (int32_t i = 0; i < edt_conf.buf_count; ++i) {
+    edt_buffer* buf = edt_conf.bufs + i;
+    edt_conf.buf = buf;
+    editorUndoReset();
+    buf->rows = NULL;
+    buf->num_rows = 0;
+    SAFE_FREE(buf->line_index);
+    buf->line_index_len = buf->line_index_cap = 0;
+
+    if (buf->map) {
+      munmap(buf->map, buf->map_len);
+      buf->map = NULL;
+      buf->map_len = 0;
+    }
+  }
+
+  edt_conf.buf = edt_conf.bufs + edt_conf.buf_cur;
+}
+
+// Cuts "count" rows starting at "at" out of the tree with a single split
+void editorDelRows(int32_t at, int32_t count)
+{
+  if (at < 0 || count <= 0 || at + count > edt_conf.buf->num_rows) {
+    return;
+  }
+
+  // the rows to cut must start and end on node boundaries
+  editorRowAt(at);
+  editorRowAt(at + count - 1);
+  if (editorUndoRecord(UNDO_DELETE_ROWS, at, count, NULL, 0)) {
+    for (int32_t i = 0; i < count; ++i) {
+      edt_row* row = editorRowAt(at + i);
+      editorUndoExtend(row->chars, row->size, 0);
+      if (i < count - 1) {
+        editorUndoExtend("\n", 1, 0);
+      }
+    }
+  }
+
+  row_node *left = NULL, *mid = NULL, *right = NULL;
+  rowTreeSplit(edt_conf.buf->rows, at, &left, &right);
+  rowTreeSplit(right, count, &mid, &right);
+  rowTreeFree(mid);
+
+  edt_conf.buf->rows = rowTreeMerge(left, right);
+  if (edt_conf.buf->rows) {
+    edt_conf.buf->rows->parent = NULL;
+  }
+
+  edt_conf.buf->num_rows -= count;
+
+  // the row moving up now starts in the state of a different row
+  int32_t start = 0;
+  row_node* next_node = rowTreeFind(at, &start);
+  if (next_node) {
+    editorUpdateSyntax(&next_node->row);
+  }
+  ++edt_conf.buf->dirty;
+}
+
+void editorDelRow(int32_t at)
+{
+  editorDelRows(at, 1);
+}
+
+// Inserts "len" bytes of "s" into a row before position "at"
+void editorRowInsertStr(edt_row* row, int32_t at, CONST_CHAR_PTR s, size_t len)
+{
+  if (at < 0x0 || (size_t)at > row->size) {
+    at = row->size;
+  }
+
+  editorUndoRecord(UNDO_INSERT_TEXT, editorRowIndex(row), at, s, len);
+  editorRowUnshare(row);
+  row->chars = editorArenaRealloc(row->chars, row->size + len + 1);
+  memmove(row->chars + at + len, row->chars + at, row->size - at + 1);
+  memcpy(row->chars + at, s, len);
+  row->size += len;
+
+  editorUpdateRow(row);
+  ++edt_conf.buf->dirty;
+}
+
+void editorRowInsertChar(edt_row* row, int32_t at, int32_t ch)
+{
+  // add characters to a line/row
+  char c = ch;
+  editorRowInsertStr(row, at, &c, 1);
+}
+
+void editorRowAppendStr(edt_row* row, CHAR_PTR s, size_t len)
+{
+  editorRowInsertStr(row, row->size, s, len);
+}
+
+// Removes up to "len" bytes of a row starting at position "at"
+void editorRowDelStr(edt_row* row, int32_t at, size_t len)
+{
+  if (at < 0 || (size_t)at >= row->size) {
+    return;
+  }
+
+  if (len > row->size - at) {
+    len = row->size - at;
+  }
+
+  editorUndoRecord(UNDO_DELETE_TEXT, editorRowIndex(row), at, row->chars + at, len);
+  editorRowUnshare(row);
+  memmove(row->chars + at, row->chars + at + len, row->size - at - len + 1);
+
+  row->size -= len;
+  editorUpdateRow(row);
+  ++edt_conf.buf->dirty;
+}
+
+/***                                EDITOR OPERATIONS                      ***/
+void editorInsertChar(int32_t ch)
+{
+  // add newline to EOF
+  if (edt_conf.buf->csr_y == edt_conf.buf->num_rows) {
+    editorInsertRow(edt_conf.buf->num_rows, "", 0x0);
+  }
+
+  editorRowInsertChar(editorRowAt(edt_conf.buf->csr_y), edt_conf.buf->csr_x, ch);
+
+  ++edt_conf.buf->csr_x;
+}
+
+void editorInsertNewLine(void)
+{
+  if (edt_conf.buf->csr_x == 0) {
+    editorInsertRow(edt_conf.buf->csr_y, "", 0);
+  } else {
+    edt_row* row = editorRowAt(edt_conf.buf->csr_y);
+    editorInsertRow(edt_conf.buf->csr_y + 1,
+        row->chars + edt_conf.buf->csr_x,
+        row->size - edt_conf.buf->csr_x);
+
+    editorRowDelStr(row, edt_conf.buf->csr_x, row->size - edt_conf.buf->csr_x);
+  }
+
+  ++edt_conf.buf->csr_y;
+  edt_conf.buf->csr_x = 0;
+}
+
+// Inserts text spanning any number of lines at the cursor. The row under the
+// cursor is split around it and all the new rows are linked into the tree in
+// a single splice, then left for the highlighter to catch up on.
+void editorInsertText(CONST_CHAR_PTR text, size_t len)
+{
+  if (!len) {
+    return;
+  }
+
+  if (edt_conf.buf->csr_y == edt_conf.buf->num_rows) {
+    editorInsertRow(edt_conf.buf->num_rows, "", 0x0);
+  }
+
+  edt_row* row = editorRowAt(edt_conf.buf->csr_y);
+  CONST_CHAR_PTR end = text + len;
+  CONST_CHAR_PTR eol = text;
+  while (eol < end && *eol != '\r' && *eol != '\n') {
+    ++eol;
+  }
+
+  if (eol == end) {
+    editorRowInsertStr(row, edt_conf.buf->csr_x, text, len);
+    edt_conf.buf->csr_x += len;
+    return;
+  }
+
+  // the following lines are gathered '\n' separated, what follows the cursor
+  // moving behind the last one
+  size_t tail_len = row->size - edt_conf.buf->csr_x;
+  CHAR_PTR lines = malloc((end - eol) + tail_len);
+  if (!lines) {
+    HANDLE_ERR("malloc")
+  }
+
+  size_t lines_len = 0;
+  size_t last_len = 0;
+  int32_t count = 0;
+  for (CONST_CHAR_PTR p = eol; p < end; ++count) {
+    // "\r\n", "\r" and "\n" all break lines
+    p += (p[0] == '\r' && p + 1 < end && p[1] == '\n') ? 2 : 1;
+    CONST_CHAR_PTR line_end = p;
+    while (line_end < end && *line_end != '\r' && *line_end != '\n') {
+      ++line_end;
+    }
+
+    if (count) {
+      lines[lines_len++] = '\n';
+    }
+    last_len = line_end - p;
+    memcpy(lines + lines_len, p, last_len);
+    lines_len += last_len;
+    p = line_end;
+  }
+
+  memcpy(lines + lines_len, row->chars + edt_conf.buf->csr_x, tail_len);
+  lines_len += tail_len;
+
+  editorRowDelStr(row, edt_conf.buf->csr_x, tail_len);
+  editorRowInsertStr(row, edt_conf.buf->csr_x, text, eol - text);
+  editorInsertRows(edt_conf.buf->csr_y + 1, lines, lines_len, count);
+  SAFE_FREE(lines);
+
+  edt_conf.buf->csr_y += count;
+  edt_conf.buf->csr_x = last_len;
+}
+
+// Inserts a bracketed paste as a whole instead of key by key
+void editorPaste(void)
+{
+  size_t len = 0;
+  CHAR_PTR text = editorReadPaste(&len);
+
+  editorInsertText(text, len);
+  SAFE_FREE(text);
+}
+
+void editorDelChar(void)
+{
+  if (edt_conf.buf->csr_y == edt_conf.buf->num_rows) {
+    return;
+  }
+
+  if (edt_conf.buf->csr_x == 0 && edt_conf.buf->csr_y == 0) {
+    return;
+  }
+
+  edt_row* row = editorRowAt(edt_conf.buf->csr_y);
+  if (edt_conf.buf->csr_x > 0) {
+    // a character spanning several bytes goes as a whole
+    int32_t from = editorRowGlyphStart(row, edt_conf.buf->csr_x - 1);
+    editorRowDelStr(row, from, edt_conf.buf->csr_x - from);
+    edt_conf.buf->csr_x = from;
+  } else {
+    edt_row* prev_row = editorRowPrev(row);
+    edt_conf.buf->csr_x = prev_row->size;
+    editorRowAppendStr(prev_row, row->chars, row->size);
+    editorDelRow(edt_conf.buf->csr_y);
+    --edt_conf.buf->csr_y;
+  }
+}
+
+/***                                UNDO                                   ***/
+
+// Makes room for the log to grow up to "size" bytes
+void editorUndoReserve(size_t size)
+{
+  edt_undo* undo = &edt_conf.buf->undo;
+  if (size <= undo->cap) {
+    return;
+  }
+
+  size_t cap = undo->cap ? undo->cap * 2 : 4096;
+  while (cap < size) {
+    cap *= 2;
+  }
+
+  BYTE* log = realloc(undo->log, cap);
+  if (!log) {
+    HANDLE_ERR("realloc")
+  }
+
+  undo->log = log;
+  undo->cap = cap;
+}
+
+// Logs an edit about to be made, unless it continues the typing run of the
+// last record, which then just grows. Returns the record, which more text
+// may be appended to, or NULL when edits aren't being logged.
+undo_rec*
+editorUndoRecord(u_int8_t type, int32_t row, int32_t col, CONST_CHAR_PTR text, size_t len)
+{
+  edt_undo* undo = &edt_conf.buf->undo;
+  if (undo->paused) {
+    return NULL;
+  }
+
+  // a new edit drops whatever could have been redone
+  undo->end = undo->cursor;
+  undo->touched = 1;
+
+  if (undo->run && undo->last != UNDO_NONE && len) {
+    undo_rec* rec = UNDO_REC(undo->last);
+    if (rec->type == type && rec->row == row) {
+      if (type == UNDO_INSERT_TEXT && (size_t)col == rec->col + rec->len) {
+        editorUndoExtend(text, len, 0);
+        return UNDO_REC(undo->last);
+      }
+
+      // "Delete" keeps deleting at the same spot, "Backspace" right before
+      if (type == UNDO_DELETE_TEXT && (col == rec->col || (size_t)col + len == (size_t)rec->col)) {
+        u_int8_t front = ((size_t)col + len == (size_t)rec->col);
+        editorUndoExtend(text, len, front);
+        rec = UNDO_REC(undo->last);
+        rec->col = col;
+        return rec;
+      }
+    }
+  }
+
+  size_t at = undo->end;
+  editorUndoReserve(at + UNDO_REC_SIZE(len));
+
+  undo_rec* rec = UNDO_REC(at);
+  rec->type = type;
+  rec->first = !undo->open;
+  rec->row = row;
+  rec->col = col;
+  rec->len = len;
+  rec->prev = (undo->last == UNDO_NONE) ? 0 : at - undo->last;
+  rec->before_x = rec->after_x = undo->csr_x;
+  rec->before_y = rec->after_y = undo->csr_y;
+  if (len) {
+    memcpy(rec + 1, text, len);
+  }
+
+  undo->last = at;
+  undo->cursor = undo->end = at + UNDO_REC_SIZE(len);
+  undo->open = 1;
+  return rec;
+}
+
+// Appends text to the last record, or puts it in front of the record's own
+void editorUndoExtend(CONST_CHAR_PTR text, size_t len, u_int8_t front)
+{
+  edt_undo* undo = &edt_conf.buf->undo;
+  editorUndoReserve(undo->last + UNDO_REC_SIZE(UNDO_REC(undo->last)->len + len));
+
+  undo_rec* rec = UNDO_REC(undo->last);
+  BYTE* payload = (BYTE*)(rec + 1);
+  if (front) {
+    memmove(payload + len, payload, rec->len);
+    memcpy(payload, text, len);
+  } else {
+    memcpy(payload + rec->len, text, len);
+  }
+
+  rec->len += len;
+  undo->cursor = undo->end = undo->last + UNDO_REC_SIZE(rec->len);
+}
+
+// Starts logging the edits of a keypress as a group of their own. Typing keys
+// may instead keep extending the run of the previous one.
+void editorUndoBegin(u_int8_t typing)
+{
+  edt_undo* undo = &edt_conf.buf->undo;
+  undo->open = 0;
+  undo->run &= typing;
+  undo->touched = 0;
+  undo->csr_x = edt_conf.buf->csr_x;
+  undo->csr_y = edt_conf.buf->csr_y;
+}
+
+// Closes the group of a keypress, noting where it left the cursor
+void editorUndoEnd(u_int8_t typing)
+{
+  edt_undo* undo = &edt_conf.buf->undo;
+  if (!undo->touched || undo->last == UNDO_NONE) {
+    return;
+  }
+
+  undo_rec* rec = UNDO_REC(undo->last);
+  rec->after_x = edt_conf.buf->csr_x;
+  rec->after_y = edt_conf.buf->csr_y;
+  undo->run = typing && (rec->type == UNDO_INSERT_TEXT || rec->type == UNDO_DELETE_TEXT);
+  undo->touched = 0;
+
+  editorUndoTrim();
+}
+
+// Drops the oldest groups until the log fits in its limit, then moves what is
+// left to the front once the dropped part outweighs it
+void editorUndoTrim(void)
+{
+  edt_undo* undo = &edt_conf.buf->undo;
+  while (undo->end - undo->head > undo->limit && undo->head < undo->cursor) {
+    do {
+      undo->head += UNDO_REC_SIZE(UNDO_REC(undo->head)->len);
+    } while (undo->head < undo->cursor && !UNDO_REC(undo->head)->first);
+  }
+
+  if (undo->head == undo->cursor) {
+    undo->last = UNDO_NONE;
+    undo->run = 0;
+  }
+
+  if (undo->head < undo->end) {
+    UNDO_REC(undo->head)->prev = 0;
+  }
+
+  if (undo->head && undo->head >= undo->end - undo->head) {
+    memmove(undo->log, undo->log + undo->head, undo->end - undo->head);
+    undo->cursor -= undo->head;
+    undo->end -= undo->head;
+    if (undo->last != UNDO_NONE) {
+      undo->last -= undo->head;
+    }
+    undo->head = 0;
+  }
+}
+
+// Returns the bytes of history a buffer keeps: $MILLI_UNDO_LIMIT when it holds
+// a size, with an optional K, M or G suffix, UNDO_LOG_LIMIT otherwise
+size_t
+editorUndoLimit(void)
+{
+  CONST_CHAR_PTR env = getenv("MILLI_UNDO_LIMIT");
+  if (!env || !*env) {
+    return UNDO_LOG_LIMIT;
+  }
+
+  CHAR_PTR end = NULL;
+  errno = 0;
+  unsigned long long limit = strtoull(env, &end, 10);
+  if (end == env || errno || *env == '-') {
+    return UNDO_LOG_LIMIT;
+  }
+
+  int32_t shift = 0;
+  switch (toupper((BYTE)*end)) {
+  case 'K':
+    shift = 10;
+    break;
+  case 'M':
+    shift = 20;
+    break;
+  case 'G':
+    shift = 30;
+    break;
+  }
+  end += (shift != 0);
+
+  if (*end || limit > (SIZE_MAX >> shift)) {
+    return UNDO_LOG_LIMIT;
+  }
+
+  return (size_t)limit << shift;
+}
+
+// Forgets the whole history
+void editorUndoReset(void)
+{
+  edt_undo* undo = &edt_conf.buf->undo;
+  SAFE_FREE(undo->log);
+  undo->cap = undo->head = undo->cursor = undo->end = 0;
+  undo->last = UNDO_NONE;
+  undo->open = undo->run = undo->touched = 0;
+}
+
+// Replays a record, or reverts it when "revert" is set
+void editorUndoApply(undo_rec* rec, u_int8_t revert)
+{
+  CONST_CHAR_PTR text = (CONST_CHAR_PTR)(rec + 1);
+  u_int8_t insert = (rec->type == UNDO_INSERT_TEXT || rec->type == UNDO_INSERT_ROWS) != revert;
+
+  if (rec->type == UNDO_INSERT_ROWS || rec->type == UNDO_DELETE_ROWS) {
+    if (insert) {
+      editorInsertRows(rec->row, text, rec->len, rec->col);
+    } else {
+      editorDelRows(rec->row, rec->col);
+    }
+    return;
+  }
+
+  edt_row* row = editorRowAt(rec->row);
+  if (!row) {
+    return;
+  }
+
+  if (insert) {
+    editorRowInsertStr(row, rec->col, text, rec->len);
+  } else {
+    editorRowDelStr(row, rec->col, rec->len);
+  }
+}
+
+// Puts the cursor back where a group of edits had it, within the text
+void editorUndoMoveCursor(int32_t x, int32_t y)
+{
+  edt_conf.buf->csr_y = (y > edt_conf.buf->num_rows) ? edt_conf.buf->num_rows : y;
+
+  edt_row* row = editorRowAt(edt_conf.buf->csr_y);
+  int32_t size = row ? (int32_t)row->size : 0;
+  edt_conf.buf->csr_x = (x > size) ? size : x;
+}
+
+// Reverts the last group of edits, all of them before the next redraw
+void editorUndo(void)
+{
+  edt_undo* undo = &edt_conf.buf->undo;
+  if (undo->last == UNDO_NONE) {
+    editorSetStatusMessage("Nothing to undo.");
+    return;
+  }
+
+  undo_rec* rec = NULL;
+  undo->paused = 1;
+  do {
+    rec = UNDO_REC(undo->last);
+    editorUndoApply(rec, 1);
+    undo->cursor = undo->last;
+    undo->last = rec->prev ? undo->last - rec->prev : UNDO_NONE;
+  } while (!rec->first && undo->last != UNDO_NONE);
+  undo->paused = 0;
+
+  editorUndoMoveCursor(rec->before_x, rec->before_y);
+}
+
+// Replays the group of edits undone last
+void editorRedo(void)
+{
+  edt_undo* undo = &edt_conf.buf->undo;
+  if (undo->cursor == undo->end) {
+    editorSetStatusMessage("Nothing to redo.");
+    return;
+  }
+
+  undo_rec* rec = NULL;
+  undo->paused = 1;
+  do {
+    rec = UNDO_REC(undo->cursor);
+    editorUndoApply(rec, 0);
+    undo->last = undo->cursor;
+    undo->cursor += UNDO_REC_SIZE(rec->len);
+  } while (undo->cursor < undo->end && !UNDO_REC(undo->cursor)->first);
+  undo->paused = 0;
+
+  editorUndoMoveCursor(rec->after_x, rec->after_y);
+}
+
+/***                                FILE I/O                               ***/
+
+// Hands the queued pieces to writev until all of them made it to the file,
+// picking up where a short write stopped. Returns -1 on I/O errors.
+int32_t
+editorSaveFlush(save_batch* batch)
+{
+  struct iovec* iov = batch->iov;
+  int32_t count = batch->count;
+
+  while (count > 0) {
+    ssize_t n = writev(batch->fd, iov, count);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+
+    batch->written += n;
+    for (; count > 0 && (size_t)n >= iov->iov_len; ++iov, --count) {
+      n -= iov->iov_len;
+    }
+
+    if (count > 0) {
+      iov->iov_base = (BYTE*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  batch->count = 0;
+  atomic_store(batch->progress, batch->written);
+  return 0;
+}
+
+// Queues "len" bytes of "text", which must stay put until the batch is flushed
+int32_t
+editorSaveAppend(save_batch* batch, CONST_CHAR_PTR text, size_t len)
+{
+  if (batch->count == SAVE_IOV_MAX && editorSaveFlush(batch) == -1) {
+    return -1;
+  }
+
+  batch->iov[batch->count].iov_base = (PTR_T)text;
+  batch->iov[batch->count].iov_len = len;
+  ++batch->count;
+  return 0;
+}
+
+// Queues a run of mapped lines the way they would have been read line by line
+int32_t
+editorSpanWrite(save_batch* batch, CONST_CHAR_PTR span, size_t len, u_int8_t crlf)
+{
+  CONST_CHAR_PTR span_end = span + len;
+
+  // without carriage returns the mapped bytes already are the file's contents
+  if (!crlf) {
+    if (editorSaveAppend(batch, span, len) == -1) {
+      return -1;
+    }
+
+    return span_end[-1] == '\n' ? 0 : editorSaveAppend(batch, "\n", 1);
+  }
+
+  for (CONST_CHAR_PTR p = span; p < span_end;) {
+    size_t line_len = 0;
+    p = editorSpanLine(p, span_end - p, 0, &line_len);
+    if (editorSaveAppend(batch, p, line_len) == -1 || editorSaveAppend(batch, "\n", 1) == -1) {
+      return -1;
+    }
+
+    p = memchr(p, '\n', span_end - p);
+    p = p ? p + 1 : span_end;
+  }
+
+  return 0;
+}
+
+// Streams the pieces of a save's snapshot to "fd" without building a copy of
+// the buffer: rows and mapped spans are written from where they already live
+int32_t
+editorWritePieces(int32_t fd, edt_save* save)
+{
+  save_batch batch;
+  batch.count = 0;
+  batch.fd = fd;
+  batch.written = 0;
+  batch.progress = &save->written;
+
+  for (size_t i = 0; i < save->count; ++i) {
+    save_piece* piece = save->pieces + i;
+    if (piece->mapped) {
+      if (editorSpanWrite(&batch, piece->text, piece->len, save->crlf) == -1) {
+        return -1;
+      }
+    } else if (editorSaveAppend(&batch, piece->text, piece->len) == -1
+        || editorSaveAppend(&batch, "\n", 1) == -1) {
+      return -1;
+    }
+  }
+
+  return editorSaveFlush(&batch);
+}
+
+// Reads a file that can't be mapped(pipes, devices...) line by line
+void editorOpenStream(FILE* fp)
+{
+  CHAR_PTR line = NULL;
+  size_t line_cap = 0;
+  ssize_t line_len = 0;
+
+  // loading isn't an edit that can be undone
+  edt_conf.buf->undo.paused = 1;
+
+  // register the read data into the editor for display
+  while ((line_len = getline(&line, &line_cap, fp)) != -1) {
+    // strip off newline or carriage return characters
+    while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) {
+      --line_len;
+    }
+
+    editorInsertRow(edt_conf.buf->num_rows, line, line_len);
+  }
+
+  edt_conf.buf->undo.paused = 0;
+  SAFE_FREE(line);
+}
+
+// Opens a file from disk. Regular files are memory-mapped and only their line
+// count is taken up front: rows get built as they are viewed or edited.
+void editorOpen()
+{
+  editorSelectSyntaxHighlight();
+
+  // open file for reading
+  FILE* fp = fopen(edt_conf.buf->fname, "r");
+  if (!fp) {
+    HANDLE_ERR("fopen")
+  }
+
+  struct stat st;
+  if (fstat(fileno(fp), &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    editorOpenStream(fp);
+    fclose(fp);
+    edt_conf.buf->dirty = 0;
+    return;
+  }
+
+  CHAR_PTR map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+  if (map == MAP_FAILED) {
+    editorOpenStream(fp);
+    fclose(fp);
+    edt_conf.buf->dirty = 0;
+    return;
+  }
+
+  // the mapping outlives the descriptor
+  fclose(fp);
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  edt_conf.buf->map = map;
+  edt_conf.buf->map_len = st.st_size;
+  edt_conf.buf->map_crlf = (memchr(map, '\r', st.st_size) != NULL);
+
+  // the whole file starts out as a single mapped span
+  row_node* node = rowNodeNew((int32_t)editorIndexLines(map, st.st_size));
+  node->span = map;
+  node->span_len = st.st_size;
+
+  edt_conf.buf->rows = node;
+  edt_conf.buf->num_rows = node->lines;
+  edt_conf.buf->dirty = 0;
+
+  // the highlighter works out the comment state of the lines in the background
+  if (edt_conf.buf->syntax) {
+    editorUpdateSyntax(&node->row);
+  }
+
+  madvise(map, st.st_size, MADV_RANDOM);
+}
+
+// Replaces the file a save is for with its snapshot. It goes to a temporary
+// file in the same directory first which is then renamed over the old one,
+// so a failed save leaves the file untouched. Unmapped lines keep pointing
+// into the old file's mapping, which outlives its name.
+int32_t
+editorWriteFile(edt_save* save)
+{
+  // write next to the file a symbolic link points at rather than over the link
+  CHAR_PTR path = realpath(save->fname, NULL);
+  if (!path) {
+    path = strdup(save->fname);
+  }
+
+  size_t path_len = strlen(path);
+  CHAR_PTR tmp = malloc(path_len + sizeof(".XXXXXX"));
+  if (!tmp) {
+    SAFE_FREE(path);
+    return -1;
+  }
+  memcpy(tmp, path, path_len);
+  memcpy(tmp + path_len, ".XXXXXX", sizeof(".XXXXXX"));
+
+  struct stat st;
+  mode_t mode = 0;
+  if (stat(path, &st) != -1) {
+    mode = st.st_mode & 07777;
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    mode = 0666 & ~mask;
+  }
+
+  int32_t ret = -1;
+  int32_t fd = mkstemp(tmp);
+  if (fd != -1) {
+    int32_t ok = fchmod(fd, mode) != -1 && editorWritePieces(fd, save) != -1
+        && fsync(fd) != -1;
+    int32_t err = errno;
+    if (close(fd) == -1 && ok) {
+      ok = 0;
+      err = errno;
+    }
+
+    if (ok && rename(tmp, path) != -1) {
+      editorSyncDir(path);
+      ret = 0;
+    } else {
+      err = ok ? errno : err;
+      unlink(tmp);
+      errno = err;
+    }
+  }
+
+  SAFE_FREE(tmp);
+  SAFE_FREE(path);
+  return ret;
+}
+
+// Flushes the directory holding "path" so a rename into it survives a crash
+void editorSyncDir(CONST_CHAR_PTR path)
+{
+  CONST_CHAR_PTR slash = strrchr(path, '/');
+  CHAR_PTR dir = slash ? strndup(path, slash - path + 1) : strdup(".");
+
+  int32_t fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+
+  SAFE_FREE(dir);
+}
+
+// Holds on to a block of row contents the writer may still be reading
+void editorSaveKeep(PTR_T block)
+{
+  edt_save* save = &edt_conf.save;
+  if (save->kept_count == save->kept_cap) {
+    save->kept_cap = save->kept_cap ? save->kept_cap * 2 : 64;
+    save->kept = realloc(save->kept, save->kept_cap * sizeof(PTR_T));
+    if (!save->kept) {
+      HANDLE_ERR("realloc")
+    }
+  }
+
+  save->kept[save->kept_count++] = block;
+}
+
+// Gives a row a copy of its contents of its own before it gets changed while
+// a save may still be writing the old ones out. Rows are copied at most once
+// per save.
+void editorRowUnshare(edt_row* row)
+{
+  if (!ROW_SHARED(row)) {
+    return;
+  }
+
+  CHAR_PTR chars = editorArenaAlloc(row->size + 1);
+  memcpy(chars, row->chars, row->size + 1);
+  editorSaveKeep(row->chars);
+
+  row->chars = chars;
+  row->save_gen = edt_conf.save.gen;
+}
+
+PTR_T
+editorSaveWorker(PTR_T arg)
+{
+  edt_save* save = arg;
+  save->error = (editorWriteFile(save) == -1) ? errno : 0;
+  atomic_store(&save->done, 1);
+  return NULL;
+}
+
+// Takes a snapshot of where the rows' contents live and starts writing it out
+// on a thread of its own. Only pointers are copied: every row present now
+// becomes shared with the writer until it is done.
+int32_t
+editorSaveStart(void)
+{
+  edt_save* save = &edt_conf.save;
+  size_t cap = 0;
+  save->count = 0;
+  save->total = 0;
+
+  row_node* node = rowTreeFirst(edt_conf.buf->rows);
+  for (; node; node = rowTreeNext(node)) {
+    if (save->count == cap) {
+      cap = cap ? cap * 2 : 1024;
+      save_piece* grown = realloc(save->pieces, cap * sizeof(save_piece));
+      if (!grown) {
+        SAFE_FREE(save->pieces);
+        return -1;
+      }
+      save->pieces = grown;
+    }
+
+    save_piece* piece = save->pieces + save->count++;
+    piece->mapped = ROW_MAPPED(node);
+    piece->text = piece->mapped ? node->span : node->row.chars;
+    piece->len = piece->mapped ? node->span_len : node->row.size;
+    save->total += piece->len + !piece->mapped;
+  }
+
+  save->buf = edt_conf.buf_cur;
+  save->fname = strdup(edt_conf.buf->fname);
+  save->crlf = edt_conf.buf->map_crlf;
+  save->dirty = edt_conf.buf->dirty;
+  save->error = 0;
+  atomic_store(&save->written, 0);
+  atomic_store(&save->done, 0);
+  ++save->gen;
+  save->running = 1;
+
+  // without a thread to spare the save is done right away
+  if (pthread_create(&save->thread, NULL, editorSaveWorker, save)) {
+    save->thread = pthread_self();
+    editorSaveWorker(save);
+  }
+
+  return 0;
+}
+
+// Checks on a running save, or waits for it to end when "wait" is set. Once
+// the writer is done its snapshot is let go of and the edits it covered stop
+// counting as unsaved. Returns whether the message bar changed.
+u_int8_t
+editorSavePoll(u_int8_t wait)
+{
+  edt_save* save = &edt_conf.save;
+  if (!save->running) {
+    return 0;
+  }
+
+  // still going, the progress moved on
+  if (!wait && !atomic_load(&save->done)) {
+    return 1;
+  }
+
+  if (!pthread_equal(save->thread, pthread_self())) {
+    pthread_join(save->thread, NULL);
+  }
+  save->running = 0;
+
+  for (size_t i = 0; i < save->kept_count; ++i) {
+    ARENA_FREE(save->kept[i]);
+  }
+  save->kept_count = 0;
+  SAFE_FREE(save->pieces);
+  save->count = 0;
+  SAFE_FREE(save->fname);
+
+  if (save->error) {
+    editorSetStatusMessage("Failed to save file. I/O error: %s", strerror(save->error));
+    return 1;
+  }
+
+  // edits made while saving are still unsaved, in whichever buffer is shown by now
+  edt_buffer* buf = edt_conf.bufs + save->buf;
+  buf->dirty = (buf->dirty > save->dirty) ? buf->dirty - save->dirty : 0;
+  editorSetStatusMessage("%lld bytes were written to DISK.", (long long)atomic_load(&save->written));
+  return 1;
+}
+
+// Saves the buffer in the background, editing can go on meanwhile
+void editorSave(void)
+{
+  if (edt_conf.save.running) {
+    editorSetStatusMessage("A save is already in progress.");
+    return;
+  }
+
+  if (!edt_conf.buf->fname) {
+    edt_conf.buf->fname = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+
+    if (!edt_conf.buf->fname) {
+      editorSetStatusMessage("Save ABORTED!");
+      return;
+    }
+
+    edt_conf.buf->empty_file = 1;
+    editorSelectSyntaxHighlight();
+  }
+
+  if (editorSaveStart() == -1) {
+    editorSetStatusMessage("Failed to save file. %s", strerror(errno));
+  }
+}
+
+/***                                BUFFERS                                ***/
+
+// Adds an empty buffer, returning its index. The buffers may move, so the one
+// on screen is looked up again.
+int32_t
+editorBufferNew(void)
+{
+  edt_buffer* bufs = realloc(edt_conf.bufs, (edt_conf.buf_count + 1) * sizeof(edt_buffer));
+  if (!bufs) {
+    HANDLE_ERR("realloc")
+  }
+
+  edt_buffer* buf = bufs + edt_conf.buf_count;
+  memset(buf, 0, sizeof(edt_buffer));
+  buf->undo.last = UNDO_NONE;
+  buf->undo.limit = editorUndoLimit();
+
+  edt_conf.bufs = bufs;
+  edt_conf.buf = bufs + edt_conf.buf_cur;
+  return edt_conf.buf_count++;
+}
+
+// Opens a file in a buffer of its own, leaving the one on screen alone
+int32_t
+editorBufferOpen(CHAR_PTR fname)
+{
+  int32_t cur = edt_conf.buf_cur;
+  int32_t index = editorBufferNew();
+
+  edt_conf.buf_cur = index;
+  edt_conf.buf = edt_conf.bufs + index;
+  edt_conf.buf->fname = fname;
+  editorOpen();
+
+  edt_conf.buf_cur = cur;
+  edt_conf.buf = edt_conf.bufs + cur;
+  return index;
+}
+
+// Puts another buffer on screen, wrapping around at either end. Buffers keep
+// their rows, highlighting included, and where the cursor and the view were,
+// so nothing gets loaded again: the next frame just draws it.
+void editorBufferSwitch(int32_t index)
+{
+  index = (index + edt_conf.buf_count) % edt_conf.buf_count;
+  if (index == edt_conf.buf_cur) {
+    editorSetStatusMessage("No other file is open.");
+    return;
+  }
+
+  // the matches found point into the rows of the buffer they were found in
+  editorSearchReset();
+
+  edt_conf.buf_cur = index;
+  edt_conf.buf = edt_conf.bufs + index;
+  editorSetStatusMessage("[%d/%d] %s",
+      index + 1,
+      edt_conf.buf_count,
+      edt_conf.buf->fname ? edt_conf.buf->fname : "[ No name ]");
+}
+
+/***                                REGEX                                  ***/
+
+// Adds a node to the parse tree, returning its index or -1 when out of memory
+int32_t
+regexNewNode(re_parser* parser, u_int8_t type, int32_t left, int32_t right)
+{
+  if (parser->count == parser->cap) {
+    int32_t new_cap = parser->cap ? parser->cap * 2 : 32;
+    re_node* grown = realloc(parser->nodes, new_cap * sizeof(re_node));
+    if (!grown) {
+      parser->error = 1;
+      return -1;
+    }
+
+    parser->nodes = grown;
+    parser->cap = new_cap;
+  }
+
+  re_node* node = parser->nodes + parser->count;
+  memset(node, 0, sizeof(re_node));
+  node->type = type;
+  node->left = left;
+  node->right = right;
+  return parser->count++;
+}
+
+// Adds a byte to a set, along with its other case when ignoring case
+void regexAddChar(re_parser* parser, BYTE* set, BYTE ch)
+{
+  SET_ADD(set, ch);
+  if (parser->icase && isalpha(ch)) {
+    SET_ADD(set, islower(ch) ? toupper(ch) : tolower(ch));
+  }
+}
+
+// Parses the character after a '\'. Returns whether it was a class escape
+// such as "\d", whose set then gets filled in.
+u_int8_t
+regexParseEscape(re_parser* parser, BYTE* set)
+{
+  BYTE ch = *parser->p;
+  if (!ch) {
+    parser->error = 1;
+    return 0;
+  }
+
+  ++parser->p;
+  BYTE lower = tolower(ch);
+  if (lower != 'd' && lower != 'w' && lower != 's') {
+    return 0;
+  }
+
+  BYTE class_set[32] = { 0 };
+  for (int32_t c = 0; c < 256; ++c) {
+    if ((lower == 'd' && isdigit(c)) || (lower == 'w' && (isalnum(c) || c == '_'))
+        || (lower == 's' && isspace(c))) {
+      SET_ADD(class_set, c);
+    }
+  }
+
+  // "\D", "\W" and "\S" are the complements
+  for (int32_t i = 0; i < 32; ++i) {
+    set[i] |= isupper(ch) ? (BYTE)~class_set[i] : class_set[i];
+  }
+
+  return 1;
+}
+
+// Parses a bracket expression such as "[a-z_]" or "[^0-9]"
+int32_t
+regexParseClass(re_parser* parser)
+{
+  BYTE set[32] = { 0 };
+  u_int8_t negate = 0;
+
+  if (*parser->p == '^') {
+    negate = 1;
+    ++parser->p;
+  }
+
+  // a ']' right after the opening bracket is a literal
+  for (u_int8_t first = 1; *parser->p && (first || *parser->p != ']'); first = 0) {
+    BYTE lo = *parser->p++;
+    if (lo == '\\') {
+      lo = *parser->p;
+      if (regexParseEscape(parser, set)) {
+        continue;
+      }
+    }
+
+    BYTE hi = lo;
+    if (parser->p[0] == '-' && parser->p[1] && parser->p[1] != ']') {
+      hi = parser->p[1];
+      parser->p += 2;
+      if (hi == '\\') {
+        hi = *parser->p;
+        if (regexParseEscape(parser, set)) {
+          parser->error = 1;
+        }
+      }
+    }
+
+    for (int32_t c = lo; c <= hi; ++c) {
+      regexAddChar(parser, set, c);
+    }
+  }
+
+  if (*parser->p != ']') {
+    parser->error = 1;
+    return -1;
+  }
+  ++parser->p;
+
+  int32_t node = regexNewNode(parser, RE_SET, -1, -1);
+  if (node >= 0) {
+    for (int32_t i = 0; i < 32; ++i) {
+      parser->nodes[node].set[i] = negate ? (BYTE)~set[i] : set[i];
+    }
+  }
+
+  return node;
+}
+
+// atom := '(' alt ')' | '[' class ']' | '.' | '\' escape | literal
+int32_t
+regexParseAtom(re_parser* parser)
+{
+  BYTE ch = *parser->p++;
+  if (ch == '(') {
+    int32_t node = regexParseAlt(parser);
+    if (*parser->p != ')') {
+      parser->error = 1;
+      return -1;
+    }
+
+    ++parser->p;
+    return node;
+  }
+
+  if (ch == '[') {
+    return regexParseClass(parser);
+  }
+
+  int32_t node = regexNewNode(parser, RE_SET, -1, -1);
+  if (node < 0) {
+    return -1;
+  }
+
+  BYTE* set = parser->nodes[node].set;
+  if (ch == '.') {
+    memset(set, 0xff, 32);
+  } else if (ch == '\\') {
+    ch = *parser->p;
+    if (!regexParseEscape(parser, set)) {
+      regexAddChar(parser, set, ch);
+    }
+  } else if (ch == '*' || ch == '+' || ch == '?') {
+    // nothing to repeat
+    parser->error = 1;
+  } else {
+    regexAddChar(parser, set, ch);
+  }
+
+  return node;
+}
+
+// repeat := atom ('*' | '+' | '?')*
+int32_t
+regexParseRepeat(re_parser* parser)
+{
+  int32_t node = regexParseAtom(parser);
+  for (;;) {
+    BYTE ch = *parser->p;
+    u_int8_t type = (ch == '*') ? RE_STAR : (ch == '+') ? RE_PLUS : (ch == '?') ? RE_QUEST : RE_EMPTY;
+    if (type == RE_EMPTY || parser->error) {
+      return node;
+    }
+
+    ++parser->p;
+    node = regexNewNode(parser, type, node, -1);
+  }
+}
+
+// cat := repeat*
+int32_t
+regexParseCat(re_parser* parser)
+{
+  int32_t node = -1;
+  while (!parser->error && *parser->p && *parser->p != '|' && *parser->p != ')') {
+    // '$' only anchors at the very end of the pattern
+    if (*parser->p == '$' && !parser->p[1]) {
+      break;
+    }
+
+    int32_t next = regexParseRepeat(parser);
+    node = (node < 0) ? next : regexNewNode(parser, RE_CAT, node, next);
+  }
+
+  return (node < 0) ? regexNewNode(parser, RE_EMPTY, -1, -1) : node;
+}
+
+// alt := cat ('|' cat)*
+int32_t
+regexParseAlt(re_parser* parser)
+{
+  int32_t node = regexParseCat(parser);
+  while (!parser->error && *parser->p == '|') {
+    ++parser->p;
+    node = regexNewNode(parser, RE_ALT, node, regexParseCat(parser));
+  }
+
+  return node;
+}
+
+// Adds a state to the NFA, returning its index or -1 when out of memory
+int32_t
+regexNewState(re_prog* prog, u_int8_t type, int32_t out, int32_t out1)
+{
+  if (prog->count == prog->cap) {
+    int32_t new_cap = prog->cap ? prog->cap * 2 : 64;
+    re_state* grown = realloc(prog->states, new_cap * sizeof(re_state));
+    if (!grown) {
+      return -1;
+    }
+
+    prog->states = grown;
+    prog->cap = new_cap;
+  }
+
+  re_state* state = prog->states + prog->count;
+  memset(state, 0, sizeof(re_state));
+  state->type = type;
+  state->out = out;
+  state->out1 = out1;
+  return prog->count++;
+}
+
+// Compiles a subtree into NFA states leading to "next" and returns its entry
+// state. Concatenations are laid out backwards for the reversed NFA.
+int32_t
+regexCompileNode(re_prog* prog, re_node* nodes, int32_t node, int32_t next, u_int8_t reverse)
+{
+  if (next < 0) {
+    return -1;
+  }
+
+  re_node* n = nodes + node;
+  switch (n->type) {
+  case RE_EMPTY:
+    return next;
+  case RE_SET: {
+    int32_t state = regexNewState(prog, RS_SET, next, -1);
+    if (state >= 0) {
+      memcpy(prog->states[state].set, n->set, 32);
+    }
+    return state;
+  }
+  case RE_CAT:
+    if (reverse) {
+      return regexCompileNode(prog, nodes, n->right, regexCompileNode(prog, nodes, n->left, next, reverse), reverse);
+    }
+    return regexCompileNode(prog, nodes, n->left, regexCompileNode(prog, nodes, n->right, next, reverse), reverse);
+  case RE_ALT: {
+    int32_t left = regexCompileNode(prog, nodes, n->left, next, reverse);
+    int32_t right = regexCompileNode(prog, nodes, n->right, next, reverse);
+    return (left < 0 || right < 0) ? -1 : regexNewState(prog, RS_SPLIT, left, right);
+  }
+  case RE_STAR: {
+    int32_t split = regexNewState(prog, RS_SPLIT, -1, next);
+    int32_t body = (split < 0) ? -1 : regexCompileNode(prog, nodes, n->left, split, reverse);
+    if (body < 0) {
+      return -1;
+    }
+
+    prog->states[split].out = body;
+    return split;
+  }
+  case RE_PLUS: {
+    int32_t split = regexNewState(prog, RS_SPLIT, -1, next);
+    int32_t body = (split < 0) ? -1 : regexCompileNode(prog, nodes, n->left, split, reverse);
+    if (body < 0) {
+      return -1;
+    }
+
+    prog->states[split].out = body;
+    return body;
+  }
+  case RE_QUEST: {
+    int32_t body = regexCompileNode(prog, nodes, n->left, next, reverse);
+    return (body < 0) ? -1 : regexNewState(prog, RS_SPLIT, body, next);
+  }
+  }
+
+  return -1;
+}
+
+// Compiles a pattern into a forward and a reversed NFA. '^' and '$' anchor
+// to the ends of the line when they start or end the pattern and are
+// literals anywhere else. Returns NULL when the pattern is malformed.
+re_prog*
+editorRegexCompile(CONST_CHAR_PTR pattern, u_int8_t icase)
+{
+  re_prog* prog = calloc(1, sizeof(re_prog));
+  if (!prog) {
+    return NULL;
+  }
+
+  re_parser parser = { pattern, NULL, 0, 0, icase, 0 };
+  if (*parser.p == '^') {
+    prog->anchor_start = 1;
+    ++parser.p;
+  }
+
+  size_t len = strlen(parser.p);
+  prog->anchor_end = len && parser.p[len - 1] == '$' && (len < 2 || parser.p[len - 2] != '\\');
+
+  int32_t root = regexParseAlt(&parser);
+  if (*parser.p == '$' && prog->anchor_end) {
+    ++parser.p;
+  }
+
+  // a stray ')' stops the parse short of the end
+  if (root >= 0 && !parser.error && !*parser.p) {
+    int32_t match = regexNewState(prog, RS_MATCH, -1, -1);
+    prog->fwd_start = regexCompileNode(prog, parser.nodes, root, match, 0);
+    prog->rev_start = regexCompileNode(prog, parser.nodes, root, match, 1);
+  } else {
+    prog->fwd_start = -1;
+  }
+
+  SAFE_FREE(parser.nodes);
+  if (prog->fwd_start < 0 || prog->rev_start < 0) {
+    editorRegexFree(prog);
+    return NULL;
+  }
+
+  return prog;
+}
+
+void editorRegexFree(re_prog* prog)
+{
+  if (prog) {
+    SAFE_FREE(prog->states);
+    free(prog);
+  }
+}
+
+// Sets up an empty DFA over one of the NFAs of a program
+void editorDfaInit(re_dfa* dfa, const re_prog* prog, int32_t nfa_start, u_int8_t unanchored)
+{
+  memset(dfa, 0, sizeof(re_dfa));
+  dfa->prog = prog;
+  dfa->nfa_start = nfa_start;
+  dfa->unanchored = unanchored;
+  dfa->states = malloc(DFA_MAX_STATES * sizeof(dfa_state));
+  dfa->table_mask = DFA_MAX_STATES * 2 - 1;
+  dfa->table = malloc((dfa->table_mask + 1) * sizeof(int32_t));
+  dfa->stack = malloc(prog->count * sizeof(int32_t));
+  dfa->seeds = malloc((prog->count + 1) * sizeof(int32_t));
+  dfa->closure = malloc(prog->count * sizeof(int32_t));
+  dfa->mark = calloc(prog->count, sizeof(u_int32_t));
+  editorDfaFlush(dfa);
+}
+
+void editorDfaFree(re_dfa* dfa)
+{
+  SAFE_FREE(dfa->states);
+  SAFE_FREE(dfa->pool);
+  SAFE_FREE(dfa->table);
+  SAFE_FREE(dfa->stack);
+  SAFE_FREE(dfa->seeds);
+  SAFE_FREE(dfa->closure);
+  SAFE_FREE(dfa->mark);
+  dfa->prog = NULL;
+}
+
+// Throws every cached state away and adds the start state back
+void editorDfaFlush(re_dfa* dfa)
+{
+  dfa->count = 0;
+  dfa->pool_len = 0;
+  memset(dfa->table, 0xff, (dfa->table_mask + 1) * sizeof(int32_t));
+
+  int32_t seed = dfa->nfa_start;
+  dfa->start = editorDfaAdd(dfa, &seed, 1);
+}
+
+// Returns the DFA state for the epsilon closure of some NFA states, adding
+// it to the cache when it is new. The caller makes sure there is room.
+int32_t
+editorDfaAdd(re_dfa* dfa, int32_t* seeds, int32_t seed_count)
+{
+  const re_prog* prog = dfa->prog;
+  int32_t depth = 0, len = 0;
+  u_int8_t match = 0;
+
+  if (++dfa->mark_gen == 0) {
+    memset(dfa->mark, 0, prog->count * sizeof(u_int32_t));
+    dfa->mark_gen = 1;
+  }
+
+  // only states that consume a byte or accept tell DFA states apart
+  for (int32_t i = 0; i < seed_count; ++i) {
+    if (dfa->mark[seeds[i]] != dfa->mark_gen) {
+      dfa->mark[seeds[i]] = dfa->mark_gen;
+      dfa->stack[depth++] = seeds[i];
+    }
+  }
+
+  while (depth) {
+    const re_state* state = prog->states + dfa->stack[--depth];
+    if (state->type != RS_SPLIT) {
+      dfa->closure[len++] = state - prog->states;
+      match |= (state->type == RS_MATCH);
+      continue;
+    }
+
+    int32_t outs[2] = { state->out, state->out1 };
+    for (int32_t i = 0; i < 2; ++i) {
+      if (dfa->mark[outs[i]] != dfa->mark_gen) {
+        dfa->mark[outs[i]] = dfa->mark_gen;
+        dfa->stack[depth++] = outs[i];
+      }
+    }
+  }
+
+  // insertion sort: closures are small and mostly come out in order
+  int32_t* set = dfa->closure;
+  for (int32_t i = 1; i < len; ++i) {
+    int32_t v = set[i], j = i;
+    for (; j > 0 && set[j - 1] > v; --j) {
+      set[j] = set[j - 1];
+    }
+    set[j] = v;
+  }
+
+  u_int32_t hash = 2166136261u;
+  for (int32_t i = 0; i < len; ++i) {
+    hash = (hash ^ (u_int32_t)set[i]) * 16777619u;
+  }
+
+  u_int32_t slot = hash & dfa->table_mask;
+  for (; dfa->table[slot] >= 0; slot = (slot + 1) & dfa->table_mask) {
+    dfa_state* found = dfa->states + dfa->table[slot];
+    if (found->hash == hash && found->set_len == len
+        && !memcmp(dfa->pool + found->set, set, len * sizeof(int32_t))) {
+      return dfa->table[slot];
+    }
+  }
+
+  if (dfa->pool_len + len > dfa->pool_cap) {
+    dfa->pool_cap = (dfa->pool_len + len) * 2;
+    dfa->pool = realloc(dfa->pool, dfa->pool_cap * sizeof(int32_t));
+  }
+
+  dfa_state* state = dfa->states + dfa->count;
+  memset(state->next, 0xff, sizeof(state->next));
+  state->set = dfa->pool_len;
+  state->set_len = len;
+  state->hash = hash;
+  state->match = match;
+  memcpy(dfa->pool + dfa->pool_len, set, len * sizeof(int32_t));
+  dfa->pool_len += len;
+
+  dfa->table[slot] = dfa->count;
+  return dfa->count++;
+}
+
+// Follows a transition, working it out from the NFA the first time it's
+// taken. Flushing a full cache invalidates every state but the returned one.
+int32_t
+editorDfaStep(re_dfa* dfa, int32_t state, BYTE ch)
+{
+  int32_t next = dfa->states[state].next[ch];
+  if (next != DFA_UNKNOWN) {
+    return next;
+  }
+
+  const re_prog* prog = dfa->prog;
+  const dfa_state* from = dfa->states + state;
+  int32_t seed_count = 0;
+
+  // the seeds are copied out because flushing the cache empties the pool
+  for (int32_t i = 0; i < from->set_len; ++i) {
+    const re_state* nfa = prog->states + dfa->pool[from->set + i];
+    if (nfa->type == RS_SET && SET_HAS(nfa->set, ch)) {
+      dfa->seeds[seed_count++] = nfa->out;
+    }
+  }
+
+  if (dfa->unanchored) {
+    dfa->seeds[seed_count++] = dfa->nfa_start;
+  }
+
+  if (dfa->count == DFA_MAX_STATES) {
+    editorDfaFlush(dfa);
+    state = -1;
+  }
+
+  next = editorDfaAdd(dfa, dfa->seeds, seed_count);
+  if (state >= 0) {
+    dfa->states[state].next[ch] = next;
+  }
+
+  return next;
+}
+
+// Rebuilds a worker's DFAs when the program they were built for changed
+void editorMatcherPrepare(re_matcher* matcher, const re_prog* prog, u_int64_t prog_id)
+{
+  if (matcher->prog_id == prog_id) {
+    return;
+  }
+
+  if (matcher->prog_id) {
+    editorDfaFree(&matcher->rev);
+    editorDfaFree(&matcher->fwd);
+  }
+
+  // without a '$' a match may end anywhere, so the backward scan is unanchored
+  editorDfaInit(&matcher->rev, prog, prog->rev_start, !prog->anchor_end);
+  editorDfaInit(&matcher->fwd, prog, prog->fwd_start, 0);
+  matcher->threads = realloc(matcher->threads, 2 * prog->count * sizeof(int32_t));
+  matcher->tags = realloc(matcher->tags, 2 * prog->count * sizeof(size_t));
+  matcher->prog_id = prog_id;
+}
+
+void editorMatcherFree(re_matcher* matcher)
+{
+  if (matcher->prog_id) {
+    editorDfaFree(&matcher->rev);
+    editorDfaFree(&matcher->fwd);
+  }
+
+  SAFE_FREE(matcher->starts);
+  SAFE_FREE(matcher->ends);
+  SAFE_FREE(matcher->threads);
+  SAFE_FREE(matcher->tags);
+  matcher->starts_cap = matcher->ends_cap = 0;
+  matcher->prog_id = 0;
+}
+
+// Adds a thread of an NFA to a list along with the states it reaches without
+// consuming a byte, tagged with "tag". States already in the list for the
+// DFA's current mark generation keep the tag they came with.
+void editorRegexAddThread(re_dfa* dfa, int32_t* list, size_t* tags, INT_PTR count, int32_t state, size_t tag)
+{
+  const re_prog* prog = dfa->prog;
+  int32_t depth = 0;
+
+  if (dfa->mark[state] == dfa->mark_gen) {
+    return;
+  }
+  dfa->mark[state] = dfa->mark_gen;
+  dfa->stack[depth++] = state;
+
+  while (depth) {
+    const re_state* nfa = prog->states + dfa->stack[--depth];
+    if (nfa->type != RS_SPLIT) {
+      list[*count] = nfa - prog->states;
+      tags[(*count)++] = tag;
+      continue;
+    }
+
+    int32_t outs[2] = { nfa->out, nfa->out1 };
+    for (int32_t i = 0; i < 2; ++i) {
+      if (dfa->mark[outs[i]] != dfa->mark_gen) {
+        dfa->mark[outs[i]] = dfa->mark_gen;
+        dfa->stack[depth++] = outs[i];
+      }
+    }
+  }
+}
+
+// Works out the end of the longest match starting at each position of a line
+// from "from" on, or the position itself when none does, in one backward run
+// of the reversed NFA. Every thread is tagged with the end of the match it
+// would close. Threads are kept in the order of their tags, furthest first,
+// and of those reaching the same state only the first is kept, so the first
+// thread to accept carries the longest match. Each byte costs at most a step
+// of every state of the NFA.
+void editorRegexLongest(re_matcher* matcher, CONST_CHAR_PTR text, size_t len, size_t from)
+{
+  re_dfa* rev = &matcher->rev; // lends its scratch arrays to the closures
+  const re_prog* prog = rev->prog;
+  int32_t* cur = matcher->threads;
+  int32_t* next = matcher->threads + prog->count;
+  size_t* cur_tags = matcher->tags;
+  size_t* next_tags = matcher->tags + prog->count;
+  int32_t cur_count = 0;
+
+  if (matcher->ends_cap < len + 1) {
+    matcher->ends_cap = (len + 1) * 2;
+    matcher->ends = realloc(matcher->ends, matcher->ends_cap * sizeof(size_t));
+  }
+
+  if (++rev->mark_gen == 0) {
+    memset(rev->mark, 0, prog->count * sizeof(u_int32_t));
+    rev->mark_gen = 1;
+  }
+
+  for (size_t i = len; i > from; --i) {
+    // a match may end here, after all those ending further on
+    if (!prog->anchor_end || i == len) {
+      editorRegexAddThread(rev, cur, cur_tags, &cur_count, prog->rev_start, i);
+    }
+
+    if (++rev->mark_gen == 0) {
+      memset(rev->mark, 0, prog->count * sizeof(u_int32_t));
+      rev->mark_gen = 1;
+    }
+
+    int32_t next_count = 0;
+    for (int32_t t = 0; t < cur_count; ++t) {
+      const re_state* nfa = prog->states + cur[t];
+      if (nfa->type == RS_SET && SET_HAS(nfa->set, (BYTE)text[i - 1])) {
+        editorRegexAddThread(rev, next, next_tags, &next_count, nfa->out, cur_tags[t]);
+      }
+    }
+
+    matcher->ends[i - 1] = i - 1;
+    for (int32_t t = 0; t < next_count; ++t) {
+      if (prog->states[next[t]].type == RS_MATCH) {
+        matcher->ends[i - 1] = next_tags[t];
+        break;
+      }
+    }
+
+    int32_t* swap = cur;
+    cur = next;
+    next = swap;
+    size_t* swap_tags = cur_tags;
+    cur_tags = next_tags;
+    next_tags = swap_tags;
+    cur_count = next_count;
+  }
+}
+
+// Collects the leftmost-longest, non-overlapping matches of a line, skipping
+// empty ones. A backward pass of the reversed DFA marks every position a
+// match starts at, then the forward DFA stretches each start to its longest
+// match. The forward DFA has to run on until it dies, which may be far past
+// the end of the match, and the next start is scanned over again. Once the
+// forward scans went over as many bytes as the line holds, the rest of the
+// line is left to editorRegexLongest(). A line thus costs at most three DFA
+// passes over it, plus one NFA pass whose bytes cost up to the size of the
+// pattern each.
+void editorRegexLine(re_matcher* matcher, CONST_CHAR_PTR text, size_t len, int32_t line, srch_job* job)
+{
+  re_dfa* rev = &matcher->rev;
+  re_dfa* fwd = &matcher->fwd;
+  const re_prog* prog = fwd->prog;
+
+  if (matcher->starts_cap < len + 1) {
+    matcher->starts_cap = (len + 1) * 2;
+    matcher->starts = realloc(matcher->starts, matcher->starts_cap);
+  }
+
+  u_int8_t any = 0;
+  int32_t state = rev->start;
+  memset(matcher->starts, 0, len + 1);
+  for (size_t i = len; i-- > 0;) {
+    int32_t next = rev->states[state].next[(BYTE)text[i]];
+    state = (next != DFA_UNKNOWN) ? next : editorDfaStep(rev, state, text[i]);
+    if (!rev->states[state].set_len) {
+      break;
+    }
+
+    if (rev->states[state].match) {
+      matcher->starts[i] = any = 1;
+    }
+  }
+
+  if (!any) {
+    return;
+  }
+
+  size_t limit = prog->anchor_start ? 1 : len;
+  size_t scanned = 0; // bytes the forward DFA went over
+  u_int8_t longest = 0; // the rest of the line was left to the NFA
+  for (size_t start = 0; start < limit;) {
+    if (!matcher->starts[start]) {
+      ++start;
+      continue;
+    }
+
+    if (scanned >= len && !longest) {
+      editorRegexLongest(matcher, text, len, start);
+      longest = 1;
+    }
+
+    size_t end = longest ? matcher->ends[start] : start;
+    state = fwd->start;
+    for (size_t i = start; i < len && !longest; ++i) {
+      ++scanned;
+      int32_t next = fwd->states[state].next[(BYTE)text[i]];
+      state = (next != DFA_UNKNOWN) ? next : editorDfaStep(fwd, state, text[i]);
+      if (!fwd->states[state].set_len) {
+        break;
+      }
+
+      if (fwd->states[state].match && (!prog->anchor_end || i + 1 == len)) {
+        end = i + 1;
+      }
+    }
+
+    if (end == start) {
+      ++start;
+      continue;
+    }
+
+    srch_match match = { line, start, end - start, text + start, len - start };
+    editorMatchAppend(&job->matches, &job->count, &job->cap, &match);
+    start = end;
+  }
+}
+
+/***                                SEARCH ENGINE                          ***/
+
+// Compares "len" bytes, ignoring case if asked to
+u_int8_t
+editorMemEq(CONST_CHAR_PTR a, CONST_CHAR_PTR b, size_t len, u_int8_t icase)
+{
+  if (!icase) {
+    return !memcmp(a, b, len);
+  }
+
+  for (size_t i = 0; i < len; ++i) {
+    if (tolower((BYTE)a[i]) != tolower((BYTE)b[i])) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// Finds the first occurrence of "needle" in "hay". Blocks of the haystack are
+// filtered on the needle's first and last bytes at once and only the
+// positions where both agree get compared in full.
+CONST_CHAR_PTR
+editorMemFind(CONST_CHAR_PTR hay, size_t hay_len, CONST_CHAR_PTR needle, size_t len, u_int8_t icase)
+{
+  if (!len || hay_len < len) {
+    return NULL;
+  }
+
+  BYTE first = needle[0];
+  BYTE last = needle[len - 1];
+  BYTE first_alt = icase ? (islower(first) ? toupper(first) : tolower(first)) : first;
+  BYTE last_alt = icase ? (islower(last) ? toupper(last) : tolower(last)) : last;
+  size_t end = hay_len - len; // last position a match can start at
+  size_t i = 0;
+
+#ifdef __AVX2__
+  const __m256i first_v = _mm256_set1_epi8(first);
+  const __m256i first_alt_v = _mm256_set1_epi8(first_alt);
+  const __m256i last_v = _mm256_set1_epi8(last);
+  const __m256i last_alt_v = _mm256_set1_epi8(last_alt);
+  for (; i + 32 <= end + 1; i += 32) {
+    __m256i head = _mm256_loadu_si256((const __m256i*)(hay + i));
+    __m256i tail = _mm256_loadu_si256((const __m256i*)(hay + i + len - 1));
+    __m256i eq = _mm256_and_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(head, first_v), _mm256_cmpeq_epi8(head, first_alt_v)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(tail, last_v), _mm256_cmpeq_epi8(tail, last_alt_v)));
+
+    for (u_int32_t mask = _mm256_movemask_epi8(eq); mask; mask &= mask - 1) {
+      size_t at = i + __builtin_ctz(mask);
+      if (editorMemEq(hay + at, needle, len, icase)) {
+        return hay + at;
+      }
+    }
+  }
+#endif
+
+#ifdef __SSE2__
+  const __m128i first_x = _mm_set1_epi8(first);
+  const __m128i first_alt_x = _mm_set1_epi8(first_alt);
+  const __m128i last_x = _mm_set1_epi8(last);
+  const __m128i last_alt_x = _mm_set1_epi8(last_alt);
+  for (; i + 16 <= end + 1; i += 16) {
+    __m128i head = _mm_loadu_si128((const __m128i*)(hay + i));
+    __m128i tail = _mm_loadu_si128((const __m128i*)(hay + i + len - 1));
+    __m128i eq = _mm_and_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(head, first_x), _mm_cmpeq_epi8(head, first_alt_x)),
+        _mm_or_si128(_mm_cmpeq_epi8(tail, last_x), _mm_cmpeq_epi8(tail, last_alt_x)));
+
+    for (u_int32_t mask = _mm_movemask_epi8(eq); mask; mask &= mask - 1) {
+      size_t at = i + __builtin_ctz(mask);
+      if (editorMemEq(hay + at, needle, len, icase)) {
+        return hay + at;
+      }
+    }
+  }
+#endif
+
+  for (; i <= end; ++i) {
+    BYTE ch = hay[i];
+    if ((ch == first || ch == first_alt) && editorMemEq(hay + i, needle, len, icase)) {
+      return hay + i;
+    }
+  }
+
+  return NULL;
+}
+
+// Appends a match to a list, growing it geometrically
+void editorMatchAppend(srch_match** matches, size_t* count, size_t* cap, srch_match* match)
+{
+  if (*count == *cap) {
+    size_t new_cap = *cap ? *cap * 2 : 64;
+    srch_match* grown = realloc(*matches, new_cap * sizeof(srch_match));
+    if (!grown) {
+      return;
+    }
+
+    *matches = grown;
+    *cap = new_cap;
+  }
+
+  (*matches)[(*count)++] = *match;
+}
+
+// Scans one segment of the buffer for the current query. Lines of the matches
+// are relative to the start of the segment.
+void editorSearchSegment(srch_segment* seg, srch_job* job, re_matcher* matcher)
+{
+  edt_search* search = &edt_conf.search;
+  CONST_CHAR_PTR end = seg->text + seg->len;
+  CONST_CHAR_PTR line_start = seg->text;
+  CONST_CHAR_PTR p = seg->text;
+  int32_t line = 0;
+  size_t before = job->count;
+
+  // a regex is run line by line, with the '\r' of CRLF lines left out
+  if (search->prog) {
+    for (;;) {
+      CONST_CHAR_PTR eol = seg->mapped ? memchr(p, '\n', end - p) : NULL;
+      size_t len = (eol ? eol : end) - p;
+      if (len && edt_conf.buf->map_crlf && seg->mapped && p[len - 1] == '\r') {
+        --len;
+      }
+
+      editorRegexLine(matcher, p, len, line, job);
+      if (!eol || eol + 1 == end) {
+        line += (eol != NULL);
+        break;
+      }
+
+      p = eol + 1;
+      ++line;
+    }
+
+    seg->hits = job->count - before;
+    seg->newlines = seg->mapped ? line : 0;
+    atomic_fetch_add(&search->found, seg->hits);
+    return;
+  }
+
+  CONST_CHAR_PTR hit = NULL;
+  while ((hit = editorMemFind(p, end - p, search->query, search->query_len, search->query_icase))) {
+    // the query never holds a newline, so a match can't straddle two lines
+    size_t newlines = seg->mapped ? editorCountNewlines(line_start, hit - line_start) : 0;
+    if (newlines) {
+      line += newlines;
+      line_start = (CONST_CHAR_PTR)memrchr(line_start, '\n', hit - line_start) + 1;
+    }
+
+    // matches may overlap so that a longer query can refine them later
+    srch_match match = { line, hit - line_start, search->query_len, hit, end - hit };
+    editorMatchAppend(&job->matches, &job->count, &job->cap, &match);
+    p = hit + 1;
+  }
+
+  seg->hits = job->count - before;
+  seg->newlines = seg->mapped ? line + editorCountNewlines(line_start, end - line_start) : 0;
+  atomic_fetch_add(&search->found, seg->hits);
+}
+
+// Worker thread: takes jobs off the current search until it is exhausted or
+// cancelled, then sleeps until the next one
+PTR_T
+editorSearchWorker(PTR_T arg)
+{
+  re_matcher* matcher = arg;
+  edt_search* search = &edt_conf.search;
+
+  pthread_mutex_lock(&search->lock);
+  for (;;) {
+    while (!search->shutdown && search->next_job >= search->job_count) {
+      pthread_cond_wait(&search->wake, &search->lock);
+    }
+
+    if (search->shutdown) {
+      break;
+    }
+
+    srch_job* job = search->jobs + search->next_job++;
+    u_int64_t generation = atomic_load(&search->generation);
+    ++search->busy;
+    pthread_mutex_unlock(&search->lock);
+
+    if (search->prog) {
+      editorMatcherPrepare(matcher, search->prog, search->prog_id);
+    }
+
+    size_t seg = job->first;
+    for (; seg < job->last && atomic_load(&search->generation) == generation; ++seg) {
+      editorSearchSegment(search->segs + seg, job, matcher);
+    }
+
+    atomic_store(&job->done, seg == job->last);
+
+    pthread_mutex_lock(&search->lock);
+    if (--search->busy == 0) {
+      pthread_cond_broadcast(&search->idle);
+    }
+  }
+
+  pthread_mutex_unlock(&search->lock);
+  return NULL;
+}
+
+// Stops the search in flight and waits for the workers to let go of it
+void editorSearchCancel(void)
+{
+  edt_search* search = &edt_conf.search;
+  if (!search->workers) {
+    return;
+  }
+
+  pthread_mutex_lock(&search->lock);
+  atomic_fetch_add(&search->generation, 1);
+  search->next_job = search->job_count;
+  while (search->busy) {
+    pthread_cond_wait(&search->idle, &search->lock);
+  }
+  pthread_mutex_unlock(&search->lock);
+
+  for (size_t i = 0; i < search->job_count; ++i) {
+    SAFE_FREE(search->jobs[i].matches);
+  }
+
+  search->job_count = search->next_job = search->jobs_merged = 0;
+  search->running = 0;
+}
+
+// Starts the worker pool, one thread per online CPU
+void editorSearchInit(void)
+{
+  edt_search* search = &edt_conf.search;
+  int32_t workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+  // batch edits already keep the CPUs busy with a file each
+  if (edt_conf.batch.active) {
+    workers /= edt_conf.batch.jobs;
+  }
+
+  if (workers < 1) {
+    workers = 1;
+  } else if (workers > SEARCH_MAX_WORKERS) {
+    workers = SEARCH_MAX_WORKERS;
+  }
+
+  pthread_mutex_init(&search->lock, NULL);
+  pthread_cond_init(&search->wake, NULL);
+  pthread_cond_init(&search->idle, NULL);
+
+  search->workers = calloc(workers, sizeof(pthread_t));
+  search->matchers = calloc(workers, sizeof(re_matcher));
+  for (; search->worker_count < workers; ++search->worker_count) {
+    int32_t i = search->worker_count;
+    if (pthread_create(search->workers + i, NULL, editorSearchWorker, search->matchers + i)) {
+      break;
+    }
+  }
+}
+
+// Stops and joins the worker pool
+void editorSearchShutdown(void)
+{
+  edt_search* search = &edt_conf.search;
+  if (!search->workers) {
+    return;
+  }
+
+  editorSearchCancel();
+
+  pthread_mutex_lock(&search->lock);
+  search->shutdown = 1;
+  pthread_cond_broadcast(&search->wake);
+  pthread_mutex_unlock(&search->lock);
+
+  for (int32_t i = 0; i < search->worker_count; ++i) {
+    pthread_join(search->workers[i], NULL);
+    editorMatcherFree(search->matchers + i);
+  }
+
+  SAFE_FREE(search->workers);
+  SAFE_FREE(search->matchers);
+  SAFE_FREE(search->segs);
+  SAFE_FREE(search->jobs);
+  search->seg_cap = search->job_cap = 0;
+  search->worker_count = 0;
+}
+
+// Adds a segment to the snapshot of the buffer handed to the workers
+void editorSearchAddSegment(CONST_CHAR_PTR text, size_t len, int32_t line, u_int8_t mapped)
+{
+  edt_search* search = &edt_conf.search;
+  if (search->seg_count == search->seg_cap) {
+    search->seg_cap = search->seg_cap ? search->seg_cap * 2 : 1024;
+    search->segs = realloc(search->segs, search->seg_cap * sizeof(srch_segment));
+  }
+
+  srch_segment* seg = search->segs + search->seg_count++;
+  seg->text = text;
+  seg->len = len;
+  seg->line = line;
+  seg->mapped = mapped;
+  seg->hits = seg->newlines = 0;
+}
+
+// Splits the buffer into segments and jobs of similar size and wakes the
+// workers up. Mapped spans are cut on line boundaries; only the first piece
+// of a span knows its line, the others continue from the piece before.
+void editorSearchStart(void)
+{
+  edt_search* search = &edt_conf.search;
+  if (!search->workers) {
+    editorSearchInit();
+  }
+
+  search->seg_count = 0;
+  int32_t line = 0;
+  row_node* node = rowTreeFirst(edt_conf.buf->rows);
+  for (; node; line += node->lines, node = rowTreeNext(node)) {
+    if (!ROW_MAPPED(node)) {
+      if (node->row.size >= (search->prog ? 1 : search->query_len)) {
+        editorSearchAddSegment(node->row.chars, node->row.size, line, 0);
+      }
+      continue;
+    }
+
+    CONST_CHAR_PTR p = node->span;
+    CONST_CHAR_PTR end = node->span + node->span_len;
+    for (int32_t piece_line = line; p < end; piece_line = -1) {
+      CONST_CHAR_PTR piece_end = end;
+      if ((size_t)(end - p) > SEARCH_CHUNK) {
+        piece_end = memchr(p + SEARCH_CHUNK, '\n', end - p - SEARCH_CHUNK);
+        piece_end = piece_end ? piece_end + 1 : end;
+      }
+
+      editorSearchAddSegment(p, piece_end - p, piece_line, 1);
+      p = piece_end;
+    }
+  }
+
+  size_t jobs = 0;
+  for (size_t seg = 0; seg < search->seg_count; ++jobs) {
+    if (jobs == search->job_cap) {
+      search->job_cap = search->job_cap ? search->job_cap * 2 : 64;
+      search->jobs = realloc(search->jobs, search->job_cap * sizeof(srch_job));
+    }
+
+    srch_job* job = search->jobs + jobs;
+    memset(job, 0, sizeof(srch_job));
+    job->first = seg;
+
+    for (size_t bytes = 0; seg < search->seg_count && bytes < SEARCH_CHUNK; ++seg) {
+      bytes += search->segs[seg].len + SEARCH_SEG_COST;
+    }
+
+    job->last = seg;
+  }
+
+  atomic_store(&search->found, 0);
+  search->merge_line = 0;
+  search->running = 1;
+
+  pthread_mutex_lock(&search->lock);
+  search->job_count = jobs;
+  search->next_job = search->jobs_merged = 0;
+  pthread_cond_broadcast(&search->wake);
+  pthread_mutex_unlock(&search->lock);
+}
+
+// Returns the first match at or after a position, in O(log N)
+size_t
+editorSearchLowerBound(int32_t line, int32_t col)
+{
+  edt_search* search = &edt_conf.search;
+  size_t lo = 0, hi = search->count;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    srch_match* match = search->matches + mid;
+    if (match->line < line || (match->line == line && match->col < col)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+// Moves the cursor onto the current match
+void editorSearchJump(void)
+{
+  edt_search* search = &edt_conf.search;
+  if (search->current < 0 || (size_t)search->current >= search->count) {
+    return;
+  }
+
+  srch_match* match = search->matches + search->current;
+  edt_conf.buf->csr_y = match->line;
+  edt_conf.buf->csr_x = match->col;
+  edt_conf.buf->row_off = edt_conf.buf->num_rows;
+}
+
+// Picks the first match at or after where the search was started from. While
+// workers are still running a match further down may simply not be in yet.
+void editorSearchPickFirst(void)
+{
+  edt_search* search = &edt_conf.search;
+  if (search->current >= 0 || !search->count) {
+    return;
+  }
+
+  size_t at = editorSearchLowerBound(search->origin_y, search->origin_x);
+  if (at == search->count) {
+    if (search->running) {
+      return;
+    }
+
+    at = 0;
+  }
+
+  search->current = at;
+  editorSearchJump();
+}
+
+// Merges, in file order, the jobs the workers finished into the sorted match
+// index. Returns whether anything new came in.
+u_int8_t
+editorSearchPoll(void)
+{
+  edt_search* search = &edt_conf.search;
+  u_int8_t merged = 0;
+
+  while (search->running && search->jobs_merged < search->job_count) {
+    srch_job* job = search->jobs + search->jobs_merged;
+    if (!atomic_load(&job->done)) {
+      break;
+    }
+
+    srch_match* match = job->matches;
+    for (size_t seg = job->first; seg < job->last; ++seg) {
+      srch_segment* segment = search->segs + seg;
+      int32_t base = (segment->line >= 0) ? segment->line : search->merge_line;
+
+      for (size_t i = 0; i < segment->hits; ++i, ++match) {
+        match->line += base;
+        editorMatchAppend(&search->matches, &search->count, &search->cap, match);
+      }
+
+      search->merge_line = base + segment->newlines;
+    }
+
+    SAFE_FREE(job->matches);
+    ++search->jobs_merged;
+    merged = 1;
+  }
+
+  if (search->running && search->jobs_merged == search->job_count) {
+    search->running = 0;
+    merged = 1;
+  }
+
+  if (merged) {
+    editorSearchPickFirst();
+  }
+
+  return merged;
+}
+
+// Waits for the workers to be done with the search and merges all they found
+void editorSearchFinish(void)
+{
+  while (edt_conf.search.running) {
+    if (!editorSearchPoll()) {
+      sched_yield();
+    }
+  }
+}
+
+// Narrows the previous matches down to those still matching a query that
+// only grew longer: no other position in the buffer can match it
+void editorSearchRefine(CONST_CHAR_PTR query, size_t len)
+{
+  edt_search* search = &edt_conf.search;
+  size_t kept = 0;
+
+  for (size_t i = 0; i < search->count; ++i) {
+    srch_match* match = search->matches + i;
+    if (match->avail >= len && editorMemEq(match->text, query, len, search->icase)) {
+      match->len = len;
+      search->matches[kept++] = *match;
+    }
+  }
+
+  search->count = kept;
+}
+
+// Runs a query, reusing the previous results when it merely extends them and
+// these are complete, and handing it to the workers otherwise. In regex mode
+// the query is compiled first and always searched afresh.
+void editorSearchRun(CONST_CHAR_PTR query)
+{
+  edt_search* search = &edt_conf.search;
+  size_t len = strlen(query);
+
+  u_int8_t extends = search->query && search->query_len && search->query_len <= len
+      && !search->running && search->query_icase == search->icase
+      && !search->regex && !search->query_regex
+      && !strncmp(search->query, query, search->query_len);
+
+  // a new keystroke supersedes whatever is still being searched
+  editorSearchCancel();
+
+  SAFE_FREE(search->query);
+  search->query = strdup(query);
+  search->query_len = len;
+  search->query_icase = search->icase;
+  search->query_regex = search->regex;
+  search->current = -1;
+
+  editorRegexFree(search->prog);
+  search->prog = NULL;
+  if (search->regex && len) {
+    search->prog = editorRegexCompile(query, search->icase);
+    ++search->prog_id;
+  }
+
+  if (!len || (search->regex && !search->prog)) {
+    search->count = 0;
+  } else if (extends) {
+    editorSearchRefine(query, len);
+  } else {
+    search->count = 0;
+    editorSearchStart();
+  }
+
+  editorSearchPoll();
+  editorSearchPickFirst();
+}
+
+// Drops the results of the last search
+void editorSearchReset(void)
+{
+  edt_search* search = &edt_conf.search;
+
+  editorSearchCancel();
+  editorRegexFree(search->prog);
+  search->prog = NULL;
+  SAFE_FREE(search->query);
+  SAFE_FREE(search->matches);
+  search->query_len = search->count = search->cap = 0;
+  search->current = -1;
+  search->active = 0;
+}
+
+// Returns the highlight of a row to draw, painting the matches of an ongoing
+// search over a scratch copy so the row's cache stays untouched
+BYTE* editorSearchOverlay(edt_row* row, int32_t file_row)
+{
+  static BYTE* overlay = NULL;
+  static size_t overlay_cap = 0;
+  edt_search* search = &edt_conf.search;
+
+  if (!search->active || !search->count) {
+    return row->highlight;
+  }
+
+  // first match on or after this row
+  size_t lo = 0, hi = search->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (search->matches[mid].line < file_row) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if (lo == search->count || search->matches[lo].line != file_row) {
+    return row->highlight;
+  }
+
+  if (overlay_cap < row->size + 1) {
+    overlay_cap = row->size + 1;
+    overlay = realloc(overlay, overlay_cap);
+  }
+
+  memcpy(overlay, row->highlight, row->size);
+  for (; lo < search->count && search->matches[lo].line == file_row; ++lo) {
+    memset(overlay + search->matches[lo].col, HL_MATCH, search->matches[lo].len);
+  }
+
+  return overlay;
+}
+
+/***                                FIND                                   ***/
+
+// Callback to locate search query.
+void editorFindCallback(CHAR_PTR query, int32_t key)
+{
+  edt_search* search = &edt_conf.search;
+
+  if (key == '\r' || key == '\x1b') {
+    editorSearchCancel();
+    search->active = 0;
+    return;
+  }
+
+  if (!search->active) {
+    search->active = 1;
+    search->origin_y = edt_conf.buf->csr_y;
+    search->origin_x = edt_conf.buf->csr_x;
+  }
+
+  if (key == CTRL_KEY('t')) {
+    search->icase = !search->icase;
+  } else if (key == CTRL_KEY('r')) {
+    search->regex = !search->regex;
+  }
+
+  // only rescan when the query or one of the modes actually changed
+  if (!search->query || search->query_icase != search->icase || search->query_regex != search->regex
+      || strcmp(search->query, query)) {
+    editorSearchRun(query);
+    return;
+  }
+
+  if (!search->count) {
+    return;
+  }
+
+  // step from the cursor with a binary search over the sorted matches
+  size_t at = editorSearchLowerBound(edt_conf.buf->csr_y, edt_conf.buf->csr_x);
+  if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    if (at < search->count && search->current >= 0 && (size_t)search->current == at) {
+      ++at;
+    }
+
+    if (at == search->count) {
+      if (search->running) {
+        return;
+      }
+
+      at = 0;
+    }
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    if (at == 0) {
+      if (search->running) {
+        return;
+      }
+
+      at = search->count;
+    }
+
+    --at;
+  } else {
+    return;
+  }
+
+  search->current = at;
+  editorSearchJump();
+}
+
+void editorFind(void)
+{
+  // save cursor & scroll position before search
+  int32_t saved_csr_x = edt_conf.buf->csr_x;
+  int32_t saved_csr_y = edt_conf.buf->csr_y;
+  int32_t saved_col_off = edt_conf.buf->col_off;
+  int32_t saved_row_off = edt_conf.buf->row_off;
+
+  // get search query from user
+  CHAR_PTR query = editorPrompt(
+      "Search: %s (ESC to cancel | ARROWS to navigate | Ctrl-T case | Ctrl-R regex)",
+      editorFindCallback);
+  editorSearchReset();
+
+  if (!query) {
+    return;
+  } else {
+    // restore saved cursor & scroll position in case no query was input
+    edt_conf.buf->csr_x = saved_csr_x;
+    edt_conf.buf->csr_y = saved_csr_y;
+    edt_conf.buf->col_off = saved_col_off;
+    edt_conf.buf->row_off = saved_row_off;
+  }
+
+  SAFE_FREE(query);
+}
+
+/***                                APPEND BUFFER                          ***/
+
+// Appends data to a custom dynamic output screen buffer, doubling its
+// capacity whenever it runs out
+void abAppend(struct abuf* ab, CONST_CHAR_PTR s, size_t len)
+{
+  if (ab->len + len > ab->cap) {
+    size_t new_cap = ab->cap ? ab->cap : 4096;
+    while (new_cap < ab->len + len) {
+      new_cap *= 2;
+    }
+
+    CHAR_PTR new = realloc(ab->buffer, new_cap);
+    if (!new)
+      return;
+    PERF_COUNT(allocs);
+
+    ab->buffer = new;
+    ab->cap = new_cap;
+  }
+
+  memcpy((ab->buffer + ab->len), s, len);
+  ab->len += len;
+}
+
+// Empties the buffer but keeps its memory for the next use
+void abReset(struct abuf* ab)
+{
+  ab->len = 0;
+}
+
+// Writes the whole buffer out, carrying on after partial writes and signals.
+// Returns 0 on success and -1 on error.
+int32_t
+abFlush(struct abuf* ab, int32_t fd)
+{
+  size_t done = 0;
+  while (done < ab->len) {
+    PERF_COUNT(syscalls);
+    ssize_t written = write(fd, ab->buffer + done, ab->len - done);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno == EAGAIN) {
+        struct pollfd out = { fd, POLLOUT, 0 };
+        PERF_COUNT(syscalls);
+        poll(&out, 1, -1);
+        continue;
+      }
+
+      return -1;
+    }
+
+    done += written;
+  }
+
+  return 0;
+}
+
+// Frees allocated memory for the output screen buffer
+void abFree(struct abuf* ab)
+{
+  SAFE_FREE(ab->buffer);
+  ab->len = ab->cap = 0;
+}
+
+/***                                INPUT                                  ***/
+
+// Asks user for input in cases like saving files or passing commands
+CHAR_PTR
+editorPrompt(CHAR_PTR prompt, void (*callback)(CHAR_PTR, int32_t))
+{
+  size_t bufsize = 128;
+  CHAR_PTR buf = calloc(bufsize, sizeof(char));
+
+  size_t buflen = 0;
+
+  // the prompt holds on to the message bar until it is answered
+  edt_conf.in_prompt = 1;
+  for (;;) {
+    editorSetStatusMessage(prompt, buf);
+    editorRefreshScreen();
+
+    int32_t ch = editorReadKey();
+    if (ch == DEL_KEY || ch == CTRL_KEY('h') || ch == BACKSPACE) {
+      if (buflen != 0) {
+        // a UTF-8 character goes as a whole
+        do {
+          --buflen;
+        } while (buflen != 0 && ((BYTE)buf[buflen] & 0xc0) == 0x80);
+        buf[buflen] = '\0';
+      }
+    } else if (ch == '\x1b') {
+      // using "ESC" to cancel user input
+      editorSetStatusMessage("");
+      edt_conf.in_prompt = 0;
+      if (callback) {
         callback(buf, ch);
       }
 
-      SAFE_FREE(buf);
-      return NULL;
-    } else if (ch == '\r') {
-      if (buflen != 0) {
-        editorSetStatusMessage("");
-        if (callback) {
-          callback(buf, ch);
+      SAFE_FREE(buf);
+      return NULL;
+    } else if (ch == '\r') {
+      if (buflen != 0) {
+        editorSetStatusMessage("");
+        edt_conf.in_prompt = 0;
+        if (callback) {
+          callback(buf, ch);
+        }
+
+        return buf;
+      }
+    } else if (ch == PASTE_START) {
+      // a prompt takes a single line, so a paste stops at its first break
+      size_t paste_len = 0;
+      CHAR_PTR paste = editorReadPaste(&paste_len);
+      for (size_t i = 0; i < paste_len && paste[i] != '\r' && paste[i] != '\n'; ++i) {
+        if (iscntrl((BYTE)paste[i])) {
+          continue;
+        }
+
+        if (buflen == bufsize - 1) {
+          bufsize *= 2;
+          buf = realloc(buf, bufsize);
+        }
+
+        buf[buflen++] = paste[i];
+      }
+
+      buf[buflen] = '\0';
+      SAFE_FREE(paste);
+    } else if (ch < 256 && !iscntrl(ch)) {
+      if (buflen == bufsize - 1) {
+        bufsize *= 2;
+        buf = realloc(buf, bufsize);
+      }
+
+      buf[buflen++] = ch;
+      buf[buflen] = '\0';
+    }
+
+    if (callback) {
+      callback(buf, ch);
+    }
+  }
+}
+
+// Moves the cursor using ARROW keys
+void editorMoveCursor(int32_t key)
+{
+  edt_row* row = editorRowAt(edt_conf.buf->csr_y);
+  switch (key) {
+  case ARROW_LEFT:
+    // bounds checking to prevent the cursor exceeding its bounds
+    if (edt_conf.buf->csr_x != 0) {
+      edt_conf.buf->csr_x = editorRowGlyphStart(row, edt_conf.buf->csr_x - 1);
+    } else if (edt_conf.buf->csr_y > 0) {
+      // move cursor to the end of previous line when arrow left is pressed at
+      // the beginning of a line
+      --edt_conf.buf->csr_y;
+      edt_conf.buf->csr_x = editorRowAt(edt_conf.buf->csr_y)->size;
+    }
+    break;
+  case ARROW_RIGHT:
+    // limit scrolling to the right
+    if (row && (size_t)edt_conf.buf->csr_x < row->size) {
+      int32_t len = 0x0;
+      editorRowGlyph(row, edt_conf.buf->csr_x, 0, &len, NULL);
+      edt_conf.buf->csr_x += len;
+    } else if (row && (size_t)edt_conf.buf->csr_x == row->size) {
+      // move cursor to the start of next line when arrow right is pressed at
+      // the end of a line
+      ++edt_conf.buf->csr_y;
+      edt_conf.buf->csr_x = 0x0;
+    }
+    break;
+  case ARROW_UP:
+    // bounds checking to prevent the cursor exceeding its bounds
+    if (edt_conf.buf->csr_y != 0) {
+      --edt_conf.buf->csr_y;
+    }
+    break;
+  case ARROW_DOWN:
+    // bounds checking to prevent the cursor exceeding its bounds
+    if (edt_conf.buf->csr_y < edt_conf.buf->num_rows) {
+      ++edt_conf.buf->csr_y;
+    }
+    break;
+  }
+
+  editorSnapCursor();
+}
+
+// Keeps the cursor within the row it moved to
+void editorSnapCursor(void)
+{
+  // snap cursor to end of line
+  edt_row* row = editorRowAt(edt_conf.buf->csr_y);
+
+  int32_t row_len = row ? row->size : 0x0;
+  if (edt_conf.buf->csr_x > row_len) {
+    edt_conf.buf->csr_x = row_len;
+  }
+
+  // and never leave it in the middle of a character
+  if (row) {
+    edt_conf.buf->csr_x = editorRowGlyphStart(row, edt_conf.buf->csr_x);
+  }
+}
+
+// Moves the cursor to the start of a line, which the next frame shows at the
+// top of the screen. Finding a row is a walk down the row tree, and a line
+// still mapped from the file is looked up in the buffer's line index: the
+// rows in between are never touched.
+void editorGotoLine(int32_t line)
+{
+  if (line >= edt_conf.buf->num_rows) {
+    line = edt_conf.buf->num_rows - 1;
+  }
+  if (line < 0) {
+    line = 0;
+  }
+
+  edt_conf.buf->csr_y = line;
+  edt_conf.buf->csr_x = 0;
+
+  // scrolled back up to the cursor, as after a search
+  edt_conf.buf->row_off = edt_conf.buf->num_rows;
+}
+
+// Asks for a line number, or for a percentage of the file with a trailing
+// '%', and goes there
+void editorGoto(void)
+{
+  CHAR_PTR input = editorPrompt("Go to line( N or N%% ): %s (ESC to cancel)", NULL);
+  if (!input) {
+    return;
+  }
+
+  CHAR_PTR end = NULL;
+  errno = 0;
+  long long value = strtoll(input, &end, 10);
+  u_int8_t percent = (end != input && *end == '%');
+  end += percent;
+  while (isspace((BYTE)*end)) {
+    ++end;
+  }
+
+  if (end == input || *end || errno || value < 0) {
+    editorSetStatusMessage("Not a line number: %.40s", input);
+    SAFE_FREE(input);
+    return;
+  }
+  SAFE_FREE(input);
+
+  if (percent) {
+    value = (value > 100) ? 100 : value;
+    editorGotoLine((int64_t)edt_conf.buf->num_rows * value / 100);
+  } else {
+    editorGotoLine(value > INT32_MAX ? INT32_MAX : value - 1);
+  }
+}
+
+// Reads the user-typed/input keys and executes actions for them.
+void editorProcessKeypress(void)
+{
+  static u_int8_t quit_times = MILLI_QUIT_TIMES;
+  int32_t in_key = editorReadKey();
+  u_int64_t start = PERF_ON() ? editorClockNs() : 0;
+  edt_conf.last_key = in_key;
+
+  // runs of typed characters and deletions are undone as a whole
+  u_int8_t typing = (in_key < ARROW_LEFT && !iscntrl(in_key)) || in_key == '\t'
+      || in_key == BACKSPACE || in_key == CTRL_KEY('h') || in_key == DEL_KEY;
+  editorUndoBegin(typing);
+
+  switch (in_key) {
+  case '\r':
+    editorInsertNewLine();
+    break;
+  case CTRL_KEY('q'): // use Ctrl-Q to quit
+    // a save still being written decides whether changes are left
+    editorSavePoll(1);
+    int32_t unsaved = 0;
+    for (int32_t i = 0; i < edt_conf.buf_count; ++i) {
+      unsaved += (edt_conf.bufs[i].dirty != 0);
+    }
+
+    if (unsaved && quit_times > 0) {
+      if (unsaved == 1 && edt_conf.buf->dirty) {
+        editorSetStatusMessage("WARNING! file has unsaved changes. Press "
+                               "Ctrl-Q %d more times to force-quit.",
+            quit_times--);
+      } else {
+        editorSetStatusMessage("WARNING! %d open files have unsaved changes. "
+                               "Press Ctrl-Q %d more times to force-quit.",
+            unsaved,
+            quit_times--);
+      }
+
+      return;
+    }
+
+    // Memory clean up
+    editorSearchShutdown();
+    editorFreeRows();
+    editorFreeSyntaxes();
+    editorScreenFree();
+
+    for (int32_t i = 0; i < edt_conf.buf_count; ++i) {
+      if (edt_conf.bufs[i].fname && edt_conf.bufs[i].empty_file) {
+        SAFE_FREE(edt_conf.bufs[i].fname);
+      }
+    }
+    SAFE_FREE(edt_conf.bufs);
+
+    if (!edt_conf.replay.active) {
+      CLR_SCRN();
+    }
+    exit(EXIT_SUCCESS);
+    break;
+
+  case CTRL_KEY('s'):
+    // save a file
+    editorSave();
+    break;
+
+  case CTRL_KEY('f'):
+    // Find a string in file
+    editorFind();
+    break;
+
+  case PASTE_START:
+    editorPaste();
+    break;
+
+  case CTRL_KEY('g'):
+    editorGoto();
+    break;
+
+  case CTRL_KEY('n'):
+    editorBufferSwitch(edt_conf.buf_cur + 1);
+    break;
+
+  case CTRL_KEY('b'):
+    editorBufferSwitch(edt_conf.buf_cur - 1);
+    break;
+
+  case CTRL_KEY('z'):
+    editorUndo();
+    break;
+
+  case CTRL_KEY('y'):
+    editorRedo();
+    break;
+
+  case PASTE_END:
+    break;
+
+  case HOME_KEY:
+    edt_conf.buf->csr_x = 0;
+    break;
+
+  case END_KEY:
+    // move cursor to end of line
+    if (edt_conf.buf->csr_y < edt_conf.buf->num_rows) {
+      edt_conf.buf->csr_x = editorRowAt(edt_conf.buf->csr_y)->size;
+    }
+    break;
+
+  case BACKSPACE:
+  case CTRL_KEY('h'):
+  case DEL_KEY:
+    if (in_key == DEL_KEY) {
+      editorMoveCursor(ARROW_RIGHT);
+    }
+    editorDelChar();
+    break;
+
+  case PAGE_UP:
+  case PAGE_DOWN: {
+    // pages are relative to the scroll position, which only gets updated
+    // when a frame is drawn: keys batched before the next frame need it now
+    editorScroll();
+
+    // scrolling entire pages with PAGE up and down keys: the cursor goes a
+    // page past the top or bottom line of the screen in one step, and only
+    // the row it lands on is looked at
+    int64_t y = (in_key == PAGE_UP)
+        ? (int64_t)edt_conf.buf->row_off - edt_conf.term_rows
+        : (int64_t)edt_conf.buf->row_off + 2 * (int64_t)edt_conf.term_rows - 1;
+
+    if (y > edt_conf.buf->num_rows) {
+      y = edt_conf.buf->num_rows;
+    }
+    edt_conf.buf->csr_y = (y < 0) ? 0 : (int32_t)y;
+    editorSnapCursor();
+  } break;
+
+  case ARROW_UP:
+  case ARROW_DOWN:
+  case ARROW_LEFT:
+  case ARROW_RIGHT:
+    editorMoveCursor(in_key);
+    break;
+
+  case CTRL_KEY('l'):
+    // redraw the whole screen, in case something else wrote over it
+    editorScreenInvalidate();
+    break;
+
+  case CTRL_KEY('p'):
+    // what the last frame cost, in place of the message bar
+    edt_conf.perf.hud = !edt_conf.perf.hud;
+    break;
+
+  case '\x1b':
+    break;
+
+  default:
+    // insert any other keys into the text that aren't specially mapped by the
+    // editor
+    editorInsertChar(in_key);
+    break;
+  }
+
+  editorUndoEnd(typing);
+  quit_times = MILLI_QUIT_TIMES;
+
+  if (start) {
+    editorPerfEvent(PERF_KEY, start, in_key);
+  }
+}
+
+/***                                SCREEN                                 ***/
+
+// Sizes the grids to the terminal, forcing a full redraw when that changes
+void editorScreenResize(int32_t rows, int32_t cols)
+{
+  scr_grid* screen = &edt_conf.screen;
+  if (screen->front && screen->rows == rows && screen->cols == cols) {
+    return;
+  }
+
+  SAFE_FREE(screen->front);
+  SAFE_FREE(screen->back);
+  screen->valid = 0;
+  screen->front = malloc(rows * cols * sizeof(scr_cell));
+  screen->back = malloc(rows * cols * sizeof(scr_cell));
+  if (!screen->front || !screen->back) {
+    HANDLE_ERR("malloc")
+  }
+
+  screen->rows = rows;
+  screen->cols = cols;
+}
+
+void editorScreenFree(void)
+{
+  scr_grid* screen = &edt_conf.screen;
+  abFree(&screen->out);
+  SAFE_FREE(screen->front);
+  SAFE_FREE(screen->back);
+  screen->rows = screen->cols = 0;
+  screen->valid = 0;
+}
+
+// Forgets what the terminal shows so that the next frame is drawn in full
+void editorScreenInvalidate(void)
+{
+  edt_conf.screen.valid = 0;
+}
+
+// Blanks the frame being composed
+void editorScreenClear(void)
+{
+  scr_grid* screen = &edt_conf.screen;
+  scr_cell blank = { ' ', COLOR_DEFAULT, 0 };
+
+  for (int32_t i = 0; i < screen->rows * screen->cols; ++i) {
+    screen->back[i] = blank;
+  }
+}
+
+// Sets a cell of the frame being composed, dropping cells off the screen
+void editorScreenPut(int32_t y, int32_t x, u_int32_t glyph, u_int8_t color, u_int8_t attr)
+{
+  scr_grid* screen = &edt_conf.screen;
+  if (y < 0 || y >= screen->rows || x < 0 || x >= screen->cols) {
+    return;
+  }
+
+  scr_cell* cell = screen->back + y * screen->cols + x;
+  cell->glyph = glyph;
+  cell->color = color;
+  cell->attr = attr;
+}
+
+// Writes "len" bytes of UTF-8 text into the frame and returns the column
+// after it. Invalid bytes show up as '?' and a wide character that would
+// run off the screen as a blank.
+int32_t
+editorScreenText(int32_t y, int32_t x, CONST_CHAR_PTR text, int32_t len, u_int8_t color, u_int8_t attr)
+{
+  for (int32_t i = 0; i < len;) {
+    int32_t cp = 0x0;
+    int32_t seq_len = editorUtf8Decode(text + i, len - i, &cp);
+    int32_t width = seq_len ? editorCharWidth(cp) : -1;
+
+    if (seq_len == 1) {
+      editorScreenPut(y, x++, (BYTE)text[i++], color, attr);
+      continue;
+    }
+
+    if (width < 0) {
+      editorScreenPut(y, x++, '?', color, attr);
+      i += seq_len ? seq_len : 1;
+      continue;
+    }
+
+    if (width && x + width > edt_conf.screen.cols) {
+      editorScreenPut(y, x, ' ', color, attr);
+    } else if (width) {
+      u_int32_t glyph = 0x0;
+      for (int32_t j = 0; j < seq_len; ++j) {
+        glyph |= (u_int32_t)(BYTE)text[i + j] << (8 * j);
+      }
+
+      editorScreenPut(y, x, glyph, color, attr);
+      if (width == 2) {
+        editorScreenPut(y, x + 1, 0x0, color, attr);
+      }
+    }
+
+    x += width;
+    i += seq_len;
+  }
+
+  return x;
+}
+
+// Switches the terminal's pen over to the look of a cell
+void editorScreenPen(struct abuf* ab, scr_cell* pen, scr_cell* cell)
+{
+  if (pen->color == cell->color && pen->attr == cell->attr) {
+    return;
+  }
+
+  char buf[24] = { '\0' };
+  int32_t len = 0;
+  if (pen->attr == cell->attr) {
+    len = snprintf(buf, sizeof(buf), "\x1b[%dm", cell->color);
+  } else {
+    // attributes can only be switched off all at once
+    len = snprintf(buf,
+        sizeof(buf),
+        "\x1b[0%s%s;%dm",
+        (cell->attr & CELL_BOLD) ? ";1" : "",
+        (cell->attr & CELL_INVERSE) ? ";7" : "",
+        cell->color);
+  }
+
+  abAppend(ab, buf, len);
+  *pen = *cell;
+}
+
+// Emits the cells of the composed frame that differ from what the terminal
+// shows, in runs reached with cursor addressing, and makes it the current
+// frame. A row whose tail went blank is cut short with an erase to its end.
+void editorScreenFlush(struct abuf* ab)
+{
+  scr_grid* screen = &edt_conf.screen;
+  scr_cell blank = { ' ', COLOR_DEFAULT, 0 };
+  scr_cell pen = blank;
+  int32_t cur_y = -1, cur_x = -1; // where the terminal's cursor is, if known
+  char buf[32] = { '\0' };
+
+  if (!screen->valid) {
+    abAppend(ab, "\x1b[2J", 4);
+    for (int32_t i = 0; i < screen->rows * screen->cols; ++i) {
+      screen->front[i] = blank;
+    }
+    screen->valid = 1;
+  }
+
+  for (int32_t y = 0; y < screen->rows; ++y) {
+    scr_cell* front = screen->front + y * screen->cols;
+    scr_cell* back = screen->back + y * screen->cols;
+
+    // everything after "last" is blank in the new frame
+    int32_t last = screen->cols - 1;
+    while (last >= 0 && CELL_EQ(back[last], blank)) {
+      --last;
+    }
+
+    for (int32_t x = 0; x < screen->cols;) {
+      if (CELL_EQ(front[x], back[x])) {
+        ++x;
+        continue;
+      }
+
+      // the right half of a wide character is written along with its left
+      // half, in either frame
+      if (x > 0 && (!back[x].glyph || !front[x].glyph)) {
+        --x;
+      }
+
+      if (cur_y != y || cur_x != x) {
+        int32_t len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+        abAppend(ab, buf, len);
+      }
+
+      if (x > last) {
+        editorScreenPen(ab, &pen, &blank);
+        abAppend(ab, "\x1b[K", 3);
+        break;
+      }
+
+      // a few unchanged cells are cheaper to rewrite than to jump over
+      int32_t end = x + 1;
+      for (int32_t i = end; i <= last && i - end < SCREEN_GAP; ++i) {
+        if (!CELL_EQ(front[i], back[i])) {
+          end = i + 1;
         }
+      }
+      while (end < screen->cols && (!back[end].glyph || !front[end].glyph)) {
+        ++end;
+      }
 
-        return buf;
+      // cells drawn with the same pen go out in a single append
+      while (x < end) {
+        editorScreenPen(ab, &pen, back + x);
+
+        char run[256] = { '\0' };
+        size_t run_len = 0;
+        for (; x < end && back[x].color == pen.color && back[x].attr == pen.attr && run_len + 4 <= sizeof(run); ++x) {
+          for (u_int32_t glyph = back[x].glyph; glyph; glyph >>= 8) {
+            run[run_len++] = glyph & 0xff;
+          }
+        }
+
+        abAppend(ab, run, run_len);
       }
-    } else if (!iscntrl(ch) && ch < 128) {
-      if (buflen == bufsize - 1) {
-        bufsize *= 2;
-        buf = realloc(buf, bufsize);
+
+      // past the last column the terminal holds the cursor for a wrap
+      cur_y = y;
+      cur_x = (x < screen->cols) ? x : -1;
+    }
+  }
+
+  editorScreenPen(ab, &pen, &blank);
+
+  scr_cell* shown = screen->back;
+  screen->back = screen->front;
+  screen->front = shown;
+}
+
+/***                                OUTPUT                                 ***/
+
+// Scrolls the cursor down or up for large files
+void editorScroll(void)
+{
+  edt_conf.buf->render_x = 0x0;
+  int32_t width = 1; // columns to keep in view for the character under the cursor
+  if (edt_conf.buf->csr_y < edt_conf.buf->num_rows) {
+    edt_row* row = editorRowAt(edt_conf.buf->csr_y);
+    edt_conf.buf->render_x = editorRowCxToRx(row, edt_conf.buf->csr_x);
+
+    if ((size_t)edt_conf.buf->csr_x < row->size && (BYTE)row->chars[edt_conf.buf->csr_x] >= 0x80) {
+      int32_t len = 0x0;
+      width = editorRowGlyph(row, edt_conf.buf->csr_x, edt_conf.buf->render_x, &len, NULL);
+    }
+  }
+
+  // handling vertical scrolling
+  if (edt_conf.buf->csr_y < edt_conf.buf->row_off) {
+    edt_conf.buf->row_off = edt_conf.buf->csr_y;
+  }
+
+  if (edt_conf.buf->csr_y >= (edt_conf.buf->row_off + edt_conf.term_rows)) {
+    edt_conf.buf->row_off = edt_conf.buf->csr_y - edt_conf.term_rows + 1;
+  }
+
+  // handling horizontal scrolling
+  if (edt_conf.buf->render_x < edt_conf.buf->col_off) {
+    edt_conf.buf->col_off = edt_conf.buf->render_x;
+  }
+
+  if (edt_conf.buf->render_x + width > edt_conf.buf->col_off + edt_conf.term_cols) {
+    edt_conf.buf->col_off = edt_conf.buf->render_x + width - edt_conf.term_cols;
+  }
+}
+
+// Composes the visible rows of the file into the screen grid
+void editorDrawRows(void)
+{
+  // rows on screen are consecutive so only the first one is looked up
+  edt_row* row = editorRowAt(edt_conf.buf->row_off);
+  int32_t y = 0;
+  for (; y < edt_conf.term_rows - 1; ++y) {
+    int32_t file_row = y + edt_conf.buf->row_off;
+
+    if (file_row >= edt_conf.buf->num_rows) {
+      editorScreenPut(y, 0, '~', COLOR_DEFAULT, 0);
+
+      // display welcome message only when an empty file is opened
+      if (edt_conf.buf->num_rows == 0 && y == edt_conf.term_rows / 3) {
+        char welcome[80] = { '\0' };
+        int32_t welcome_len = snprintf(welcome,
+            sizeof(welcome),
+            "Milli editor -- version %s",
+            MILLI_VERSION);
+
+        if (welcome_len > edt_conf.term_cols) {
+          welcome_len = edt_conf.term_cols;
+        }
+
+        // center welcome message, over the '~' when there is no room
+        int32_t padding = (edt_conf.term_cols - welcome_len) / 2;
+        editorScreenText(y, padding, welcome, welcome_len, COLOR_DEFAULT, 0);
       }
+      continue;
+    }
 
-      buf[buflen++] = ch;
-      buf[buflen] = '\0';
+    // display contents of file, building its caches on first sight
+    editorRowHighlight(row);
+    BYTE* hl = editorSearchOverlay(row, file_row);
+    int32_t right = edt_conf.buf->col_off + edt_conf.term_cols; // first column past the screen
+
+    // a glyph cut by the left edge starts off the screen
+    int32_t cx = (row->width > edt_conf.buf->col_off) ? editorRowRxToCx(row, edt_conf.buf->col_off) : (int32_t)row->size;
+    int32_t rx = editorRowCxToRx(row, cx);
+    while ((size_t)cx < row->size && rx < right) {
+      BYTE ch = row->chars[cx];
+      u_int8_t color = (hl[cx] == HL_NORMAL) ? COLOR_DEFAULT : editorSyntaxToColor(hl[cx]);
+
+      if (ch < 0x80 && ch != '\t' && (BYTE)row->chars[cx + 1] < 0x80) {
+        if (iscntrl(ch)) {
+          // highlighting non-printable characters
+          char sym = (ch <= 26) ? '@' + ch : '?';
+          editorScreenPut(y, rx - edt_conf.buf->col_off, (BYTE)sym, COLOR_DEFAULT, CELL_INVERSE);
+        } else {
+          editorScreenPut(y, rx - edt_conf.buf->col_off, ch, color, 0);
+        }
+
+        ++cx;
+        ++rx;
+        continue;
+      }
+
+      int32_t len = 0x0;
+      u_int32_t glyph = 0x0;
+      int32_t width = editorRowGlyph(row, cx, rx, &len, &glyph);
+
+      if (!glyph) {
+        editorScreenPut(y, rx - edt_conf.buf->col_off, (ch <= 26) ? '@' + ch : '?', COLOR_DEFAULT, CELL_INVERSE);
+      } else if (width == 1 || (rx >= edt_conf.buf->col_off && rx + width <= right)) {
+        // the columns after the first one of a wide character hold nothing
+        editorScreenPut(y, rx - edt_conf.buf->col_off, (ch == '\t') ? ' ' : glyph, color, 0);
+        for (int32_t i = 1; i < width; ++i) {
+          editorScreenPut(y, rx - edt_conf.buf->col_off + i, (ch == '\t') ? ' ' : 0x0, color, 0);
+        }
+      } else {
+        // blanks for the part of a wide character the screen's edges leave
+        for (int32_t i = 0; i < width; ++i) {
+          editorScreenPut(y, rx - edt_conf.buf->col_off + i, ' ', color, 0);
+        }
+      }
+
+      cx += len;
+      rx += width;
     }
 
-    if (callback) {
-      callback(buf, ch);
+    row = editorRowNext(row);
+  }
+}
+
+void editorDrawStatusBar(void)
+{
+  int32_t y = edt_conf.term_rows - 1;
+  char status[80] = { '\0' };
+  char rstatus[80] = { '\0' };
+  // int32_t coverage_percent = ((edt_conf.buf->csr_y + 1) / edt_conf.buf->num_rows) *
+  // 100;
+
+  // with several files open, which one of them this is
+  char which[32] = { '\0' };
+  if (edt_conf.buf_count > 1) {
+    snprintf(which, sizeof(which), "[%d/%d] ", edt_conf.buf_cur + 1, edt_conf.buf_count);
+  }
+
+  int32_t len = snprintf(status,
+      sizeof(status),
+      "%s%.20s - %d lines %s",
+      which,
+      edt_conf.buf->fname ? edt_conf.buf->fname : "[ No name ]",
+      edt_conf.buf->num_rows,
+      edt_conf.buf->dirty ? "[ modified ]" : "");
+  int32_t rlen = snprintf(rstatus,
+      sizeof(rstatus),
+      "[ %s%s | Ln: %d, Col: %d ]",
+      editorSearchStatus(),
+      edt_conf.buf->syntax ? edt_conf.buf->syntax->file_type : "text",
+      edt_conf.buf->csr_y + 1,
+      edt_conf.buf->csr_x);
+
+  if (len > edt_conf.term_cols) {
+    len = edt_conf.term_cols;
+  }
+
+  // display status bar with inverted colors: black text on a white background
+  for (int32_t x = 0; x < edt_conf.term_cols; ++x) {
+    editorScreenPut(y, x, ' ', COLOR_DEFAULT, CELL_BOLD | CELL_INVERSE);
+  }
+
+  editorScreenText(y, 0, status, len, COLOR_DEFAULT, CELL_BOLD | CELL_INVERSE);
+  if (rlen < (int32_t)sizeof(rstatus) && rlen <= edt_conf.term_cols - len) {
+    editorScreenText(y, edt_conf.term_cols - rlen, rstatus, rlen, COLOR_DEFAULT, CELL_BOLD | CELL_INVERSE);
+  }
+}
+
+void editorDrawMsgBar(void)
+{
+  if (edt_conf.perf.hud && !edt_conf.in_prompt) {
+    editorDrawPerfHud();
+    return;
+  }
+
+  // a background save shows how far along it is until it's done
+  edt_save* save = &edt_conf.save;
+  if (save->running && !edt_conf.in_prompt) {
+    char progress[80] = { '\0' };
+    int64_t written = atomic_load(&save->written);
+    int32_t percent = (written >= save->total) ? 100 : (int32_t)(written * 100 / save->total);
+    int32_t len = snprintf(progress, sizeof(progress), "Saving %s... %d%%", save->fname, percent);
+    if (len >= (int32_t)sizeof(progress)) {
+      len = sizeof(progress) - 1;
+    }
+    if (len > edt_conf.term_cols) {
+      len = edt_conf.term_cols;
     }
+    editorScreenText(edt_conf.term_rows, 0, progress, len, COLOR_DEFAULT, 0);
+    return;
+  }
+
+  int32_t msg_len = strlen(edt_conf.status_msg);
+  if (msg_len > edt_conf.term_cols) {
+    msg_len = edt_conf.term_cols;
+  }
+
+  if (msg_len && (edt_conf.in_prompt || (time(NULL) - edt_conf.status_msg_time) < STATUS_MSG_TIMEOUT)) {
+    editorScreenText(edt_conf.term_rows, 0, edt_conf.status_msg, msg_len, COLOR_DEFAULT, 0);
   }
 }
 
-// Moves the cursor using ARROW keys
-void editorMoveCursor(int32_t key)
+// Composes the next frame and sends the terminal what changed since the last
+void editorRefreshScreen(void)
 {
-  edt_row* row = (edt_conf.csr_y >= edt_conf.num_rows)
-      ? NULL
-      : edt_conf.row + edt_conf.csr_y;
-  switch (key) {
-  case ARROW_LEFT:
-    // bounds checking to prevent the cursor exceeding its bounds
-    if (edt_conf.csr_x != 0) {
-      --edt_conf.csr_x;
-    } else if (edt_conf.csr_y > 0) {
-      // move cursor to the end of previous line when arrow left is pressed at
-      // the beginning of a line
-      --edt_conf.csr_y;
-      edt_conf.csr_x = edt_conf.row[edt_conf.csr_y].size;
+  edt_perf* perf = &edt_conf.perf;
+  u_int64_t start = PERF_ON() ? editorClockNs() : 0;
+  u_int64_t syntax_ns = perf->cur.syntax_ns;
+
+  editorScroll();
+
+  // the grid covers the whole terminal, the bars below the text included
+  editorScreenResize(edt_conf.term_rows + 2, edt_conf.term_cols);
+  editorScreenClear();
+  editorDrawRows();
+  editorDrawStatusBar();
+  editorDrawMsgBar();
+
+  struct abuf* ab = &edt_conf.screen.out;
+  abReset(ab);
+
+  // hide cursor
+  abAppend(ab, "\x1b[?25l", 6);
+
+  editorScreenFlush(ab);
+
+  // move the cursor
+  char buf[32] = { '\0' };
+  snprintf(buf,
+      sizeof(buf),
+      "\x1b[%d;%dH",
+      1 + (edt_conf.buf->csr_y - edt_conf.buf->row_off),
+      1 + (edt_conf.buf->render_x - edt_conf.buf->col_off));
+  abAppend(ab, buf, strlen(buf));
+
+  // show cursor
+  abAppend(ab, "\x1b[?25h", 6);
+
+  if (start) {
+    perf->cur.draw_ns += editorPerfEvent(PERF_DRAW, start, perf->frames) - (perf->cur.syntax_ns - syntax_ns);
+    start = editorClockNs();
+  }
+
+  // a replay only keeps count of what it would have sent, a frame that only
+  // partly reached the terminal leaves it unknown
+  if (edt_conf.replay.active) {
+    ++edt_conf.replay.frames;
+    edt_conf.replay.out_bytes += ab->len;
+  } else if (abFlush(ab, STDOUT_FILENO) == -1) {
+    editorScreenInvalidate();
+  }
+
+  perf->cur.bytes += ab->len;
+  if (start) {
+    perf->cur.write_ns += editorPerfEvent(PERF_WRITE, start, ab->len);
+  }
+  editorPerfFrameEnd();
+}
+
+// Describes the ongoing search for the status bar
+CONST_CHAR_PTR
+editorSearchStatus(void)
+{
+  static char status[96] = { '\0' };
+  edt_search* search = &edt_conf.search;
+
+  if (!search->active) {
+    return "";
+  }
+
+  // only the modes that are switched on get named, the bar is narrow
+  char mode[16];
+  snprintf(mode,
+      sizeof(mode),
+      "%s%s%s%s",
+      search->regex ? "regex" : "",
+      search->regex && search->icase ? " " : "",
+      search->icase ? "icase" : "",
+      search->regex || search->icase ? " | " : "");
+
+  if (search->query_regex && search->query_len && !search->prog) {
+    snprintf(status, sizeof(status), "bad regex | %s", mode);
+  } else if (search->running) {
+    snprintf(status, sizeof(status), "%zu+ matches | %s", atomic_load(&search->found), mode);
+  } else if (search->current >= 0) {
+    snprintf(status, sizeof(status), "match %zu of %zu | %s", (size_t)search->current + 1, search->count, mode);
+  } else {
+    snprintf(status, sizeof(status), "%zu matches | %s", search->count, mode);
+  }
+
+  return status;
+}
+
+void editorSetStatusMessage(CONST_CHAR_PTR fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(edt_conf.status_msg, sizeof(edt_conf.status_msg), fmt, ap);
+  va_end(ap);
+
+  edt_conf.status_msg_time = time(NULL);
+}
+
+/***                                REPLAY                                 ***/
+
+// Reads a monotonic clock, in nanoseconds
+u_int64_t
+editorClockNs(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (u_int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Loads a recording of keys, "-" reading it from the standard input, and
+// switches the editor over to replaying it. The timings get reported on exit.
+void editorReplayLoad(CONST_CHAR_PTR path)
+{
+  edt_replay* replay = &edt_conf.replay;
+  int32_t fd = strcmp(path, "-") ? open(path, O_RDONLY) : STDIN_FILENO;
+  if (fd == -1) {
+    HANDLE_ERR("open")
+  }
+
+  size_t cap = INPUT_BUF_SIZE;
+  replay->keys = malloc(cap);
+  replay->len = 0;
+  for (;;) {
+    if (replay->len == cap) {
+      cap *= 2;
+      replay->keys = realloc(replay->keys, cap);
     }
-    break;
-  case ARROW_RIGHT:
-    // limit scrolling to the right
-    if (row && (size_t)edt_conf.csr_x < row->size) {
-      ++edt_conf.csr_x;
-    } else if (row && (size_t)edt_conf.csr_x == row->size) {
-      // move cursor to the start of next line when arrow right is pressed at
-      // the end of a line
-      ++edt_conf.csr_y;
-      edt_conf.csr_x = 0x0;
+    if (!replay->keys) {
+      HANDLE_ERR("malloc")
     }
-    break;
-  case ARROW_UP:
-    // bounds checking to prevent the cursor exceeding its bounds
-    if (edt_conf.csr_y != 0) {
-      --edt_conf.csr_y;
+
+    ssize_t nread = read(fd, replay->keys + replay->len, cap - replay->len);
+    if (nread == -1 && errno == EINTR) {
+      continue;
     }
-    break;
-  case ARROW_DOWN:
-    // bounds checking to prevent the cursor exceeding its bounds
-    if (edt_conf.csr_y < edt_conf.num_rows) {
-      ++edt_conf.csr_y;
+    if (nread == -1) {
+      HANDLE_ERR("read")
     }
-    break;
+    if (nread == 0) {
+      break;
+    }
+
+    replay->len += nread;
+  }
+
+  if (fd != STDIN_FILENO) {
+    close(fd);
+  }
+
+  replay->pos = 0;
+  replay->active = 1;
+  atexit(editorReplayReport);
+}
+
+// Stands in for waiting on the terminal: hands the rest of the recording
+// over, and ends the replay once it ran out. Nothing is waited on, the last
+// key's work having been settled already.
+ssize_t
+editorReplayWait(int32_t timeout)
+{
+  (void)timeout;
+  edt_replay* replay = &edt_conf.replay;
+  if (replay->pos == replay->len) {
+    exit(EXIT_SUCCESS);
+  }
+
+  return editorInputFill();
+}
+
+// Lets a save or search set off by the last key finish, as a user waiting on
+// the results would, so that its time is put down to that key
+void editorReplaySettle(void)
+{
+  editorSavePoll(1);
+  editorSearchFinish();
+}
+
+// Sorts a key into the kind of operation it's timed as
+int32_t
+editorReplayOp(int32_t key)
+{
+  switch (key) {
+  case '\r':
+    return REPLAY_NEWLINE;
+  case BACKSPACE:
+  case CTRL_KEY('h'):
+  case DEL_KEY:
+    return REPLAY_DELETE;
+  case CTRL_KEY('f'):
+    return REPLAY_SEARCH;
+  case PAGE_UP:
+  case PAGE_DOWN:
+    return REPLAY_PAGE;
+  case CTRL_KEY('s'):
+    return REPLAY_SAVE;
+  case '\t':
+  case PASTE_START:
+    return REPLAY_INSERT;
   }
 
-  // snap cursor to end of line
-  row = (edt_conf.csr_y >= edt_conf.num_rows) ? NULL
-                                              : edt_conf.row + edt_conf.csr_y;
+  return (key < ARROW_LEFT && !iscntrl(key)) ? REPLAY_INSERT : REPLAY_OTHER;
+}
 
-  int32_t row_len = row ? row->size : 0x0;
-  if (edt_conf.csr_x > row_len) {
-    edt_conf.csr_x = row_len;
+void editorReplayRecord(int32_t op, u_int64_t time)
+{
+  replay_stat* stat = edt_conf.replay.stats + op;
+  if (stat->count == stat->cap) {
+    stat->cap = stat->cap ? stat->cap * 2 : 1024;
+    stat->times = realloc(stat->times, stat->cap * sizeof(u_int64_t));
+    if (!stat->times) {
+      HANDLE_ERR("realloc")
+    }
   }
+
+  stat->times[stat->count++] = time;
 }
 
-// Reads the user-typed/input keys and executes actions for them.
-void editorProcessKeypress(void)
+int32_t
+editorCompareU64(const void* a, const void* b)
 {
-  static u_int8_t quit_times = MILLI_QUIT_TIMES;
-  int32_t in_key = editorReadKey();
-
-  switch (in_key) {
-  case '\r':
-    editorInsertNewLine();
-    break;
-  case CTRL_KEY('q'): // use Ctrl-Q to quit
-    if (edt_conf.dirty && quit_times > 0) {
-      editorSetStatusMessage("WARNING! file has unsaved changes. Press "
-                             "Ctrl-Q %d more times to force-quit.",
-          quit_times--);
+  u_int64_t x = *(const u_int64_t*)a;
+  u_int64_t y = *(const u_int64_t*)b;
+  return (x > y) - (x < y);
+}
 
-      return;
+// Prints the latency percentiles of each kind of key replayed, one line each
+// so that runs can be diffed
+void editorReplayReport(void)
+{
+  static CONST_CHAR_PTR names[REPLAY_OPS] = { "insert", "newline", "delete", "search", "page", "save", "other" };
+  static const u_int32_t percentiles[] = { 50, 90, 99 };
+  edt_replay* replay = &edt_conf.replay;
+
+  printf("%-8s %8s %10s %10s %10s %10s\n", "op", "count", "p50 us", "p90 us", "p99 us", "max us");
+  for (int32_t op = 0; op < REPLAY_OPS; ++op) {
+    replay_stat* stat = replay->stats + op;
+    if (!stat->count) {
+      continue;
     }
 
-    // Memory clean up
-    editorFreeRow(edt_conf.row);
-
-    if (edt_conf.fname && edt_conf.empty_file) {
-      SAFE_FREE(edt_conf.fname);
+    qsort(stat->times, stat->count, sizeof(u_int64_t), editorCompareU64);
+    printf("%-8s %8zu", names[op], stat->count);
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i) {
+      // nearest rank
+      size_t rank = (stat->count * percentiles[i] + 99) / 100;
+      printf(" %10.1f", stat->times[rank - 1] / 1e3);
     }
+    printf(" %10.1f\n", stat->times[stat->count - 1] / 1e3);
 
-    CLR_SCRN();
-    exit(EXIT_SUCCESS);
-    break;
+    SAFE_FREE(stat->times);
+    stat->count = stat->cap = 0;
+  }
 
-  case CTRL_KEY('s'):
-    // save a file
-    editorSave();
-    break;
+  printf("%zu frames, %zu bytes to the terminal\n", replay->frames, replay->out_bytes);
+  fflush(stdout);
+  SAFE_FREE(replay->keys);
+}
 
-  case CTRL_KEY('f'):
-    // Find a string in file
-    editorFind();
-    break;
+// Runs the editor over the loaded recording, one frame per key, timing each
+// key from reading it to its frame being composed. Doesn't return: the
+// replay ends from editorReplayWait().
+void editorReplay(void)
+{
+  editorRefreshScreen();
 
-  case HOME_KEY:
-    edt_conf.csr_x = 0;
-    break;
+  for (;;) {
+    u_int64_t start = editorClockNs();
+    editorProcessKeypress();
+    editorReplaySettle();
+    editorRefreshScreen();
+    editorReplayRecord(editorReplayOp(edt_conf.last_key), editorClockNs() - start);
+  }
+}
 
-  case END_KEY:
-    // move cursor to end of line
-    if (edt_conf.csr_y < edt_conf.num_rows) {
-      edt_conf.csr_x = edt_conf.row[edt_conf.csr_y].size;
-    }
-    break;
+/***                                PERF                                   ***/
 
-  case BACKSPACE:
-  case CTRL_KEY('h'):
-  case DEL_KEY:
-    if (in_key == DEL_KEY) {
-      editorMoveCursor(ARROW_RIGHT);
-    }
-    editorDelChar();
-    break;
+// Ends an event started at "start", appending it to the trace if there is
+// one. Returns how long it took.
+u_int64_t
+editorPerfEvent(int32_t event, u_int64_t start, u_int32_t arg)
+{
+  u_int64_t duration = editorClockNs() - start;
 
-  case PAGE_UP:
-  case PAGE_DOWN: {
-    // scrolling entire pages with PAGE up and down keys
-    if (in_key == PAGE_UP) {
-      edt_conf.csr_y = edt_conf.row_off;
-    } else if (in_key == PAGE_DOWN) {
-      edt_conf.csr_y = edt_conf.row_off + edt_conf.term_rows - 1;
+  edt_perf* perf = &edt_conf.perf;
+  if (perf->trace_fd != -1) {
+    perf_record record = { start, duration, event, arg };
+    abAppend(&perf->trace, (CONST_CHAR_PTR)&record, sizeof(record));
+  }
 
-      if (edt_conf.csr_y > edt_conf.num_rows) {
-        edt_conf.csr_y = edt_conf.num_rows;
-      }
-    }
+  return duration;
+}
+
+// Closes the books on a frame: its numbers become the ones the HUD shows and
+// the trace gets written out, once per frame or when enough piled up
+void editorPerfFrameEnd(void)
+{
+  edt_perf* perf = &edt_conf.perf;
+  if (perf->frame_start) {
+    editorPerfEvent(PERF_FRAME, perf->frame_start, perf->frames);
+  }
 
-    int32_t times = edt_conf.term_rows;
+  perf->last = perf->cur;
+  memset(&perf->cur, 0, sizeof(perf->cur));
+  ++perf->frames;
+  perf->frame_start = PERF_ON() ? editorClockNs() : 0;
 
-    while (times--) {
-      editorMoveCursor(in_key == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+  if (perf->trace_fd != -1 && perf->trace.len) {
+    if (abFlush(&perf->trace, perf->trace_fd) == -1) {
+      close(perf->trace_fd);
+      perf->trace_fd = -1;
+      editorSetStatusMessage("Trace stopped: %s", strerror(errno));
     }
-  } break;
+    abReset(&perf->trace);
+  }
+}
 
-  case ARROW_UP:
-  case ARROW_DOWN:
-  case ARROW_LEFT:
-  case ARROW_RIGHT:
-    editorMoveCursor(in_key);
-    break;
+// Starts streaming timings to a trace file: "MILLITRC", then one perf_record
+// per event
+void editorPerfTraceOpen(CONST_CHAR_PTR path)
+{
+  edt_perf* perf = &edt_conf.perf;
+  perf->trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (perf->trace_fd == -1) {
+    HANDLE_ERR("open")
+  }
 
-  case CTRL_KEY('l'):
-  case '\x1b':
-    break;
+  abAppend(&perf->trace, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1);
+  atexit(editorPerfTraceClose);
+}
 
-  default:
-    // insert any other keys into the text that aren't specially mapped by the
-    // editor
-    editorInsertChar(in_key);
-    break;
+// Writes out the records still buffered and closes the trace
+void editorPerfTraceClose(void)
+{
+  edt_perf* perf = &edt_conf.perf;
+  if (perf->trace_fd == -1) {
+    return;
   }
 
-  quit_times = MILLI_QUIT_TIMES;
+  abFlush(&perf->trace, perf->trace_fd);
+  close(perf->trace_fd);
+  perf->trace_fd = -1;
+  abFree(&perf->trace);
 }
 
-/***                                OUTPUT                                 ***/
-
-// Scrolls the cursor down or up for large files
-void editorScroll(void)
+// Shows what the last frame cost in the message bar
+void editorDrawPerfHud(void)
 {
-  edt_conf.render_x = 0x0;
-  if (edt_conf.csr_y < edt_conf.num_rows) {
-    edt_conf.render_x = editorRowCxToRx(edt_conf.row + edt_conf.csr_y, edt_conf.csr_x);
+  perf_frame* last = &edt_conf.perf.last;
+  char hud[128] = { '\0' };
+
+  int32_t len = snprintf(hud,
+      sizeof(hud),
+      "syntax %.2f | draw %.2f | write %.2f ms | %zu B | %zu syscalls | %zu allocs",
+      last->syntax_ns / 1e6,
+      last->draw_ns / 1e6,
+      last->write_ns / 1e6,
+      last->bytes,
+      last->syscalls,
+      last->allocs);
+  if (len >= (int32_t)sizeof(hud)) {
+    len = sizeof(hud) - 1;
   }
-
-  // handling vertical scrolling
-  if (edt_conf.csr_y < edt_conf.row_off) {
-    edt_conf.row_off = edt_conf.csr_y;
+  if (len > edt_conf.term_cols) {
+    len = edt_conf.term_cols;
   }
 
-  if (edt_conf.csr_y >= (edt_conf.row_off + edt_conf.term_rows)) {
-    edt_conf.row_off = edt_conf.csr_y - edt_conf.term_rows + 1;
-  }
+  editorScreenText(edt_conf.term_rows, 0, hud, len, COLOR_DEFAULT, CELL_INVERSE);
+}
 
-  // handling horizontal scrolling
-  if (edt_conf.render_x < edt_conf.col_off) {
-    edt_conf.col_off = edt_conf.render_x;
+/***                                BATCH                                  ***/
+
+// Copies text out of an edit script, up to the end of the line or an
+// unescaped "delim", turning "\n", "\t", "\\" and an escaped "delim" into
+// what they stand for. Regular expressions are copied "raw", keeping their
+// own escapes. Returns the length copied and where it stopped.
+size_t
+editorBatchUnescape(CHAR_PTR dst, CONST_CHAR_PTR src, char delim, u_int8_t raw, CONST_CHAR_PTR* end)
+{
+  size_t len = 0;
+  for (; *src && *src != delim; ++src) {
+    if (*src != '\\' || !src[1]) {
+      dst[len++] = *src;
+    } else if (src[1] == delim) {
+      dst[len++] = *++src;
+    } else if (!raw && (src[1] == 'n' || src[1] == 't' || src[1] == '\\')) {
+      ++src;
+      dst[len++] = (*src == 'n') ? '\n' : (*src == 't') ? '\t' : '\\';
+    } else {
+      dst[len++] = *src++;
+      dst[len++] = *src;
+    }
   }
 
-  if (edt_conf.render_x >= edt_conf.col_off + edt_conf.term_cols) {
-    edt_conf.col_off = edt_conf.render_x - edt_conf.term_cols + 1;
+  dst[len] = '\0';
+  if (end) {
+    *end = src;
   }
+
+  return len;
 }
 
-// Decorates the terminal interface with the content of the output screen buffer
-void editorDrawRows(struct abuf* ab)
+// Reads an edit script, one command per line, skipping blank lines and the
+// ones starting with '#'. A malformed script stops the run before any file
+// was touched.
+void editorBatchLoad(CONST_CHAR_PTR path)
 {
-  int32_t y = 0;
-  for (; y < edt_conf.term_rows - 1; ++y) {
-    int32_t file_row = y + edt_conf.row_off;
+  static CONST_CHAR_PTR names[] = { "goto", "find", "insert", "insert-line", "append-line", "delete", "delete-line", "replace" };
+  edt_batch* batch = &edt_conf.batch;
+  FILE* fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+  if (!fp) {
+    HANDLE_ERR("fopen")
+  }
 
-    if (file_row >= edt_conf.num_rows) {
-      // display welcome message only when an empty file is opened
-      if (edt_conf.num_rows == 0 && y == edt_conf.term_rows / 3) {
-        char welcome[80] = { '\0' };
-        int32_t welcome_len = snprintf(welcome,
-            sizeof(welcome),
-            "Milli editor -- version %s",
-            MILLI_VERSION);
+  CHAR_PTR line = NULL;
+  size_t line_cap = 0;
+  ssize_t line_len = 0;
+  for (int32_t line_no = 1; (line_len = getline(&line, &line_cap, fp)) != -1; ++line_no) {
+    while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) {
+      line[--line_len] = '\0';
+    }
+    if (!line_len || line[0] == '#') {
+      continue;
+    }
 
-        if (welcome_len > edt_conf.term_cols) {
-          welcome_len = edt_conf.term_cols;
-        }
+    size_t name_len = strcspn(line, " ");
+    CONST_CHAR_PTR arg = line[name_len] ? line + name_len + 1 : line + name_len;
+    batch_cmd cmd = { 0, 0, 1, NULL, 0, NULL, 0, line_no };
 
-        // center welcome message
-        int32_t padding = (edt_conf.term_cols - welcome_len) / 2;
-        if (padding) {
-          abAppend(ab, "~", 1);
-          --padding;
-        }
+    // "find" and "replace" take a regular expression when suffixed
+    if (name_len > 6 && !strncmp(line + name_len - 6, "-regex", 6)) {
+      cmd.regex = 1;
+      name_len -= 6;
+    }
 
-        while (padding--) {
-          abAppend(ab, " ", 1);
-        }
+    size_t op = 0;
+    while (op < sizeof(names) / sizeof(names[0]) && (strlen(names[op]) != name_len || strncmp(line, names[op], name_len))) {
+      ++op;
+    }
+    cmd.op = op;
+
+    CONST_CHAR_PTR error = NULL;
+    if (op == sizeof(names) / sizeof(names[0]) || (cmd.regex && op != BATCH_FIND && op != BATCH_REPLACE)) {
+      error = "unknown command";
+    } else if (op == BATCH_GOTO) {
+      cmd.count = strcmp(arg, "$") ? atoi(arg) - 1 : -1;
+      error = (cmd.count < 0 && strcmp(arg, "$")) ? "expected a line number or \"$\"" : NULL;
+    } else if (op == BATCH_DELETE || op == BATCH_DELETE_LINE) {
+      cmd.count = *arg ? atoi(arg) : 1;
+      error = (cmd.count <= 0) ? "expected a count" : NULL;
+    } else {
+      cmd.text = malloc(strlen(arg) + 1);
+      cmd.with = malloc(strlen(arg) + 1);
+      if (!cmd.text || !cmd.with) {
+        HANDLE_ERR("malloc")
+      }
 
-        // write welcome message
-        abAppend(ab, welcome, welcome_len);
+      // the first character of a replace's argument delimits its two halves
+      CONST_CHAR_PTR end = arg;
+      if (op == BATCH_REPLACE) {
+        char delim = *arg;
+        cmd.len = editorBatchUnescape(cmd.text, arg + (delim != '\0'), delim, cmd.regex, &end);
+        if (delim && *end == delim) {
+          cmd.with_len = editorBatchUnescape(cmd.with, end + 1, delim, 0, &end);
+        }
+        error = (!delim || !*end) ? "expected /old/new/" : NULL;
       } else {
-        abAppend(ab, "~", 1);
+        cmd.len = editorBatchUnescape(cmd.text, arg, '\0', cmd.regex, &end);
       }
-    } else {
-      // display contents of file
-      int32_t len = edt_conf.row[file_row].rsize - edt_conf.col_off;
 
-      if (len < 0) {
-        len = 0x0;
+      if (op == BATCH_FIND || op == BATCH_REPLACE) {
+        re_prog* prog = cmd.regex ? editorRegexCompile(cmd.text, 0) : NULL;
+        if (!cmd.len) {
+          error = "empty query";
+        } else if (cmd.regex && !prog) {
+          error = "bad regex";
+        }
+        editorRegexFree(prog);
       }
+    }
 
-      if (len > edt_conf.term_cols) {
-        len = edt_conf.term_cols;
+    if (error) {
+      fprintf(stderr, "%s:%d: %s\n", path, line_no, error);
+      exit(EXIT_FAILURE);
+    }
+
+    if (batch->count == batch->cap) {
+      batch->cap = batch->cap ? batch->cap * 2 : 16;
+      batch->cmds = realloc(batch->cmds, batch->cap * sizeof(batch_cmd));
+      if (!batch->cmds) {
+        HANDLE_ERR("realloc")
       }
+    }
+    batch->cmds[batch->count++] = cmd;
+  }
 
-      CHAR_PTR ch = edt_conf.row[file_row].render + edt_conf.col_off;
-      BYTE* hl = edt_conf.row[file_row].highlight + edt_conf.col_off;
-      int32_t curr_color = -1;
-      int32_t j = 0;
-      for (; j < len; ++j) {
-        if (iscntrl(ch[j])) {
-          // highlighting non-printable characters
-          char sym = (ch[j] <= 26) ? '@' + ch[j] : '?';
+  SAFE_FREE(line);
+  if (fp != stdin) {
+    fclose(fp);
+  }
+  batch->active = 1;
+}
 
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
+// Searches the whole buffer for the query of a find or replace, on the
+// search workers, and waits for all the matches
+void editorBatchSearch(batch_cmd* cmd)
+{
+  edt_search* search = &edt_conf.search;
+  editorSearchReset();
+  search->regex = cmd->regex;
+  search->icase = 0;
+  search->origin_y = edt_conf.buf->csr_y;
+  search->origin_x = edt_conf.buf->csr_x;
+
+  editorSearchRun(cmd->text);
+  editorSearchFinish();
+}
 
-          if (curr_color != -1) {
-            char buf[16] = { '\0' };
-            int32_t clen = snprintf(buf, sizeof(buf), "\x1b[%dm", curr_color);
-            abAppend(ab, buf, clen);
-          }
-        } else if (hl[j] == HL_NORMAL) {
-          // highlight all other characters with white
-          if (curr_color != -1) {
-            abAppend(ab, "\x1b[39m", 5);
-            curr_color = -1;
-          }
+// Carries out a command of the script at the cursor. Returns why the file
+// has to be skipped, or NULL.
+CONST_CHAR_PTR
+editorBatchRun(batch_cmd* cmd)
+{
+  edt_search* search = &edt_conf.search;
+  edt_row* row = NULL;
+  int32_t at = 0;
+
+  switch (cmd->op) {
+  case BATCH_GOTO:
+    // lines past the end go to the last one
+    editorGotoLine(cmd->count < 0 ? edt_conf.buf->num_rows - 1 : cmd->count);
+    break;
 
-          abAppend(ab, ch + j, 1);
-        } else {
-          // highlight all digits with RED
-          int32_t color = editorSyntaxToColor(hl[j]);
-          if (color != curr_color) {
-            curr_color = color;
-            char buf[16] = { '\0' };
-            int32_t clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
-          }
+  case BATCH_FIND:
+    // the cursor ends up right after the match, where a next find goes on
+    editorBatchSearch(cmd);
+    size_t next = editorSearchLowerBound(edt_conf.buf->csr_y, edt_conf.buf->csr_x);
+    if (next == search->count) {
+      return "no match";
+    }
 
-          abAppend(ab, ch + j, 1);
-        }
-      }
+    edt_conf.buf->csr_y = search->matches[next].line;
+    edt_conf.buf->csr_x = search->matches[next].col + search->matches[next].len;
+    break;
 
-      abAppend(ab, "\x1b[39m", 5);
+  case BATCH_INSERT:
+    editorInsertText(cmd->text, cmd->len);
+    break;
+
+  case BATCH_INSERT_LINE:
+  case BATCH_APPEND_LINE:
+    at = edt_conf.buf->csr_y + (cmd->op == BATCH_APPEND_LINE);
+    at = (at > edt_conf.buf->num_rows) ? edt_conf.buf->num_rows : at;
+
+    int32_t lines = 1;
+    for (size_t i = 0; i < cmd->len; ++i) {
+      lines += (cmd->text[i] == '\n');
     }
 
-    // clear to the right of the cursor for each redrawn line
-    abAppend(ab, "\x1b[K", 3);
+    editorInsertRows(at, cmd->text, cmd->len, lines);
+    edt_conf.buf->csr_y = at;
+    edt_conf.buf->csr_x = 0;
+    break;
 
-    abAppend(ab, "\r\n", 2);
-  }
+  case BATCH_DELETE:
+    // characters after the cursor, a line break counting as one
+    for (int32_t i = 0; i < cmd->count; ++i) {
+      row = editorRowAt(edt_conf.buf->csr_y);
+      if (!row || (edt_conf.buf->csr_y == edt_conf.buf->num_rows - 1 && (size_t)edt_conf.buf->csr_x >= row->size)) {
+        break;
+      }
 
-  // drawing the last line
-  abAppend(ab, "\x1b[K", 3);
-}
+      editorMoveCursor(ARROW_RIGHT);
+      editorDelChar();
+    }
+    break;
 
-void editorDrawStatusBar(struct abuf* ab)
-{
-  // display status bar with inverted colors: black text on a white background
-  abAppend(ab, "\x1b[1;7m", 6);
-  char status[80] = { '\0' };
-  char rstatus[80] = { '\0' };
-  // int32_t coverage_percent = ((edt_conf.csr_y + 1) / edt_conf.num_rows) *
-  // 100;
+  case BATCH_DELETE_LINE:
+    at = edt_conf.buf->num_rows - edt_conf.buf->csr_y;
+    editorDelRows(edt_conf.buf->csr_y, (cmd->count < at) ? cmd->count : at);
+    edt_conf.buf->csr_x = 0;
+    break;
 
-  int32_t len = snprintf(status,
-      sizeof(status),
-      "%.20s - %d lines %s",
-      edt_conf.fname ? edt_conf.fname : "[ No name ]",
-      edt_conf.num_rows,
-      edt_conf.dirty ? "[ modified ]" : "");
-  int32_t rlen = snprintf(rstatus,
-      sizeof(rstatus),
-      "[ %s | Ln: %d, Col: %d ]",
-      edt_conf.syntax ? edt_conf.syntax->file_type : "text",
-      edt_conf.csr_y + 1,
-      edt_conf.csr_x);
+  case BATCH_REPLACE: {
+    // the search jumps to a match, the cursor is meant to stay put
+    int32_t csr_x = edt_conf.buf->csr_x;
+    int32_t csr_y = edt_conf.buf->csr_y;
+    editorBatchSearch(cmd);
+
+    // matches may overlap, those running into the one kept before are dropped
+    size_t kept = 0;
+    for (size_t i = 0; i < search->count; ++i) {
+      srch_match* match = search->matches + i;
+      srch_match* prev = kept ? search->matches + kept - 1 : NULL;
+      if (match->len && !(prev && prev->line == match->line && prev->col + prev->len > match->col)) {
+        search->matches[kept++] = *match;
+      }
+    }
 
-  if (len > edt_conf.term_cols) {
-    len = edt_conf.term_cols;
-  }
+    // line breaks in the replacement split rows as if typed, moving the
+    // cursor down along with the lines below them
+    int32_t breaks = 0;
+    for (size_t i = 0; i < cmd->with_len; ++i) {
+      breaks += cmd->with[i] == '\n' || (cmd->with[i] == '\r' && (i + 1 == cmd->with_len || cmd->with[i + 1] != '\n'));
+    }
 
-  abAppend(ab, status, len);
+    // back to front, the matches not replaced yet stay where they were found
+    for (size_t i = kept; i-- > 0;) {
+      srch_match* match = search->matches + i;
+      row = editorRowAt(match->line);
+      editorRowDelStr(row, match->col, match->len);
 
-  while (len < edt_conf.term_cols) {
-    if ((edt_conf.term_cols - len) == rlen) {
-      abAppend(ab, rstatus, rlen);
-      break;
-    } else {
-      abAppend(ab, " ", 1);
-      ++len;
+      edt_conf.buf->csr_y = match->line;
+      edt_conf.buf->csr_x = match->col;
+      editorInsertText(cmd->with, cmd->with_len);
+      csr_y += (match->line < csr_y) ? breaks : 0;
+    }
+
+    edt_conf.buf->csr_x = csr_x;
+    edt_conf.buf->csr_y = csr_y;
+    row = editorRowAt(edt_conf.buf->csr_y);
+    if (row && (size_t)edt_conf.buf->csr_x > row->size) {
+      edt_conf.buf->csr_x = row->size;
     }
+  } break;
   }
 
-  abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2); // status message line
+  return NULL;
 }
 
-void editorDrawMsgBar(struct abuf* ab)
+// Runs the script over a file and saves it, telling on a line of its own
+// what became of it. Runs in a process of its own.
+int32_t
+editorBatchFile(CHAR_PTR path)
 {
-  abAppend(ab, "\x1b[K", 3);
+  // the editor gives up on files it can't open, which would take the whole
+  // process down without a word about the file
+  struct stat st;
+  if (stat(path, &st) == -1 || access(path, R_OK | W_OK) == -1) {
+    printf("%s: failed, %s\n", path, strerror(errno));
+    return BATCH_FAILED;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    printf("%s: failed, not a regular file\n", path);
+    return BATCH_FAILED;
+  }
 
-  int32_t msg_len = strlen(edt_conf.status_msg);
-  if (msg_len > edt_conf.term_cols) {
-    msg_len = edt_conf.term_cols;
+  edt_conf.batch.file = path;
+  initEditor();
+  edt_conf.buf->fname = path;
+  editorOpen();
+  edt_conf.buf->undo.paused = 1;
+
+  edt_batch* batch = &edt_conf.batch;
+  for (size_t i = 0; i < batch->count; ++i) {
+    CONST_CHAR_PTR reason = editorBatchRun(batch->cmds + i);
+    if (reason) {
+      printf("%s: skipped, line %d: %s\n", path, batch->cmds[i].line, reason);
+      return BATCH_SKIPPED;
+    }
   }
 
-  if (msg_len && (time(NULL) - edt_conf.status_msg_time) < STATUS_MSG_TIMEOUT) {
-    abAppend(ab, edt_conf.status_msg, msg_len);
+  if (!edt_conf.buf->dirty) {
+    printf("%s: unchanged\n", path);
+    return BATCH_UNCHANGED;
   }
+
+  editorSave();
+  editorSavePoll(1);
+  if (edt_conf.buf->dirty) {
+    printf("%s: failed, %s\n", path, edt_conf.status_msg);
+    return BATCH_FAILED;
+  }
+
+  printf("%s: saved\n", path);
+  return BATCH_SAVED;
 }
 
-// Refreshes and prepares the screen for decoration
-void editorRefreshScreen(void)
+// Edits the files with the loaded script, as many at a time as there are
+// CPUs, each in a process of its own. Fails when any of the files did.
+int32_t
+editorBatch(CHAR_PTR files[], int32_t count)
 {
-  editorScroll();
+  edt_batch* batch = &edt_conf.batch;
+  batch->jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (batch->jobs > count) {
+    batch->jobs = count;
+  }
+  if (batch->jobs < 1) {
+    batch->jobs = 1;
+  }
 
-  struct abuf ab = ABUF_INIT;
+  pid_t* pids = calloc(count, sizeof(pid_t)); // process editing each file
+  if (!pids) {
+    HANDLE_ERR("calloc")
+  }
 
-  // hide cursor
-  abAppend(&ab, "\x1b[?25l", 6);
+  size_t results[BATCH_RESULTS] = { 0 };
+  int32_t next = 0, running = 0;
+  fflush(stdout);
 
-  // reposition the cursor to the top-left corner( use H command )
-  abAppend(&ab, "\x1b[H", 3);
+  while (next < count || running) {
+    if (next < count && running < batch->jobs) {
+      pid_t pid = fork();
+      if (pid == -1) {
+        HANDLE_ERR("fork")
+      }
+      if (pid == 0) {
+        exit(editorBatchFile(files[next]));
+      }
 
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMsgBar(&ab);
+      pids[next++] = pid;
+      ++running;
+      continue;
+    }
 
-  // move the cursor
-  char buf[32] = { '\0' };
-  snprintf(buf,
-      sizeof(buf),
-      "\x1b[%d;%dH",
-      1 + (edt_conf.csr_y - edt_conf.row_off),
-      1 + (edt_conf.render_x - edt_conf.col_off));
-  abAppend(&ab, buf, strlen(buf));
+    int32_t status = 0;
+    pid_t pid = wait(&status);
+    if (pid == -1 && errno == EINTR) {
+      continue;
+    }
+    if (pid == -1) {
+      HANDLE_ERR("wait")
+    }
+    --running;
 
-  // show cursor
-  abAppend(&ab, "\x1b[?25h", 6);
+    int32_t result = WIFEXITED(status) ? WEXITSTATUS(status) : BATCH_FAILED;
+    if (result >= BATCH_RESULTS) {
+      result = BATCH_FAILED;
+    }
 
-  write(STDOUT_FILENO, ab.buffer, ab.len);
-  abFree(&ab);
-}
+    // a process that crashed didn't get to tell about its file
+    for (int32_t i = 0; !WIFEXITED(status) && i < next; ++i) {
+      if (pids[i] == pid) {
+        printf("%s: failed, killed by signal %d\n", files[i], WTERMSIG(status));
+        fflush(stdout);
+      }
+    }
+    ++results[result];
+  }
 
-void editorSetStatusMessage(CONST_CHAR_PTR fmt, ...)
-{
-  va_list ap;
-  va_start(ap, fmt);
-  vsnprintf(edt_conf.status_msg, sizeof(edt_conf.status_msg), fmt, ap);
-  va_end(ap);
+  free(pids);
+  fprintf(stderr,
+      "%zu saved, %zu unchanged, %zu skipped, %zu failed\n",
+      results[BATCH_SAVED],
+      results[BATCH_UNCHANGED],
+      results[BATCH_SKIPPED],
+      results[BATCH_FAILED]);
 
-  edt_conf.status_msg_time = time(NULL);
+  return results[BATCH_FAILED] ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 /***                                INIT                                   ***/
@@ -1308,38 +6460,101 @@ void editorSetStatusMessage(CONST_CHAR_PTR fmt, ...)
 // Initializes the editor and its configuration
 void initEditor(void)
 {
-  edt_conf.csr_x = edt_conf.csr_y = edt_conf.row_off = edt_conf.col_off = edt_conf.num_rows = edt_conf.dirty = edt_conf.render_x = 0x0;
-  edt_conf.row = NULL;
-  edt_conf.fname = NULL;
+  edt_conf.bufs = NULL;
+  edt_conf.buf_count = edt_conf.buf_cur = 0;
+  editorBufferNew();
+  memset(&edt_conf.arena, 0, sizeof(edt_conf.arena));
   INIT_ARRAY(edt_conf.status_msg, '\0');
   edt_conf.status_msg_time = 0;
-  edt_conf.syntax = NULL;
-  edt_conf.empty_file = 0;
+  edt_conf.in_prompt = 0;
+  memset(&edt_conf.search, 0, sizeof(edt_conf.search));
+  edt_conf.search.current = -1;
+  memset(&edt_conf.screen, 0, sizeof(edt_conf.screen));
+  memset(&edt_conf.perf, 0, sizeof(edt_conf.perf));
+  edt_conf.perf.trace_fd = -1;
 
   if (getTermWinSize(&edt_conf.term_rows, &edt_conf.term_cols) == -1) {
     HANDLE_ERR("getTermWinSize")
   }
 
   edt_conf.term_rows -= 2;
+  editorInitSignals();
 }
 
+#ifndef MILLI_BENCH
 int32_t
 main(int32_t argc, CHAR_PTR argv[])
 {
-  enableRawMode();
+  // "--replay KEYS" runs a recording of keys headless and times them,
+  // "--trace FILE" streams the timings of every frame to a file and
+  // "--batch SCRIPT" runs an edit script over all the files given
+  CONST_CHAR_PTR replay = NULL;
+  CONST_CHAR_PTR trace = NULL;
+  CONST_CHAR_PTR batch = NULL;
+  int32_t arg = 1;
+  for (; arg < argc && !strncmp(argv[arg], "--", 2); arg += 2) {
+    if (arg + 1 >= argc || (strcmp(argv[arg], "--replay") && strcmp(argv[arg], "--trace") && strcmp(argv[arg], "--batch"))) {
+      fprintf(stderr, "usage: %s [--replay KEYS] [--trace FILE] [FILE...]\n", argv[0]);
+      fprintf(stderr, "       %s --batch SCRIPT FILE...\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    if (!strcmp(argv[arg], "--replay")) {
+      replay = argv[arg + 1];
+    } else if (!strcmp(argv[arg], "--trace")) {
+      trace = argv[arg + 1];
+    } else {
+      batch = argv[arg + 1];
+    }
+  }
+
+  if (batch) {
+    if (arg == argc) {
+      fprintf(stderr, "%s: --batch needs files to edit\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    editorBatchLoad(batch);
+    return editorBatch(argv + arg, argc - arg);
+  }
+
+  // a broken syntax file is told about before the screen is taken over
+  editorSyntaxLoadDir();
+
+  if (replay) {
+    editorReplayLoad(replay);
+  } else {
+    enableRawMode();
+  }
+
   initEditor();
+  if (trace) {
+    editorPerfTraceOpen(trace);
+  }
 
-  if (argc >= 2) {
-    edt_conf.fname = argv[1];
+  // the first file goes on screen, the others wait in buffers of their own
+  if (argc > arg) {
+    edt_conf.buf->fname = argv[arg];
     editorOpen();
   }
+  for (int32_t i = arg + 1; i < argc; ++i) {
+    editorBufferOpen(argv[i]);
+  }
 
-  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-F = find | Ctrl-Q = quit");
+  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-F = find | Ctrl-G = goto | Ctrl-Z/Y = undo/redo | Ctrl-N/B = next/prev file | Ctrl-P = perf | Ctrl-Q = quit");
+  if (edt_conf.replay.active) {
+    editorReplay();
+  }
 
   for (;;) {
     editorRefreshScreen();
-    editorProcessKeypress();
+
+    // every key that already came in is handled before the next frame
+    do {
+      editorProcessKeypress();
+    } while (editorInputPending());
   }
 
   return EXIT_SUCCESS;
 }
+#endif
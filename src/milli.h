@@ -12,24 +12,42 @@
 #include <asm-generic/errno-base.h>
 #include <asm-generic/ioctls.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /***                                  DEFINES                             ***/
 #define INT_PTR int32_t*
 #define CHAR_PTR char*
 #define CONST_CHAR_PTR const char*
 #define BYTE unsigned char
+#define PTR_T void*
 
 // macro to clear the screen
 #define CLR_SCRN()                      \
@@ -45,11 +63,19 @@
     }                                             \
   }
 
-#define HANDLE_ERR(msg) \
-  {                     \
-    CLR_SCRN();         \
-    perror(msg);        \
-    exit(EXIT_FAILURE); \
+// in batch mode stdout carries a line per file and no screen is taken over,
+// so a file being edited is reported failed like any other
+#define HANDLE_ERR(msg)                                                          \
+  {                                                                              \
+    if (edt_conf.batch.file) {                                                   \
+      printf("%s: failed, %s: %s\n", edt_conf.batch.file, msg, strerror(errno)); \
+      exit(BATCH_FAILED);                                                        \
+    }                                                                            \
+    if (!edt_conf.batch.active) {                                                \
+      CLR_SCRN();                                                                \
+    }                                                                            \
+    perror(msg);                                                                 \
+    exit(EXIT_FAILURE);                                                          \
   }
 
 #define SAFE_FREE(x) \
@@ -64,16 +90,168 @@
 #define MILLI_TAB_STOP 8
 #define MILLI_QUIT_TIMES 3
 #define STATUS_MSG_TIMEOUT 5
-#define SEARCH_BACKWARDS -1
-#define SEARCH_FORWARDS 1
-#define SEARCH_NO_MATCH -1
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 #define CTRL_KEY(key) ((key) & (0x1f))
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+#define LEX_MAX_QUOTES 4 // characters a syntax may start strings with
+#define LEX_GROUP(s) ((s) < LEX_MLC ? 1 : (s) == LEX_MLC ? 2 : 4 << ((s) - LEX_STR)) // code, comment or one of the strings
+#define SYNTAX_DIR ".config/milli/syntax" // under $HOME, unless $MILLI_SYNTAX_DIR says otherwise
+#define ROW_NODE(r) ((row_node*)(r))
+#define ROW_COUNT(n) ((n) ? (n)->count : 0)
+#define ROW_DIRTY(n) ((n) ? (n)->dirty : 0)
+#define ROW_MAPPED(n) ((n)->span != NULL)
+#define LINE_INDEX_STEP 1024 // lines between two entries of a mapped file's line index
+#define ROW_SHARED(r) (edt_conf.save.running && edt_conf.save.buf == edt_conf.buf_cur && (r)->save_gen != edt_conf.save.gen)
+#define ARENA_CLASSES 25 // block sizes from 16 bytes to 64KB, in half steps
+#define ARENA_MAX_BLOCK (64 * 1024)
+#define ARENA_CHUNK_SIZE (1024 * 1024)
+#define ARENA_CAP(ptr) (((size_t*)(ptr))[-1]) // usable size of a block
+#define ARENA_FREE(ptr)     \
+  do {                      \
+    if (ptr) {              \
+      editorArenaFree(ptr); \
+      ptr = NULL;           \
+    }                       \
+  } while (0)
+#define HL_IDLE_BATCH 4096
+#define HL_SPAN_LINES 16384 // mapped lines lexed as one piece, each keeping the state it ends in
+#define KW_SEED_TRIES 64
+#define KW_MAX_SLOTS (1 << 20) // largest keyword table tried before giving up
+#define KW_MAX_LEN UINT8_MAX // longest keyword, see kw_slot
+#define SEARCH_CHUNK (256 * 1024) // bytes of text per search job
+#define SEARCH_SEG_COST 64 // per-segment overhead, in bytes, when sizing jobs
+#define SEARCH_MAX_WORKERS 16
+#define DFA_UNKNOWN -1
+#define DFA_MAX_STATES 512 // cached DFA states before the cache is flushed
+#define SET_HAS(set, ch) ((set)[(BYTE)(ch) >> 3] & (1 << ((BYTE)(ch)&7)))
+#define SET_ADD(set, ch) ((set)[(BYTE)(ch) >> 3] |= (1 << ((BYTE)(ch)&7)))
+#define INPUT_BUF_SIZE 4096
+#define SAVE_IOV_MAX 512 // pieces of text handed to a single writev
+#define SAVE_POLL_INTERVAL 100 // ms between progress updates while saving
+#ifndef UNDO_LOG_LIMIT
+#define UNDO_LOG_LIMIT (64 * 1024 * 1024) // bytes of undo history kept at most, unless $MILLI_UNDO_LIMIT says otherwise
+#endif
+#define UNDO_NONE ((size_t)-1)
+#define UNDO_REC_SIZE(len) ((sizeof(undo_rec) + (len) + 7) & ~(size_t)7)
+#define REPLAY_ROWS 24 // terminal size replays draw for, unless "LINES" and
+#define REPLAY_COLS 80 // "COLUMNS" in the environment say otherwise
+#define PERF_ON() (edt_conf.perf.hud || edt_conf.perf.trace_fd != -1) // whether frames get timed
+#define PERF_COUNT(what) (++edt_conf.perf.cur.what) // tallied for the current frame
+#define TRACE_MAGIC "MILLITRC" // start of a trace file, followed by perf_records
+#define TRACE_FLUSH_SIZE (64 * 1024) // bytes of records buffered between frames at most
+#define UNDO_REC(offset) ((undo_rec*)(edt_conf.buf->undo.log + (offset)))
+#define ESC_SEQ_TIMEOUT 50 // ms to wait for the rest of an escape sequence
+#define TERM_REPLY_TIMEOUT 1000 // ms to wait for the terminal to answer a query
+#define PASTE_MAX_WAITS 100 // escape timeouts tolerated in the middle of a paste
+#define SEARCH_POLL_INTERVAL 50 // ms between merges of results while searching
+#define COLOR_DEFAULT 39
+#define CELL_BOLD (1 << 0)
+#define CELL_INVERSE (1 << 1)
+#define SCREEN_GAP 6 // unchanged cells rewritten rather than jumped over
+#define CELL_EQ(a, b) ((a).glyph == (b).glyph && (a).color == (b).color && (a).attr == (b).attr)
+
+// paints "n" highlight cells unless only the comment state is being tracked
+#define HL_PAINT(hl, at, color, n)       \
+  do {                                   \
+    if (hl) {                            \
+      memset((hl) + (at), (color), (n)); \
+    }                                    \
+  } while (0)
+
+/***                                APPEND BUFFER                          ***/
+
+// dynamic string for appending only; its memory is kept across resets so a
+// buffer reused for every frame stops allocating once it is big enough
+struct abuf {
+  CHAR_PTR buffer;
+  size_t len;
+  size_t cap;
+};
+
+#define ABUF_INIT \
+  {               \
+    NULL, 0, 0    \
+  }
 
 /***                                  DATA                                ***/
 
+// region blocks of the row arena are carved out of, or a single block too big
+// for any size class
+typedef struct arena_chunk {
+  struct arena_chunk* next;
+  struct arena_chunk* prev; // only kept for large blocks, which are freed one by one
+  size_t used;
+  size_t size;
+} arena_chunk;
+
+// size-classed allocator holding everything rows are made of: tree nodes and
+// the chars, render and highlight buffers. Blocks keep their capacity in a
+// header so rows can grow into the slack of their class, freed blocks go on
+// per-class free lists and all of it is released at once, chunk by chunk.
+typedef struct row_arena {
+  PTR_T free_lists[ARENA_CLASSES];
+  arena_chunk* chunks;
+  arena_chunk* large; // blocks above ARENA_MAX_BLOCK, one per chunk
+  PTR_T node_free; // free tree nodes
+} row_arena;
+
+// slot of a compiled keyword table
+typedef struct keyword_slot {
+  CONST_CHAR_PTR word; // NULL for an empty slot
+  u_int8_t len;
+  BYTE hl; // HL_KEYWORD1 or HL_KEYWORD2
+} kw_slot;
+
+// keywords of a syntax compiled into a collision-free(perfect) hash table so
+// an identifier is looked up with a single probe
+typedef struct keyword_table {
+  kw_slot* slots;
+  u_int32_t mask; // number of slots - 1
+  u_int32_t seed; // seed making the hash collision-free for this keyword set
+  size_t min_len;
+  size_t max_len;
+} kw_table;
+
+// states of the table-driven lexer. Strings get a state per quote character,
+// from LEX_STR on.
+enum lexState {
+  LEX_SEP = 0, // after a separator, or at the start of the line
+  LEX_WORD, // in a word that can't be a keyword
+  LEX_WORDK, // in a word that started after a separator, a keyword maybe
+  LEX_NUM,
+  LEX_MLC, // in a multi-line comment
+  LEX_STR
+};
+
+// what the lexer does besides coloring a byte and moving to the next state,
+// in the order listed
+enum lexAction {
+  LEX_LOOKUP = 1 << 0, // the byte ends a word, which is looked up as a keyword
+  LEX_OPEN = 1 << 1, // the byte may start a comment
+  LEX_CLOSE = 1 << 2, // the byte may end a multi-line comment
+  LEX_ESCAPE = 1 << 3, // the byte escapes the next one in a string
+  LEX_MARK = 1 << 4, // the byte starts a word
+};
+
+// how the lexer handles a class of bytes in a state
+typedef struct lex_cell {
+  u_int8_t next; // state after the byte
+  u_int8_t hl; // color of the byte
+  u_int8_t action; // enum lexAction flags
+} lex_cell;
+
+// a syntax compiled into a lexer: bytes that behave the same in every state
+// share a class, and a state-transition table gives the handling of each
+// class in each state
+typedef struct lex_table {
+  BYTE cls[256];
+  int32_t classes;
+  int32_t states;
+  lex_cell* trans; // [state * classes + class]
+  u_int8_t quiet[256]; // LEX_GROUP() bits of the states a byte can't take out of their group
+} lex_table;
+
 // struct containing all syntax highlighting information for a given file type
 typedef struct editor_syntax {
   CHAR_PTR file_type;
@@ -83,36 +261,455 @@ typedef struct editor_syntax {
   CHAR_PTR* file_match;
   CHAR_PTR* keywords;
   int32_t flags;
+  kw_table* keyword_table; // "keywords" compiled on first use
+  CHAR_PTR quotes; // characters that start and end strings
+  lex_table* lexer; // compiled on first use
 } edt_sytx;
 
 // struct to store rows of text
 typedef struct editor_row {
   size_t size; // length of row in the file
-  size_t rsize; // size of the contents of "render"
-  BYTE* highlight; // contains highlight colors for lines in file
-  int32_t index; // index of file row within the file
+  BYTE* highlight; // highlight colors for each byte of "chars"
   int16_t hl_open_comment; // tracks rows in multi-line comments
+  u_int8_t hl_valid; // "highlight" is up to date with "chars"
+  u_int8_t hl_dirty; // "hl_open_comment" needs recomputing
+  u_int32_t save_gen; // last save "chars" was unshared for, see ROW_SHARED()
+  int32_t width; // columns the row takes on screen, once laid out
+  u_int8_t laid_out; // "width" and "cols" are up to date with "chars"
   CHAR_PTR chars;
-  CHAR_PTR render; // contains the actual characters to draw on the screen for
-      // the current row of text
+  INT_PTR cols; // glyph count then (position, column) pairs of the glyphs
+      // not drawn as one byte in one column: tabs and UTF-8 characters. NULL
+      // for rows without any, whose positions and columns match.
 } edt_row;
 
-struct editor_config {
+// node of the row tree: an implicit treap ordered by position in the file.
+// Nodes only know the size of their subtree so a row's index is computed on
+// demand by walking up to the root instead of being renumbered on every edit.
+// A node either holds one materialized row or a "span": a run of lines still
+// sitting untouched in the memory-mapped file.
+typedef struct row_node {
+  edt_row row; // must stay the first member, see ROW_NODE()
+  struct row_node* left;
+  struct row_node* right;
+  struct row_node* parent;
+  u_int32_t prio; // heap priority keeping the tree balanced
+  int32_t lines; // file lines this node stands for, 1 unless mapped
+  int32_t count; // number of file lines in this subtree
+  int32_t dirty; // rows in this subtree waiting for the highlighter
+  CONST_CHAR_PTR span; // start of the mapped lines, NULL once materialized
+  size_t span_len; // bytes of the mapped lines, newlines included
+  int32_t span_line; // line of the mapped file the span starts at
+} row_node;
+
+// node of a parsed regular expression
+typedef struct regex_node {
+  u_int8_t type; // one of enum regexNode
+  int32_t left; // operand(s), as indices into the parser's node array
+  int32_t right;
+  BYTE set[32]; // RE_SET: bitmap of the bytes it matches
+} re_node;
+
+// state of the recursive-descent regex parser
+typedef struct regex_parser {
+  CONST_CHAR_PTR p; // next character of the pattern
+  re_node* nodes;
+  int32_t count;
+  int32_t cap;
+  u_int8_t icase;
+  u_int8_t error;
+} re_parser;
+
+// state of the NFA a regular expression compiles to
+typedef struct regex_state {
+  u_int8_t type; // one of enum regexState
+  int32_t out;
+  int32_t out1; // second branch of RS_SPLIT
+  BYTE set[32]; // RS_SET: bitmap of the bytes it consumes
+} re_state;
+
+// regular expression compiled into a forward and a reversed NFA sharing one
+// state array
+typedef struct regex_prog {
+  re_state* states;
+  int32_t count;
+  int32_t cap;
+  int32_t fwd_start; // NFA of the expression
+  int32_t rev_start; // NFA of the expression read backwards
+  u_int8_t anchor_start; // pattern began with '^'
+  u_int8_t anchor_end; // pattern ended with '$'
+} re_prog;
+
+// DFA state standing for a set of NFA states
+typedef struct dfa_state {
+  int32_t next[256]; // DFA_UNKNOWN until the transition is first taken
+  int32_t set; // offset of its NFA states in the set pool
+  int32_t set_len; // 0 for the dead state
+  u_int32_t hash;
+  u_int8_t match;
+} dfa_state;
+
+// DFA over one of the NFAs of a re_prog, built lazily one transition at a
+// time while text is scanned. Its cache is flushed once it grows too large.
+typedef struct regex_dfa {
+  const re_prog* prog;
+  int32_t nfa_start;
+  u_int8_t unanchored; // every step may also begin a new match
+  int32_t start;
+  dfa_state* states;
+  int32_t count;
+  int32_t* pool; // NFA state sets of all DFA states
+  size_t pool_len;
+  size_t pool_cap;
+  int32_t* table; // DFA states hashed by their NFA set, -1 when empty
+  u_int32_t table_mask;
+  int32_t* seeds; // scratch for transitions
+  int32_t* stack; // scratch for closures
+  int32_t* closure;
+  u_int32_t* mark;
+  u_int32_t mark_gen;
+} re_dfa;
+
+// per-worker regex matching state
+typedef struct regex_matcher {
+  u_int64_t prog_id; // program the DFAs were built for
+  re_dfa rev; // finds where matches start, scanning backwards
+  re_dfa fwd; // finds the longest match from a start
+  BYTE* starts; // positions of the current line a match starts at
+  size_t starts_cap;
+  size_t* ends; // end of the longest match from each position, see editorRegexLongest()
+  size_t ends_cap;
+  int32_t* threads; // two lists of states of the reversed NFA
+  size_t* tags; // end of the match each of the threads would close
+} re_matcher;
+
+// position of a search hit
+typedef struct search_match {
+  int32_t line;
+  int32_t col; // byte offset into the line's "chars"
+  int32_t len;
+  CONST_CHAR_PTR text; // where the match starts, used to refine the query
+  size_t avail; // bytes from "text" to the end of the row or mapped span
+} srch_match;
+
+// contiguous piece of the buffer handed to the search workers
+typedef struct search_segment {
+  CONST_CHAR_PTR text;
+  size_t len;
+  int32_t line; // first line, -1 when it continues the mapped piece before
+  u_int8_t mapped; // may hold several lines
+  size_t hits; // matches found in it, set by the worker
+  size_t newlines; // newlines in it, set by the worker
+} srch_segment;
+
+// run of segments scanned by one worker at a time
+typedef struct search_job {
+  size_t first; // segments [first, last)
+  size_t last;
+  srch_match* matches; // lines relative to their segment
+  size_t count;
+  size_t cap;
+  atomic_uchar done;
+} srch_job;
+
+// results of the ongoing Ctrl-F search, in file order. The buffer is split
+// into jobs scanned by a pool of workers and the finished jobs are merged in
+// order into "matches" by the UI thread.
+typedef struct editor_search {
+  CHAR_PTR query; // query the matches were collected for
+  size_t query_len;
+  u_int8_t query_icase; // case mode the matches were collected with
+  u_int8_t query_regex; // whether the query was run as a regex
+  u_int8_t icase; // case mode asked for by the user
+  u_int8_t regex; // regex mode asked for by the user
+  re_prog* prog; // compiled query in regex mode, NULL if it didn't compile
+  u_int64_t prog_id; // bumped on every compile
+  u_int8_t active; // the search prompt is open
+  u_int8_t running; // jobs are still being scanned or merged
+  int32_t origin_y; // cursor position when the search began
+  int32_t origin_x;
+  srch_match* matches;
+  size_t count;
+  size_t cap;
+  int64_t current; // match the cursor sits on, -1 for none
+
+  srch_segment* segs;
+  size_t seg_count;
+  size_t seg_cap;
+  srch_job* jobs;
+  size_t job_count;
+  size_t job_cap;
+  size_t next_job; // next job to hand to a worker
+  size_t jobs_merged;
+  int32_t merge_line; // line the next mapped segment continues from
+  atomic_size_t found; // live match count, merged or not
+  atomic_uint_fast64_t generation; // bumped to cancel the jobs in flight
+
+  pthread_t* workers;
+  re_matcher* matchers; // one per worker
+  int32_t worker_count;
+  int32_t busy; // workers scanning a job
+  u_int8_t shutdown;
+  pthread_mutex_t lock;
+  pthread_cond_t wake; // new jobs or shutdown
+  pthread_cond_t idle; // all workers let go of their job
+} edt_search;
+
+// one character cell of the terminal
+typedef struct screen_cell {
+  u_int32_t glyph; // bytes of the character, first byte lowest
+  u_int8_t color; // SGR foreground color
+  u_int8_t attr; // CELL_BOLD, CELL_INVERSE
+} scr_cell;
+
+// the frame on the terminal and the one being composed; only the cells that
+// differ between them get written out
+typedef struct screen_grid {
+  scr_cell* front;
+  scr_cell* back;
+  int32_t rows;
+  int32_t cols;
+  u_int8_t valid; // whether "front" really is what the terminal shows
+  struct abuf out; // bytes of the frame being sent, reused between frames
+} scr_grid;
+
+// bytes read from the terminal that were not decoded into keys yet
+typedef struct editor_input {
+  char buf[INPUT_BUF_SIZE];
+  size_t start;
+  size_t len; // bytes waiting after "start"
+} edt_input;
+
+// pieces of the buffer queued up to be written to a file in one go
+typedef struct save_batch {
+  struct iovec iov[SAVE_IOV_MAX];
+  int32_t count;
+  int32_t fd;
+  int64_t written; // bytes that made it to the file so far
+  atomic_int_fast64_t* progress; // "written", published for the UI thread
+} save_batch;
+
+// row or run of mapped lines as they were when a save started
+typedef struct save_piece {
+  CONST_CHAR_PTR text;
+  size_t len;
+  u_int8_t mapped; // several lines straight out of the file
+} save_piece;
+
+// save running on a writer thread. It works off a snapshot of where the rows'
+// contents live, and rows edited meanwhile get a copy of their own first, the
+// old contents being kept alive until the writer is done with them.
+typedef struct editor_save {
+  u_int8_t running;
+  int32_t buf; // index of the buffer being saved
+  u_int32_t gen; // bumped on every save, rows from older ones are shared
+  CHAR_PTR fname;
+  save_piece* pieces;
+  size_t count;
+  u_int8_t crlf; // mapped pieces contain '\r' which must be stripped
+  int64_t total; // bytes to write
+  int32_t dirty; // edits the snapshot accounts for
+  PTR_T* kept; // row contents replaced during the save
+  size_t kept_count;
+  size_t kept_cap;
+  atomic_int_fast64_t written;
+  atomic_uchar done;
+  int32_t error; // errno of a failed save, 0 on success
+  pthread_t thread;
+} edt_save;
+
+// edit in the undo log, followed by the text it inserted or deleted. Row
+// records hold their rows' contents separated by '\n'.
+typedef struct undo_record {
+  u_int8_t type; // one of enum undoOp
+  u_int8_t first; // starts a group: the edits of one keypress or typing run
+  int32_t row;
+  int32_t col; // number of rows for row records
+  size_t len; // bytes of text
+  size_t prev; // bytes back to the previous record, 0 for the oldest
+  int32_t before_x; // cursor before the group
+  int32_t before_y;
+  int32_t after_x; // cursor after the group
+  int32_t after_y;
+} undo_rec;
+
+// append-only log of the edits made, in a single buffer. Records before
+// "cursor" can be undone and the ones after it redone. The oldest groups
+// are dropped when the log outgrows its limit.
+typedef struct editor_undo {
+  BYTE* log;
+  size_t cap;
+  size_t head; // oldest record kept
+  size_t cursor;
+  size_t end;
+  size_t last; // record right before "cursor", UNDO_NONE if there is none
+  size_t limit; // bytes of history kept at most
+  u_int8_t open; // edits join the last record's group
+  u_int8_t run; // typing may extend the last record
+  u_int8_t touched; // the current keypress logged something
+  u_int8_t paused; // edits aren't logged while undoing, redoing or loading
+  int32_t csr_x; // cursor when the current keypress started
+  int32_t csr_y;
+} edt_undo;
+
+// kinds of keys a replay times separately
+enum replayOp {
+  REPLAY_INSERT = 0,
+  REPLAY_NEWLINE,
+  REPLAY_DELETE,
+  REPLAY_SEARCH,
+  REPLAY_PAGE,
+  REPLAY_SAVE,
+  REPLAY_OTHER,
+  REPLAY_OPS
+};
+
+// how long each key of one kind took over a replay, in nanoseconds
+typedef struct replay_stat {
+  u_int64_t* times;
+  size_t count;
+  size_t cap;
+} replay_stat;
+
+// a session run without a terminal: keys come from a recording and frames
+// are composed as usual but never sent anywhere
+typedef struct editor_replay {
+  u_int8_t active;
+  CHAR_PTR keys;
+  size_t len;
+  size_t pos; // next byte of "keys" to hand over
+  size_t frames;
+  size_t out_bytes; // what the frames would have sent the terminal
+  replay_stat stats[REPLAY_OPS];
+} edt_replay;
+
+// events a trace file records
+enum perfEvent {
+  PERF_KEY = 0, // handling a key, "arg" is the key
+  PERF_SYNTAX, // lexing rows, "arg" is the row drawn or -1 for off-screen rows
+  PERF_DRAW, // composing a frame, highlighting included, "arg" is the frame
+  PERF_WRITE, // sending a frame to the terminal, "arg" is its bytes
+  PERF_FRAME, // a whole frame, from the end of the previous one, "arg" is the frame
+};
+
+// what a frame cost the editor, from the end of the previous frame on
+typedef struct perf_frame {
+  u_int64_t syntax_ns;
+  u_int64_t draw_ns; // highlighting left out
+  u_int64_t write_ns;
+  size_t bytes; // sent to the terminal
+  size_t syscalls; // made by the UI thread
+  size_t allocs; // arena blocks and output buffer growth
+} perf_frame;
+
+// record of a trace file, in the machine's byte order
+typedef struct perf_record {
+  u_int64_t start; // ns on the monotonic clock
+  u_int64_t duration; // ns
+  u_int32_t event; // one of enum perfEvent
+  u_int32_t arg;
+} perf_record;
+
+// instrumentation of the frames, shown in the message bar (Ctrl-P) and/or
+// streamed to a trace file
+typedef struct editor_perf {
+  u_int8_t hud;
+  perf_frame cur; // frame in the making
+  perf_frame last; // frame last sent
+  u_int64_t frame_start;
+  u_int32_t frames;
+  int32_t trace_fd; // -1 when not tracing
+  struct abuf trace; // records not written yet
+} edt_perf;
+
+// commands of a batch edit script
+enum batchOp {
+  BATCH_GOTO = 0,
+  BATCH_FIND,
+  BATCH_INSERT,
+  BATCH_INSERT_LINE,
+  BATCH_APPEND_LINE,
+  BATCH_DELETE,
+  BATCH_DELETE_LINE,
+  BATCH_REPLACE
+};
+
+// what became of a file edited in batch, which is also the exit status of
+// the process that edited it
+enum batchResult {
+  BATCH_SAVED = 0,
+  BATCH_UNCHANGED,
+  BATCH_SKIPPED, // a find came up empty, the file is left alone
+  BATCH_FAILED,
+  BATCH_RESULTS
+};
+
+typedef struct batch_cmd {
+  u_int8_t op; // one of enum batchOp
+  u_int8_t regex; // the query of a find or replace is a regular expression
+  int32_t count; // line to go to (-1 for the last), characters or lines to delete
+  CHAR_PTR text; // text inserted or searched for
+  size_t len;
+  CHAR_PTR with; // replacement of a replace
+  size_t with_len;
+  int32_t line; // in the script, for messages
+} batch_cmd;
+
+// an edit script run headless over many files, each one in a process of
+// its own
+typedef struct editor_batch {
+  u_int8_t active;
+  batch_cmd* cmds;
+  size_t count;
+  size_t cap;
+  int32_t jobs; // files edited at the same time
+  CONST_CHAR_PTR file; // file the process edits, NULL in the one handing them out
+} edt_batch;
+
+// an open file: its rows, along with their highlighting, and where the user
+// was in it. Switching buffers just points the editor at another one.
+typedef struct editor_buffer {
   int32_t csr_x; // cursor's X position into "chars" content
   int32_t csr_y; // cursor's Y position
-  int32_t render_x; // cursor's X position into "render" content
+  int32_t render_x; // screen column of the cursor within its row
   int32_t row_off; // row offset to track scrolling into file
   int32_t col_off; // column offset to track scrolling into file
   int32_t dirty; // tracks if text buffer's dirty(if file's been modified)
-  int32_t term_rows;
-  int32_t term_cols;
   int32_t num_rows;
   u_int8_t empty_file;
-  edt_row* row;
+  row_node* rows; // root of the row tree
+  CHAR_PTR map; // read-only mapping of the opened file
+  size_t map_len;
+  u_int8_t map_crlf; // mapping contains '\r' which must be stripped
+  size_t* line_index; // offset into "map" of every LINE_INDEX_STEP-th line
+  size_t line_index_len;
+  size_t line_index_cap;
   CHAR_PTR fname;
-  char status_msg[80];
-  time_t status_msg_time;
   edt_sytx* syntax;
+  edt_undo undo;
+} edt_buffer;
+
+struct editor_config {
+  edt_buffer* buf; // buffer on screen
+  edt_buffer* bufs;
+  int32_t buf_count;
+  int32_t buf_cur; // index of "buf"
+  int32_t term_rows;
+  int32_t term_cols;
+  row_arena arena; // storage of the rows of all the buffers
+  char status_msg[160];
+  time_t status_msg_time;
+  u_int8_t in_prompt; // a prompt's text in the message bar doesn't expire
+  edt_sytx* syntax_db; // syntaxes loaded from files, tried before HLDB
+  size_t syntax_count;
+  edt_search search;
+  edt_save save;
+  scr_grid screen;
+  edt_input input;
+  edt_replay replay;
+  edt_perf perf;
+  edt_batch batch;
+  int32_t last_key; // key the last call to editorProcessKeypress() handled
+  int32_t signal_pipe[2]; // signal handlers wake the event loop through it
   struct termios
       orig_term_attrs; // storing the current state of the text editor
 };
@@ -128,7 +725,35 @@ enum editorKey {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  PASTE_START, // bracketed paste markers
+  PASTE_END
+};
+
+// kinds of records in the undo log
+enum undoOp {
+  UNDO_INSERT_TEXT = 0,
+  UNDO_DELETE_TEXT,
+  UNDO_INSERT_ROWS,
+  UNDO_DELETE_ROWS
+};
+
+// regex syntax tree node types
+enum regexNode {
+  RE_EMPTY = 0,
+  RE_SET,
+  RE_CAT,
+  RE_ALT,
+  RE_STAR,
+  RE_PLUS,
+  RE_QUEST
+};
+
+// regex NFA state types
+enum regexState {
+  RS_SET = 0,
+  RS_SPLIT,
+  RS_MATCH
 };
 
 // Possible highlight color values to use in our editor
@@ -143,66 +768,318 @@ enum editorHighlight {
   HL_MATCH
 };
 
-/***                                APPEND BUFFER                          ***/
-
-// dynamic string for appending only
-struct abuf {
-  CHAR_PTR buffer;
-  size_t len;
-};
-
-#define ABUF_INIT \
-  {               \
-    NULL, 0       \
-  }
-
 /***                                  FUNCTION PROTOTYPES                 ***/
 void disableRawMode(void);
 void enableRawMode(void);
+void editorSignalHandler(int32_t sig);
+void editorInitSignals(void);
+void editorHandleResize(void);
+ssize_t
+editorInputFill(void);
+ssize_t
+editorWaitInput(int32_t timeout);
+u_int8_t
+editorInputPending(void);
+int32_t
+editorIdleTimeout(void);
+void editorIdle(void);
+int32_t
+editorInputByte(void);
+int32_t
+editorDecodeEscape(void);
 int32_t
 editorReadKey(void);
+CHAR_PTR
+editorReadPaste(size_t* len);
 int32_t
 getCursorPosition(INT_PTR rows, INT_PTR cols);
 int32_t
 getTermWinSize(INT_PTR rows, INT_PTR cols);
 int8_t
 is_separator(int32_t ch);
+int8_t
+editorLexLine(CONST_CHAR_PTR text, size_t len, int8_t in_ml_comm, BYTE* hl);
+int8_t
+editorLexSpan(CONST_CHAR_PTR text, size_t len, int8_t in_ml_comm);
+int8_t
+editorRowStartState(edt_row* row);
 void editorUpdateSyntax(edt_row* row);
+u_int8_t
+editorSyntaxCatchUp(int32_t upto, int32_t budget);
+void editorSyntaxIdle(void);
+edt_row*
+editorRowHighlight(edt_row* row);
+u_int32_t
+editorKeywordHash(CONST_CHAR_PTR word, size_t len, u_int32_t seed);
+kw_table*
+editorCompileKeywords(CHAR_PTR* keywords);
+BYTE editorKeywordLookup(kw_table* table, CONST_CHAR_PTR word, size_t len);
+lex_cell
+editorLexRule(edt_sytx* syntax, int32_t state, BYTE ch);
+lex_table*
+editorCompileLexer(edt_sytx* syntax);
+void editorFreeSyntax(edt_sytx* syntax, u_int8_t loaded);
+void editorFreeSyntaxes(void);
+CHAR_PTR
+editorSyntaxWord(CHAR_PTR* line);
+int32_t
+editorSyntaxLoad(CONST_CHAR_PTR path);
+void editorSyntaxLoadDir(void);
+u_int8_t
+editorSyntaxMatches(edt_sytx* syntax, CONST_CHAR_PTR fname);
 int32_t
 editorSyntaxToColor(int32_t hl_value);
 void editorSelectSyntaxHighlight(void);
 int32_t
+editorUtf8Decode(CONST_CHAR_PTR text, size_t len, int32_t* cp);
+u_int8_t
+editorUtf8InRanges(int32_t cp, u_int32_t (*ranges)[2], size_t count);
+int32_t
+editorCharWidth(int32_t cp);
+int32_t
+editorRowGlyph(edt_row* row, int32_t cx, int32_t rx, INT_PTR len, u_int32_t* glyph);
+int32_t
+editorRowColAt(edt_row* row, int32_t cx);
+int32_t
 editorRowCxToRx(edt_row* row, int32_t cx);
 int32_t
 editorRowRxToCx(edt_row* row, int32_t rx);
+int32_t
+editorRowGlyphStart(edt_row* row, int32_t cx);
+int32_t
+editorArenaClass(size_t size);
+size_t
+editorArenaClassSize(int32_t cls);
+PTR_T
+editorArenaCarve(size_t cap);
+PTR_T
+editorArenaAlloc(size_t size);
+PTR_T
+editorArenaRealloc(PTR_T ptr, size_t size);
+row_node*
+editorArenaNodeAlloc(void);
+void editorArenaNodeFree(row_node* node);
+void editorArenaFree(PTR_T ptr);
+void editorArenaReset(void);
+void rowTreePull(row_node* node);
+void rowTreeSplit(row_node* node, int32_t at, row_node** left, row_node** right);
+row_node*
+rowTreeMerge(row_node* left, row_node* right);
+void rowTreeMarkDirty(row_node* node);
+row_node*
+rowTreeFirstDirty(INT_PTR at);
+void editorRowSetDirty(edt_row* row, u_int8_t dirty);
+row_node*
+rowTreeFind(int32_t at, INT_PTR start);
+row_node*
+rowTreeFirst(row_node* node);
+row_node*
+rowTreeNext(row_node* node);
+row_node*
+rowTreePrev(row_node* node);
+row_node*
+rowNodeNew(int32_t lines);
+size_t
+editorCountNewlines(CONST_CHAR_PTR buf, size_t len);
+void editorLineIndexAdd(size_t offset);
+size_t
+editorIndexLines(CONST_CHAR_PTR buf, size_t len);
+CONST_CHAR_PTR
+editorSpanLine(CONST_CHAR_PTR span, size_t len, int32_t line, size_t* line_len);
+CONST_CHAR_PTR
+editorSpanSeek(row_node* node, int32_t line, size_t* line_len);
+row_node*
+editorSpanSplit(row_node* node, int32_t start, int32_t lines);
+edt_row*
+editorRowMaterialize(row_node* node, int32_t start, int32_t line);
+edt_row*
+editorRowAt(int32_t at);
+int32_t
+editorRowIndex(edt_row* row);
+edt_row*
+editorRowNext(edt_row* row);
+edt_row*
+editorRowPrev(edt_row* row);
 void editorUpdateRow(edt_row* row);
+int32_t
+editorRowCountWide(CONST_CHAR_PTR text, size_t len);
+edt_row*
+editorRowLayout(edt_row* row);
 void editorInsertRow(int32_t at, CHAR_PTR s, size_t len);
+void editorInsertRows(int32_t at, CONST_CHAR_PTR text, size_t len, int32_t count);
 void editorFreeRow(edt_row* row);
+void rowTreeFree(row_node* node);
+void editorFreeRows(void);
+void editorDelRows(int32_t at, int32_t count);
 void editorDelRow(int32_t at);
+void editorRowInsertStr(edt_row* row, int32_t at, CONST_CHAR_PTR s, size_t len);
 void editorRowInsertChar(edt_row* row, int32_t at, int32_t ch);
 void editorRowAppendStr(edt_row* row, CHAR_PTR s, size_t len);
-void editorRowDelChar(edt_row* row, int32_t at);
+void editorRowDelStr(edt_row* row, int32_t at, size_t len);
 void editorInsertChar(int32_t ch);
 void editorInsertNewLine(void);
+void editorInsertText(CONST_CHAR_PTR text, size_t len);
+void editorPaste(void);
 void editorDelChar(void);
-CHAR_PTR
-editorRowsToStr(INT_PTR buf_len);
+void editorUndoReserve(size_t size);
+undo_rec*
+editorUndoRecord(u_int8_t type, int32_t row, int32_t col, CONST_CHAR_PTR text, size_t len);
+void editorUndoExtend(CONST_CHAR_PTR text, size_t len, u_int8_t front);
+void editorUndoBegin(u_int8_t typing);
+void editorUndoEnd(u_int8_t typing);
+void editorUndoTrim(void);
+void editorUndoReset(void);
+size_t
+editorUndoLimit(void);
+void editorUndoApply(undo_rec* rec, u_int8_t revert);
+void editorUndoMoveCursor(int32_t x, int32_t y);
+void editorUndo(void);
+void editorRedo(void);
+int32_t
+editorSaveFlush(save_batch* batch);
+int32_t
+editorSaveAppend(save_batch* batch, CONST_CHAR_PTR text, size_t len);
+int32_t
+editorSpanWrite(save_batch* batch, CONST_CHAR_PTR span, size_t len, u_int8_t crlf);
+int32_t
+editorWritePieces(int32_t fd, edt_save* save);
+void editorOpenStream(FILE* fp);
 void editorOpen();
+int32_t
+editorWriteFile(edt_save* save);
+void editorSyncDir(CONST_CHAR_PTR path);
+void editorSaveKeep(PTR_T block);
+void editorRowUnshare(edt_row* row);
+PTR_T
+editorSaveWorker(PTR_T arg);
+int32_t
+editorSaveStart(void);
+u_int8_t
+editorSavePoll(u_int8_t wait);
 void editorSave(void);
+int32_t
+editorBufferNew(void);
+int32_t
+editorBufferOpen(CHAR_PTR fname);
+void editorBufferSwitch(int32_t index);
+int32_t
+regexNewNode(re_parser* parser, u_int8_t type, int32_t left, int32_t right);
+void regexAddChar(re_parser* parser, BYTE* set, BYTE ch);
+u_int8_t
+regexParseEscape(re_parser* parser, BYTE* set);
+int32_t
+regexParseClass(re_parser* parser);
+int32_t
+regexParseAlt(re_parser* parser);
+int32_t
+regexParseAtom(re_parser* parser);
+int32_t
+regexParseRepeat(re_parser* parser);
+int32_t
+regexParseCat(re_parser* parser);
+int32_t
+regexNewState(re_prog* prog, u_int8_t type, int32_t out, int32_t out1);
+int32_t
+regexCompileNode(re_prog* prog, re_node* nodes, int32_t node, int32_t next, u_int8_t reverse);
+re_prog*
+editorRegexCompile(CONST_CHAR_PTR pattern, u_int8_t icase);
+void editorRegexFree(re_prog* prog);
+void editorDfaInit(re_dfa* dfa, const re_prog* prog, int32_t nfa_start, u_int8_t unanchored);
+void editorDfaFree(re_dfa* dfa);
+void editorDfaFlush(re_dfa* dfa);
+int32_t
+editorDfaAdd(re_dfa* dfa, int32_t* seeds, int32_t seed_count);
+int32_t
+editorDfaStep(re_dfa* dfa, int32_t state, BYTE ch);
+void editorMatcherPrepare(re_matcher* matcher, const re_prog* prog, u_int64_t prog_id);
+void editorMatcherFree(re_matcher* matcher);
+void editorRegexAddThread(re_dfa* dfa, int32_t* list, size_t* tags, INT_PTR count, int32_t state, size_t tag);
+void editorRegexLongest(re_matcher* matcher, CONST_CHAR_PTR text, size_t len, size_t from);
+void editorRegexLine(re_matcher* matcher, CONST_CHAR_PTR text, size_t len, int32_t line, srch_job* job);
+u_int8_t
+editorMemEq(CONST_CHAR_PTR a, CONST_CHAR_PTR b, size_t len, u_int8_t icase);
+CONST_CHAR_PTR
+editorMemFind(CONST_CHAR_PTR hay, size_t hay_len, CONST_CHAR_PTR needle, size_t len, u_int8_t icase);
+void editorMatchAppend(srch_match** matches, size_t* count, size_t* cap, srch_match* match);
+void editorSearchSegment(srch_segment* seg, srch_job* job, re_matcher* matcher);
+PTR_T
+editorSearchWorker(PTR_T arg);
+void editorSearchCancel(void);
+void editorSearchInit(void);
+void editorSearchShutdown(void);
+void editorSearchAddSegment(CONST_CHAR_PTR text, size_t len, int32_t line, u_int8_t mapped);
+void editorSearchStart(void);
+size_t
+editorSearchLowerBound(int32_t line, int32_t col);
+void editorSearchJump(void);
+void editorSearchPickFirst(void);
+u_int8_t
+editorSearchPoll(void);
+void editorSearchFinish(void);
+void editorSearchRefine(CONST_CHAR_PTR query, size_t len);
+void editorSearchRun(CONST_CHAR_PTR query);
+void editorSearchReset(void);
+BYTE* editorSearchOverlay(edt_row* row, int32_t file_row);
 void editorFindCallback(CHAR_PTR query, int32_t key);
 void editorFind(void);
 void abAppend(struct abuf* ab, CONST_CHAR_PTR s, size_t len);
+void abReset(struct abuf* ab);
+int32_t
+abFlush(struct abuf* ab, int32_t fd);
 void abFree(struct abuf* ab);
+void editorScreenResize(int32_t rows, int32_t cols);
+void editorScreenFree(void);
+void editorScreenInvalidate(void);
+void editorScreenClear(void);
+void editorScreenPut(int32_t y, int32_t x, u_int32_t glyph, u_int8_t color, u_int8_t attr);
+int32_t
+editorScreenText(int32_t y, int32_t x, CONST_CHAR_PTR text, int32_t len, u_int8_t color, u_int8_t attr);
+void editorScreenPen(struct abuf* ab, scr_cell* pen, scr_cell* cell);
+void editorScreenFlush(struct abuf* ab);
 void editorRefreshScreen(void);
 CHAR_PTR
 editorPrompt(CHAR_PTR prompt, void (*callback)(CHAR_PTR, int32_t));
 void editorMoveCursor(int32_t key);
+void editorSnapCursor(void);
+void editorGotoLine(int32_t line);
+void editorGoto(void);
 void editorProcessKeypress(void);
 void editorScroll(void);
-void editorDrawRows(struct abuf* ab);
-void editorDrawStatusBar(struct abuf* ab);
-void editorDrawMsgBar(struct abuf* ab);
+void editorDrawRows(void);
+void editorDrawStatusBar(void);
+void editorDrawMsgBar(void);
+CONST_CHAR_PTR
+editorSearchStatus(void);
 void editorSetStatusMessage(CONST_CHAR_PTR fmt, ...);
+u_int64_t
+editorClockNs(void);
+void editorReplayLoad(CONST_CHAR_PTR path);
+ssize_t
+editorReplayWait(int32_t timeout);
+void editorReplaySettle(void);
+int32_t
+editorReplayOp(int32_t key);
+void editorReplayRecord(int32_t op, u_int64_t time);
+int32_t
+editorCompareU64(const void* a, const void* b);
+void editorReplayReport(void);
+void editorReplay(void);
+u_int64_t
+editorPerfEvent(int32_t event, u_int64_t start, u_int32_t arg);
+void editorPerfFrameEnd(void);
+void editorPerfTraceOpen(CONST_CHAR_PTR path);
+void editorPerfTraceClose(void);
+void editorDrawPerfHud(void);
+size_t
+editorBatchUnescape(CHAR_PTR dst, CONST_CHAR_PTR src, char delim, u_int8_t raw, CONST_CHAR_PTR* end);
+void editorBatchLoad(CONST_CHAR_PTR path);
+void editorBatchSearch(batch_cmd* cmd);
+CONST_CHAR_PTR
+editorBatchRun(batch_cmd* cmd);
+int32_t
+editorBatchFile(CHAR_PTR path);
+int32_t
+editorBatch(CHAR_PTR files[], int32_t count);
 
 void initEditor(void);
 